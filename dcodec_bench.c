@@ -0,0 +1,163 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Depth codec benchmark: compression ratio and encode/decode speed, with a lossless roundtrip check.
+	Build with make bench, run ./dcodec_bench [file]
+
+	Without a file, synthetic 160x60 frames are used: a floor plane, a wall, a box, a few mm of noise,
+	and invalid (zero) pixels along the edges and as speckle.
+	The file is raw depth frames, TOF_XS*TOF_YS uint16_t each (host byte order), e.g. a dump of
+	consecutive raw_depth images; the amplitude of file frames is not tested.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pulutof.h"
+#include "depthcodec.h"
+
+#define MAX_FRAMES 256
+#define N_SYNTH 32
+#define ROUNDS 50
+
+static double timestamp()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (double)spec.tv_sec + (double)spec.tv_nsec/1.0e9;
+}
+
+static uint16_t depth[MAX_FRAMES][TOF_XS*TOF_YS];
+static uint8_t ampl[MAX_FRAMES][TOF_XS*TOF_YS];
+
+static void gen_frame(int f)
+{
+	for(int y=0; y<TOF_YS; y++)
+	{
+		for(int x=0; x<TOF_XS; x++)
+		{
+			int d;
+			if(y > 35) // Floor: distance shrinks towards the bottom rows
+				d = 6000 / (y - 33);
+			else if(x > 100) // Wall at an angle
+				d = 1500 + (x-100)*12;
+			else
+				d = 2500;
+
+			if(x > 40 && x < 70 && y > 20 && y < 45) // Box
+				d = 900 + (x-40)*3;
+
+			d += rand()%7 - 3 + f; // Noise, and a slow drift between the frames
+
+			int invalid = (x < 3 || x >= TOF_XS-3 || y < 2 || (rand()%20 == 0));
+			depth[f][y*TOF_XS+x] = invalid ? 0 : d;
+			ampl[f][y*TOF_XS+x] = invalid ? 0 : (uint8_t)(200 - d/40 + rand()%5);
+		}
+	}
+}
+
+static int check_roundtrip(const void* img, int bpp, const uint8_t* enc, int len)
+{
+	uint8_t dec[2*TOF_XS*TOF_YS];
+	int b, xs, ys;
+	if(dcodec_decode(dec, sizeof dec, enc, len, &b, &xs, &ys) < 0 || b != bpp || xs != TOF_XS || ys != TOF_YS || memcmp(dec, img, bpp*xs*ys))
+		return -1;
+	return 0;
+}
+
+static void bench(const char* name, const void* imgs, int bpp, int n_frames)
+{
+	int img_bytes = bpp*TOF_XS*TOF_YS;
+	int max = dcodec_max_size(bpp, TOF_XS, TOF_YS);
+	uint8_t* enc = malloc((size_t)max*n_frames);
+	int* lens = malloc(n_frames*sizeof(int));
+	uint8_t dec[2*TOF_XS*TOF_YS];
+	long total = 0;
+
+	for(int f=0; f<n_frames; f++)
+	{
+		const uint8_t* img = (const uint8_t*)imgs + (size_t)f*img_bytes;
+		lens[f] = dcodec_encode(enc + (size_t)f*max, img, bpp, TOF_XS, TOF_YS);
+		total += lens[f];
+		if(check_roundtrip(img, bpp, enc + (size_t)f*max, lens[f]) < 0)
+		{
+			fprintf(stderr, "ERROR: %s frame %d doesn't decode back to the original\n", name, f);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	double t0 = timestamp();
+	for(int r=0; r<ROUNDS; r++)
+		for(int f=0; f<n_frames; f++)
+			dcodec_encode(enc + (size_t)f*max, (const uint8_t*)imgs + (size_t)f*img_bytes, bpp, TOF_XS, TOF_YS);
+	double t_enc = timestamp() - t0;
+
+	t0 = timestamp();
+	for(int r=0; r<ROUNDS; r++)
+		for(int f=0; f<n_frames; f++)
+			dcodec_decode(dec, sizeof dec, enc + (size_t)f*max, lens[f], NULL, NULL, NULL);
+	double t_dec = timestamp() - t0;
+
+	double n = (double)ROUNDS*n_frames;
+	double mb = n*img_bytes/1.0e6;
+	printf("%-10s %3d frames: %6d -> %6.0f bytes (ratio %.2f), encode %6.1f us %7.1f MB/s, decode %6.1f us %7.1f MB/s\n",
+		name, n_frames, img_bytes, (double)total/n_frames, (double)img_bytes*n_frames/total,
+		1.0e6*t_enc/n, mb/t_enc, 1.0e6*t_dec/n, mb/t_dec);
+
+	free(enc);
+	free(lens);
+}
+
+int main(int argc, char** argv)
+{
+	int n_frames = 0;
+
+	if(argc > 1)
+	{
+		FILE* f = fopen(argv[1], "rb");
+		if(!f)
+		{
+			fprintf(stderr, "ERROR: opening %s failed\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		while(n_frames < MAX_FRAMES && fread(depth[n_frames], sizeof depth[0], 1, f) == 1)
+			n_frames++;
+		fclose(f);
+		if(n_frames == 0)
+		{
+			fprintf(stderr, "ERROR: no full frames in %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		bench("depth", depth, 2, n_frames);
+		return 0;
+	}
+
+	srand(1);
+	for(int f=0; f<N_SYNTH; f++)
+		gen_frame(f);
+
+	bench("depth", depth, 2, N_SYNTH);
+	bench("amplitude", ampl, 1, N_SYNTH);
+	return 0;
+}
@@ -0,0 +1,313 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Lossless depth/amplitude image codec, see depthcodec.h
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "depthcodec.h"
+
+#define B DCODEC_BLOCK
+
+static int n_blocks(int xs, int ys)
+{
+	return (xs*ys + B-1) / B;
+}
+
+// Upper bound of the dcodec_encode() output size
+int dcodec_max_size(int bytes_per_pixel, int xs, int ys)
+{
+	int nb = n_blocks(xs, ys);
+	return DCODEC_HEADER_LEN + (nb+1)/2 + (nb+7)/8 + nb*(2 + B*2*bytes_per_pixel);
+}
+
+static inline int code_to_width(int code)
+{
+	return (code == 15) ? 16 : code;
+}
+
+static inline int width_to_code(int w)
+{
+	return (w >= 15) ? 15 : w;
+}
+
+static inline uint32_t get_px(const void* img, int bpp, int i)
+{
+	return (bpp == 2) ? ((const uint16_t*)img)[i] : ((const uint8_t*)img)[i];
+}
+
+static inline void set_px(void* img, int bpp, int i, uint32_t v)
+{
+	if(bpp == 2)
+		((uint16_t*)img)[i] = v;
+	else
+		((uint8_t*)img)[i] = v;
+}
+
+// Residual modulo 2^(8*bpp), zigzagged as a signed value of that size
+static inline uint16_t zigzag(uint32_t d, int bpp)
+{
+	if(bpp == 2)
+		return ((uint16_t)d << 1) ^ (uint16_t)((int16_t)d >> 15);
+	else
+		return (uint8_t)(((uint8_t)d << 1) ^ (uint8_t)((int8_t)d >> 7));
+}
+
+static inline uint32_t unzigzag(uint16_t v)
+{
+	return (v >> 1) ^ -(uint32_t)(v & 1);
+}
+
+/*
+	Predictor of pixel i (in the first row, up is 0; in the first column, left is 0)
+*/
+static inline uint32_t predict(const void* img, int bpp, int xs, int i)
+{
+	uint32_t up = (i >= xs) ? get_px(img, bpp, i-xs) : 0;
+	if(up)
+		return up;
+	return (i%xs) ? get_px(img, bpp, i-1) : 0;
+}
+
+/*
+	Zigzagged residuals of one block, and the bit mask of its zero (invalid) pixels.
+	Zero pixels and the pixels past the end of the image have a zero residual.
+*/
+static inline __attribute__((always_inline)) uint16_t block_residuals(uint16_t* r, const void* img, int bpp, int xs, int n, int start)
+{
+	int len = (start + B <= n) ? B : n - start;
+	uint16_t zero_mask = 0;
+
+	if(start >= xs && len == B && xs >= B)
+	{
+		// Vertical prediction first, for all the lanes (xs >= B: the decoder has the row above complete)
+		for(int k=0; k<B; k++)
+			r[k] = zigzag(get_px(img, bpp, start+k) - get_px(img, bpp, start+k-xs), bpp);
+
+		for(int k=0; k<B; k++)
+		{
+			uint32_t v = get_px(img, bpp, start+k), up = get_px(img, bpp, start+k-xs);
+			if(!v)
+			{
+				zero_mask |= 1<<k;
+				r[k] = 0;
+			}
+			else if(!up)
+				r[k] = zigzag(v - predict(img, bpp, xs, start+k), bpp);
+		}
+		return zero_mask;
+	}
+
+	for(int k=0; k<len; k++)
+	{
+		uint32_t v = get_px(img, bpp, start+k);
+		if(!v)
+		{
+			zero_mask |= 1<<k;
+			r[k] = 0;
+		}
+		else
+			r[k] = zigzag(v - predict(img, bpp, xs, start+k), bpp);
+	}
+	for(int k=len; k<B; k++)
+		r[k] = 0;
+
+	return zero_mask;
+}
+
+static inline __attribute__((always_inline)) int encode(uint8_t* out, const void* img, int bpp, int xs, int ys)
+{
+	int n = xs*ys;
+	int nb = n_blocks(xs, ys);
+
+	out[0] = bpp;
+	out[1] = xs&0xff; out[2] = xs>>8;
+	out[3] = ys&0xff; out[4] = ys>>8;
+
+	uint8_t* widths = out + DCODEC_HEADER_LEN;
+	uint8_t* masked = widths + (nb+1)/2;
+	memset(widths, 0, (nb+1)/2 + (nb+7)/8);
+	uint8_t* p = masked + (nb+7)/8;
+
+	for(int b=0; b<nb; b++)
+	{
+		uint16_t r[B];
+		uint16_t zero_mask = block_residuals(r, img, bpp, xs, n, b*B);
+
+		uint16_t all = 0;
+		for(int k=0; k<B; k++)
+			all |= r[k];
+
+		int w = 0;
+		while(all >> w)
+			w++;
+		int code = width_to_code(w);
+		w = code_to_width(code);
+		widths[b/2] |= code << ((b&1)*4);
+
+		if(zero_mask)
+		{
+			masked[b/8] |= 1<<(b&7);
+			*p++ = zero_mask&0xff;
+			*p++ = zero_mask>>8;
+		}
+
+		// B*w bits = 2*w bytes
+		uint64_t acc = 0;
+		int bits = 0;
+		for(int k=0; k<B; k++)
+		{
+			acc |= (uint64_t)r[k] << bits;
+			bits += w;
+			while(bits >= 8)
+			{
+				*p++ = acc;
+				acc >>= 8;
+				bits -= 8;
+			}
+		}
+	}
+
+	return p - out;
+}
+
+/*
+	Encodes the image to out, which must have room for dcodec_max_size() bytes.
+	Returns the encoded length, or -1 on invalid parameters.
+*/
+int dcodec_encode(uint8_t* out, const void* img, int bytes_per_pixel, int xs, int ys)
+{
+	if(xs < 1 || ys < 1 || xs > 65535 || ys > 65535 || (bytes_per_pixel != 1 && bytes_per_pixel != 2))
+	{
+		fprintf(stderr, "ERROR: dcodec_encode: invalid params\n");
+		return -1;
+	}
+
+	// Separate instances for the two pixel sizes, so that the inner loops don't branch on it
+	if(bytes_per_pixel == 2)
+		return encode(out, img, 2, xs, ys);
+	else
+		return encode(out, img, 1, xs, ys);
+}
+
+static inline __attribute__((always_inline)) int decode(void* img, const uint8_t* in, const uint8_t* end, int bpp, int xs, int ys)
+{
+	int n = xs*ys;
+	int nb = n_blocks(xs, ys);
+	const uint8_t* widths = in + DCODEC_HEADER_LEN;
+	const uint8_t* masked = widths + (nb+1)/2;
+	const uint8_t* p = masked + (nb+7)/8;
+	if(p > end)
+		return -1;
+
+	for(int b=0; b<nb; b++)
+	{
+		int w = code_to_width((widths[b/2] >> ((b&1)*4)) & 15);
+		uint16_t zero_mask = 0;
+		if(masked[b/8] & (1<<(b&7)))
+		{
+			if(p + 2 > end)
+				return -1;
+			zero_mask = p[0] | (p[1]<<8);
+			p += 2;
+		}
+		if(p + 2*w > end || w > 8*bpp)
+			return -1;
+
+		uint16_t r[B];
+		uint64_t acc = 0;
+		int bits = 0;
+		uint16_t wmask = (w == 16) ? 0xffff : (1<<w)-1;
+		for(int k=0; k<B; k++)
+		{
+			while(bits < w)
+			{
+				acc |= (uint64_t)*p++ << bits;
+				bits += 8;
+			}
+			r[k] = acc & wmask;
+			acc >>= w;
+			bits -= w;
+		}
+
+		int start = b*B;
+		int len = (start + B <= n) ? B : n - start;
+
+		if(start >= xs && len == B && xs >= B)
+		{
+			// Vertical prediction for all the lanes (xs >= B: the row above is complete), then fix
+			// the zero pixels and the ones without a valid pixel above, in order
+			for(int k=0; k<B; k++)
+				set_px(img, bpp, start+k, get_px(img, bpp, start+k-xs) + unzigzag(r[k]));
+
+			for(int k=0; k<B; k++)
+			{
+				if(zero_mask & (1<<k))
+					set_px(img, bpp, start+k, 0);
+				else if(!get_px(img, bpp, start+k-xs))
+					set_px(img, bpp, start+k, predict(img, bpp, xs, start+k) + unzigzag(r[k]));
+			}
+		}
+		else
+		{
+			for(int k=0; k<len; k++)
+			{
+				if(zero_mask & (1<<k))
+					set_px(img, bpp, start+k, 0);
+				else
+					set_px(img, bpp, start+k, predict(img, bpp, xs, start+k) + unzigzag(r[k]));
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Decodes to img, which has room for max_img_bytes. The image parameters are returned in the pointers.
+	Returns 0 on success, -1 on a corrupted or truncated stream or if img is too small.
+*/
+int dcodec_decode(void* img, int max_img_bytes, const uint8_t* in, int in_len, int* bytes_per_pixel, int* xs, int* ys)
+{
+	if(in_len < DCODEC_HEADER_LEN)
+		return -1;
+
+	int bpp = in[0];
+	int x = in[1] | (in[2]<<8);
+	int y = in[3] | (in[4]<<8);
+	if((bpp != 1 && bpp != 2) || x < 1 || y < 1 || x*y*bpp > max_img_bytes)
+		return -1;
+
+	int ret;
+	if(bpp == 2)
+		ret = decode(img, in, in + in_len, 2, x, y);
+	else
+		ret = decode(img, in, in + in_len, 1, x, y);
+	if(ret < 0)
+		return -1;
+
+	if(bytes_per_pixel) *bytes_per_pixel = bpp;
+	if(xs) *xs = x;
+	if(ys) *ys = y;
+	return 0;
+}
@@ -0,0 +1,56 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Lossless codec for depth (uint16_t) and amplitude (uint8_t) images.
+
+	Zero pixels are invalid in both images; they are coded as a bit mask per block, and otherwise ignored.
+	A valid pixel is predicted from the pixel above it, or when that's invalid (or in the first row),
+	from the pixel on the left (0 in the first column). The residual, modulo 2^(8*bytes_per_pixel), is zigzag
+	coded so that small negative and positive values are both small, and the residuals are bit-packed in blocks
+	of DCODEC_BLOCK pixels, each block with the bit width of its largest residual. Smooth surfaces come
+	out as narrow blocks; a block of only invalid pixels, or of a constant row, takes no data at all.
+
+	With the vertical predictor, the prediction of a whole block is one contiguous load from the previous
+	row, so both directions vectorize for the valid pixels; the few others are fixed up one by one.
+
+	Encoded stream (multi-byte fields little endian):
+		uint8_t  bytes_per_pixel (1 or 2)
+		uint16_t xs, ys
+		uint8_t  widths[(n_blocks+1)/2]   4-bit bit width code of each block, low nibble first
+		                                   (code 15 = 16 bits; for 1 byte pixels, at most 8)
+		uint8_t  masked[(n_blocks+7)/8]   Bit per block, LSB first: the block has invalid pixels
+		per block:
+		  uint16_t zero_mask             Only if masked: bit k set = pixel k of the block is 0
+		  packed residuals               DCODEC_BLOCK*width bits, LSB first (always whole bytes)
+	The last block is padded with zero residuals.
+*/
+
+#ifndef DEPTHCODEC_H
+#define DEPTHCODEC_H
+
+#include <stdint.h>
+
+#define DCODEC_BLOCK 16
+#define DCODEC_HEADER_LEN 5
+
+int dcodec_max_size(int bytes_per_pixel, int xs, int ys);
+int dcodec_encode(uint8_t* out, const void* img, int bytes_per_pixel, int xs, int ys);
+int dcodec_decode(void* img, int max_img_bytes, const uint8_t* in, int in_len, int* bytes_per_pixel, int* xs, int* ys);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+
+	Pipeline latency stamps and histograms, see latency.h
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+uint64_t lat_now_ns()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (uint64_t)spec.tv_sec*1000000000ULL + spec.tv_nsec;
+}
+
+/*
+	Below 4 us, a bucket per us. Above, octave e (2^e <= us < 2^(e+1)) is split in four by the two bits
+	below the leading one.
+*/
+static int bucket_of(uint32_t us)
+{
+	if(us < 4)
+		return us;
+
+	int e = 31 - __builtin_clz(us);
+	int b = 4*(e-1) + ((us >> (e-2)) & 3);
+	return (b < LAT_N_BUCKETS) ? b : LAT_N_BUCKETS-1;
+}
+
+// Exclusive upper bound of the bucket, in us
+static uint32_t bucket_limit(int b)
+{
+	if(b < 4)
+		return b+1;
+
+	int e = b/4 + 1;
+	return (uint32_t)(4 + b%4 + 1) << (e-2);
+}
+
+void lat_hist_add(lat_hist_t* h, uint64_t t0_ns, uint64_t t1_ns)
+{
+	if(!t0_ns || !t1_ns)
+		return;
+
+	uint64_t d = (t1_ns > t0_ns) ? (t1_ns - t0_ns)/1000 : 0;
+	uint32_t us = (d > UINT32_MAX) ? UINT32_MAX : d;
+
+	h->n++;
+	h->sum_us += us;
+	if(us > h->max_us)
+		h->max_us = us;
+	h->buckets[bucket_of(us)]++;
+}
+
+uint32_t lat_hist_percentile(const lat_hist_t* h, int pct)
+{
+	if(!h->n)
+		return 0;
+
+	uint64_t target = (h->n*pct + 99)/100;
+	uint64_t cum = 0;
+	for(int b=0; b<LAT_N_BUCKETS-1; b++)
+	{
+		cum += h->buckets[b];
+		if(cum >= target)
+			return (bucket_limit(b) < h->max_us) ? bucket_limit(b) : h->max_us;
+	}
+	return h->max_us;
+}
+
+void lat_hist_print_header()
+{
+	fprintf(stderr, "stage                    count      mean us   p50 us    p90 us    p99 us    max us\n");
+}
+
+void lat_hist_print(const lat_hist_t* h)
+{
+	fprintf(stderr, "%-23s  %-9llu  %-8.0f  %-8u  %-8u  %-8u  %u\n", h->name, (unsigned long long)h->n,
+		h->n ? (double)h->sum_us/h->n : 0.0,
+		lat_hist_percentile(h, 50), lat_hist_percentile(h, 90), lat_hist_percentile(h, 99), h->max_us);
+}
+
+// Keeps the name
+void lat_hist_reset(lat_hist_t* h)
+{
+	const char* name = h->name;
+	memset(h, 0, sizeof *h);
+	h->name = name;
+}
@@ -0,0 +1,56 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+
+	Pipeline latency tracing.
+
+	Stamps are CLOCK_MONOTONIC of the host in ns (lat_now_ns()); 0 means "not stamped". A frame is stamped when
+	it's been read from SPI and when distances_to_objmap() is done with it, a scan when it's published and when the
+	consumer picks it up (tof3d_stamps_t in pulutof.h), and a TCP message when it's built and when its last byte
+	has been written to a client's socket (see tcp_comm.h).
+
+	lat_hist_t collects the latencies of one stage. The buckets are logarithmic, four per octave of microseconds,
+	so the percentiles are within 25 %. Not thread safe: each histogram is for one thread.
+*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+#define LAT_N_BUCKETS 100 // Up to 2^26 us (67 s); the last bucket takes the rest
+
+typedef struct
+{
+	const char* name;
+	uint64_t n;
+	uint64_t sum_us;
+	uint32_t max_us;
+	uint32_t buckets[LAT_N_BUCKETS];
+} lat_hist_t;
+
+uint64_t lat_now_ns();
+
+void lat_hist_add(lat_hist_t* h, uint64_t t0_ns, uint64_t t1_ns); // Ignored unless both are stamped
+uint32_t lat_hist_percentile(const lat_hist_t* h, int pct);       // us, upper bound of the bucket
+void lat_hist_print(const lat_hist_t* h);
+void lat_hist_print_header();
+void lat_hist_reset(lat_hist_t* h);
+
+#endif
@@ -26,7 +26,6 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/time.h>
-#include <sys/select.h>
 #include <errno.h>
 #include <math.h>
 #include <sys/types.h>
@@ -41,58 +40,135 @@
 #include "tcp_parser.h"
 
 #include "pulutof.h"
+#include "pcio.h"
+#include "recorder.h"
+#include "shmpub.h"
+#include "latency.h"
 
-volatile int verbose_mode = 0;
-volatile int send_raw_tof = -1;
-volatile int send_pointcloud = 0; // 0 = off, -1 = relative to origin to stdout, 1 = relative to robot to files, 2 = relative to actual world coords to files
+#ifndef SPI_DEV
+#define SPI_DEV "/dev/spidev0.0"
+#endif
 
-double subsec_timestamp()
-{
-	struct timespec spec;
-	clock_gettime(CLOCK_MONOTONIC, &spec);
+static pulutof_ctx_t* tof;
+static pulutof_settings_t* cfg; // send_pointcloud: 0 = off, -1 = relative to origin to stdout, 1 = relative to robot to files, 2 = relative to actual world coords to files
 
-	return (double)spec.tv_sec + (double)spec.tv_nsec/1.0e9;
-}
+volatile int send_packed_hmap = 0; // 0 = TCP_RC_HMAP_MID, 1 = TCP_RC_HMAP_PACKED_MID
+const char* unix_sock_path = TCP_DEFAULT_UNIX_PATH; // Clients can also connect here, in addition to TCP
+
+
+int pc_format = PCIO_XYZ; // See pcio.h
+int pc_columns = 0;       // PCIO_COL_* bits
+const char* pc_dir = "."; // Where save_pointcloud() writes the segment files
+long long pc_max_bytes = 0; // Disk usage cap of the saved pointclouds, 0 = none
+
+// Pointclouds are written by recorder threads (see recorder.h), so that a slow SD card or pipe doesn't stall TCP.
+recorder_t* pc_file_rec = NULL;
+recorder_t* pc_stdout_rec = NULL;
+recorder_t* capture_rec = NULL;
+
+shmpub_t* shm_pub = NULL; // Scans published to local readers in shared memory, see shmpub.h
 
+int capture_raw = 0; // Record the raw depth and amplitude images (raw tof sensor) to pc_dir
+int compress_raw = 0; // Compress raw images (captures and TCP pictures) with depthcodec.h
 
-void save_pointcloud(int n_points, xyz_t* cloud)
+void save_pointcloud(tof3d_scan_t* scan)
 {
-	static int pc_cnt = 0;
-	char fname[256];
-	snprintf(fname, 255, "cloud%05d.xyz", pc_cnt);
-	fprintf(stderr, "Saving pointcloud with %d samples to file %s.\n", n_points, fname);
-	FILE* pc_csv = fopen(fname, "w");
-	if(!pc_csv)
+	if(!pc_file_rec)
 	{
-	   fprintf(stderr, "Error opening file for write.\n");
+		recorder_cfg_t rc = {.dir = pc_dir, .fd = -1, .format = pc_format, .columns = pc_columns, .max_total_bytes = pc_max_bytes};
+		if(!(pc_file_rec = recorder_start(&rc)))
+			return;
+		fprintf(stderr, "INFO: Saving pointclouds to %s/cloud_*.%s\n", pc_dir, pcio_file_ext(pc_format));
 	}
-	else
-	{
-		for(int i=0; i < n_points; i++)
-		{
-			fprintf(pc_csv, "%d %d %d\n",cloud[i].x, -1*cloud[i].y, cloud[i].z);
-		}
-		fclose(pc_csv);
-	}
-
-	pc_cnt++;
-	if(pc_cnt > 99999) pc_cnt = 0;
+	recorder_submit(pc_file_rec, scan);
 }
 
 
-void print_pointcloud(int n_points, xyz_t* cloud)
+void print_pointcloud(tof3d_scan_t* scan)
 {
-   for (int i = 0; i < n_points; i++) {
-      printf("%d %d %d\n",cloud[i].x, -1*cloud[i].y, cloud[i].z);
-   } // for
+   if (!pc_stdout_rec) {
+      recorder_cfg_t rc = {.dir = NULL, .fd = STDOUT_FILENO, .format = pc_format, .columns = pc_columns};
+      fflush(stdout);
+      if (!(pc_stdout_rec = recorder_start(&rc)))
+	 return;
+   } // if
+   recorder_submit(pc_stdout_rec, scan);
    
 } // print_pointcloud
 
 
-void request_tof_quit(void);
+void save_capture(tof3d_scan_t* scan)
+{
+	if(!capture_rec)
+	{
+		recorder_cfg_t rc = {.dir = pc_dir, .fd = -1, .format = RECORDER_CAPTURE, .compress = compress_raw, .max_total_bytes = pc_max_bytes};
+		if(!(capture_rec = recorder_start(&rc)))
+			return;
+		fprintf(stderr, "INFO: Capturing raw images to %s/capture_*.tofcap%s\n", pc_dir, compress_raw ? " (compressed)" : "");
+	}
+	recorder_submit(capture_rec, scan);
+}
+
+
+void stop_recorder(recorder_t* rec, const char* name)
+{
+	if(!rec)
+		return;
+
+	recorder_stats_t st;
+	recorder_get_stats(rec, &st);
+	recorder_stop(rec); // Writes out the queued scans first
+	fprintf(stderr, "INFO: %s: %llu submitted, %llu written (%llu bytes), %llu dropped, %llu failed, %llu old segments deleted\n",
+		name, (unsigned long long)st.submitted, (unsigned long long)st.written, (unsigned long long)st.bytes,
+		(unsigned long long)st.dropped, (unsigned long long)st.failed, (unsigned long long)st.segments_deleted);
+}
+
 
 volatile int retval = 0;
 
+/*
+	Device commands are applied by the poll thread in the background (see pulutof_command()). The pending ones
+	are checked on every round of the main loop, to tell how they went.
+*/
+#define MAX_PENDING_CMDS 16
+static struct { int handle; const char* what; } pending_cmds[MAX_PENDING_CMDS];
+
+static void device_command(enum pulutof_commands command, int parameter, const char* what)
+{
+	int handle = pulutof_command(tof, command, parameter);
+	if(handle < 0)
+		return;
+
+	for(int i=0; i<MAX_PENDING_CMDS; i++)
+	{
+		if(!pending_cmds[i].handle)
+		{
+			pending_cmds[i].handle = handle;
+			pending_cmds[i].what = what;
+			return;
+		}
+	}
+}
+
+static void check_device_commands()
+{
+	for(int i=0; i<MAX_PENDING_CMDS; i++)
+	{
+		if(!pending_cmds[i].handle)
+			continue;
+
+		int state = pulutof_command_state(tof, pending_cmds[i].handle);
+		if(state == PULUTOF_CMD_QUEUED || state == PULUTOF_CMD_ACTIVE)
+			continue;
+
+		if(state == PULUTOF_CMD_DONE)
+			fprintf(stderr, "INFO: %s done\n", pending_cmds[i].what);
+		else
+			fprintf(stderr, "ERROR: %s failed\n", pending_cmds[i].what);
+		pending_cmds[i].handle = 0;
+	}
+}
+
 
 void pulutof_set_exposure(int exposure_base)
 {
@@ -103,7 +179,7 @@ void pulutof_set_exposure(int exposure_base)
       fprintf(stderr, "ERROR: trying to set exposure base time too small (%d us), set to minimun (10 us)\n", exposure_base);
    } // if-else
 
-   pulutof_command(PULUTOF_COMMAND_EXPOSURE, exposure_base);
+   device_command(PULUTOF_COMMAND_EXPOSURE, exposure_base, "Exposure base time");
    
 } // pulutof_set_exposure
 
@@ -118,48 +194,184 @@ void pulutof_set_hdr_multiplier(int hdr_multiplier)
       hdr_multiplier = 2;
    } // if-else
 
-   pulutof_command(PULUTOF_COMMAND_HDR_MULTIPLIER, hdr_multiplier);
+   device_command(PULUTOF_COMMAND_HDR_MULTIPLIER, hdr_multiplier, "Hdr-multiplier");
 
 } // pulutof_set_exposure
 
 
-void* main_thread()
+volatile int quit = 0;
+
+/*
+	TCP messages reference the hmaps and pictures in the scan instead of copying them, and keep the scan pinned
+	until they're written out. A stalled client could pin the whole ring, so past MAX_PINNED_SCANS they're copied.
+*/
+#define MAX_PINNED_SCANS 8 // Of the 32 in the ring
+static int n_pinned_scans;
+
+static void scan_hold(void* scan)
 {
-   char buffer[80];
+	if(pulutof_pin_scan(tof, scan) == 1)
+		n_pinned_scans++;
+}
 
-	if(init_tcp_comm())
+static void scan_release(void* scan)
+{
+	if(pulutof_unpin_scan(tof, scan) == 0)
+		n_pinned_scans--;
+}
+
+/*
+	What the command line (and stdin) enable; subscribed clients can enable more, see update_generation().
+*/
+static int base_elevmap, base_objlist, base_raw_tof, base_pointcloud, base_organized;
+
+// Makes the processing thread generate what the command line or any subscribed client wants
+static void update_generation()
+{
+	int elevmap = base_elevmap, objlist = base_objlist, raw_tof = base_raw_tof, pointcloud = base_pointcloud, organized = base_organized;
+
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
 	{
-		fprintf(stderr, "TCP communication initialization failed.\n");
-		return NULL;
+		tcp_client_t* cl = &tcp_clients[i];
+		if(cl->fd < 0 || !cl->subscribed)
+			continue;
+		if(cl->sub.types & (1<<TCP_SUB_ELEVMAP)) elevmap = 1;
+		if(cl->sub.types & (1<<TCP_SUB_OBJLIST)) objlist = 1;
+		if(cl->sub.types & (1<<TCP_SUB_POINTCLOUD))
+		{
+			if(cl->sub.flags & TCP_SUB_FLAG_PC_ORGANIZED)
+				organized = 1;
+			else if(!pointcloud)
+				pointcloud = 1; // Relative to robot
+		}
+		if((cl->sub.types & (1<<TCP_SUB_DEPTH)) && raw_tof < 0 && (cl->sub.sensors & 0x0f))
+			raw_tof = __builtin_ctz(cl->sub.sensors);
 	}
 
-	while(1)
+	if(cfg->send_elevmap != elevmap) cfg->send_elevmap = elevmap;
+	if(cfg->send_objlist != objlist) cfg->send_objlist = objlist;
+	if(cfg->send_raw_tof != raw_tof) cfg->send_raw_tof = raw_tof;
+	if(cfg->send_pointcloud != pointcloud) cfg->send_pointcloud = pointcloud;
+	if(cfg->send_organized != organized) cfg->send_organized = organized;
+}
+
+// Clients without a subscription: they get the pictures selected with -r and z/x
+static uint32_t unsubscribed_clients()
+{
+	uint32_t mask = 0;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
 	{
-		// Calculate fd_set size (biggest fd+1)
-		int fds_size = 0;
-		if(tcp_listener_sock > fds_size) fds_size = tcp_listener_sock;
-		if(tcp_client_sock > fds_size) fds_size = tcp_client_sock;
+		if(tcp_clients[i].fd >= 0 && !tcp_clients[i].subscribed)
+			mask |= 1U<<i;
+	}
+	return mask;
+}
 
-		if(STDIN_FILENO > fds_size) fds_size = STDIN_FILENO;
-		fds_size+=1;
+/*
+	Stage latencies of the scans picked up here (see latency.h); i on stdin prints them and starts over.
+	The TCP ones are measured in tcp_comm.c.
+*/
+static lat_hist_t lat_frame = {.name = "spi -> processed"};      // Per frame
+static lat_hist_t lat_assembly = {.name = "processed -> published"}; // Last frame of the scan
+static lat_hist_t lat_handoff = {.name = "published -> main"};
+static lat_hist_t lat_scan = {.name = "spi -> main"};            // First frame of the scan
+static lat_hist_t* lat_hists[] = {&lat_frame, &lat_assembly, &lat_handoff, &lat_scan, &tcp_lat_queue, &tcp_lat_e2e};
+
+// Stamps the scan consumed and records its latencies. Returns the stamp of its first frame.
+static uint64_t trace_scan(tof3d_scan_t* scan)
+{
+	tof3d_stamps_t* st = &scan->stamps;
+	st->consumed = lat_now_ns();
 
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(STDIN_FILENO, &fds);
-		FD_SET(tcp_listener_sock, &fds);
-		if(tcp_client_sock >= 0)
-			FD_SET(tcp_client_sock, &fds);
+	uint64_t first = 0, last = 0;
+	for(int i=0; i<4; i++)
+	{
+		if(!st->spi[i])
+			continue;
+		lat_hist_add(&lat_frame, st->spi[i], st->processed[i]);
+		if(!first || st->spi[i] < first) first = st->spi[i];
+		if(st->processed[i] > last) last = st->processed[i];
+	}
+	lat_hist_add(&lat_assembly, last, st->published);
+	lat_hist_add(&lat_handoff, st->published, st->consumed);
+	lat_hist_add(&lat_scan, first, st->consumed);
+	return first;
+}
 
-		struct timeval select_time = {0, 200};
+static void print_latency()
+{
+	lat_hist_print_header();
+	for(int i=0; i<sizeof lat_hists/sizeof lat_hists[0]; i++)
+	{
+		lat_hist_print(lat_hists[i]);
+		lat_hist_reset(lat_hists[i]);
+	}
+}
 
-		if(select(fds_size, &fds, NULL, NULL, &select_time) < 0)
+// Messages from the clients
+void tcp_rx(tcp_client_t* cl, int mid)
+{
+	if(mid == TCP_CR_MAINTENANCE_MID)
+	{
+		if(msg_cr_maintenance.magic == 0x12345678)
 		{
-			fprintf(stderr, "select() error %d", errno);
-			return NULL;
+			retval = msg_cr_maintenance.retval;
+			quit = 1;
+		}
+		else
+		{
+		        fprintf(stderr, "WARN: Illegal maintenance message magic number 0x%08x.\n", msg_cr_maintenance.magic);
+		}
+	}
+	else if(mid == TCP_CR_HMAP_LEVEL_MID)
+	{
+		if(msg_cr_hmap_level.level <= OBJMAP_PYRAMID_LEVELS)
+		{
+			cl->hmap_level = msg_cr_hmap_level.level;
+			fprintf(stderr, "INFO: Client subscribed to hmap level %d\n", cl->hmap_level);
+		}
+		else
+		{
+			fprintf(stderr, "WARN: Illegal hmap level %d requested.\n", msg_cr_hmap_level.level);
 		}
+	}
+	else if(mid == TCP_CR_SUBSCRIBE_MID)
+	{
+		cl->sub = msg_cr_subscribe;
+		cl->snapshot_types = cl->sub.snapshot ? cl->sub.types : 0;
+		cl->subscribed = 1;
+		fprintf(stderr, "INFO: Client subscribed to types 0x%02x of sensors 0x%02x, dividers %d %d %d %d %d %d %d%s\n",
+			cl->sub.types, cl->sub.sensors, cl->sub.div[0], cl->sub.div[1], cl->sub.div[2], cl->sub.div[3], cl->sub.div[4], cl->sub.div[5], cl->sub.div[6],
+			cl->sub.snapshot ? ", snapshot" : "");
+	}
+}
 
-		
-		if(FD_ISSET(STDIN_FILENO, &fds))
+void* main_thread()
+{
+   char buffer[80];
+
+	base_elevmap = cfg->send_elevmap;
+	base_objlist = cfg->send_objlist;
+	base_organized = cfg->send_organized;
+	base_raw_tof = cfg->send_raw_tof;
+	base_pointcloud = cfg->send_pointcloud;
+	uint32_t scan_cnt = 0;
+
+	if(init_tcp_comm(unix_sock_path, tcp_rx))
+	{
+		fprintf(stderr, "TCP communication initialization failed.\n");
+		return NULL;
+	}
+
+	while(!quit)
+	{
+		int stdin_ready = tcp_comm_poll(1, STDIN_FILENO);
+		if(stdin_ready < 0)
+			return NULL;
+
+		check_device_commands();
+
+		if(stdin_ready)
 		{
 			fgets(buffer, sizeof(buffer), stdin);
 
@@ -172,41 +384,91 @@ void* main_thread()
 			}
 			if(cmd == 'z')
 			{
-				if(send_raw_tof >= 0) send_raw_tof--;
-				fprintf(stderr, "INFO: Sending raw tof from sensor %d\n", send_raw_tof);
+				if(base_raw_tof >= 0) base_raw_tof--;
+				fprintf(stderr, "INFO: Sending raw tof from sensor %d\n", base_raw_tof);
 			}
 			if(cmd == 'x')
 			{
-				if(send_raw_tof < 3) send_raw_tof++;
-				fprintf(stderr, "INFO: Sending raw tof from sensor %d\n", send_raw_tof);
+				if(base_raw_tof < 3) base_raw_tof++;
+				fprintf(stderr, "INFO: Sending raw tof from sensor %d\n", base_raw_tof);
 			}
 			if(cmd >= '0' && cmd <= '3')
 			{
 			   fprintf(stderr, "Requesting offset calib\n");
-			   pulutof_command(PULUTOF_COMMAND_CALIBRATE_OFFSET, cmd - '0');
+			   device_command(PULUTOF_COMMAND_CALIBRATE_OFFSET, cmd - '0', "Offset calibration");
+			}
+			if(cmd == 'k')
+			{
+				send_packed_hmap = send_packed_hmap?0:1;
+				fprintf(stderr, "INFO: Sending %s hmaps\n", send_packed_hmap?"packed":"unpacked");
+			}
+			if(cmd == 'l')
+			{
+				base_elevmap = base_elevmap?0:1;
+				fprintf(stderr, "INFO: Elevation map %s\n", base_elevmap?"on":"off");
+			}
+			if(cmd == 't')
+			{
+				int tf = 0;
+				if(buffer[1] == 'm')
+					tf = -1;
+				else
+					sscanf(buffer+1, "%d", &tf);
+				cfg->temporal_filter = tf;
+				fprintf(stderr, "INFO: Temporal filter %d (0 = off, -1 = median of 3, n = mean of n)\n", tf);
+			}
+			if(cmd == 'b')
+			{
+				int budget = 0;
+				sscanf(buffer+1, "%d", &budget);
+				cfg->proc_budget_us = budget;
+				fprintf(stderr, "INFO: Processing time budget %d us per frame (0 = off)\n", budget);
+			}
+			if(cmd == 'f')
+			{
+				cfg->floor_estimation = cfg->floor_estimation?0:1;
+				fprintf(stderr, "INFO: Floor plane estimation %s\n", cfg->floor_estimation?"on":"off");
+			}
+			if(cmd == 'n')
+			{
+				base_organized = base_organized?0:1;
+				fprintf(stderr, "INFO: Organized point clouds with normals %s\n", base_organized?"on":"off");
+			}
+			if(cmd == 'o')
+			{
+				base_objlist = base_objlist?0:1;
+				fprintf(stderr, "INFO: Obstacle list %s\n", base_objlist?"on":"off");
+			}
+			if(cmd == 'c')
+			{
+				tcp_print_client_stats();
+			}
+			if(cmd == 'i')
+			{
+				print_latency();
 			}
 			if(cmd == 'v')
 			{
-				verbose_mode = verbose_mode?0:1;
+				cfg->verbose = cfg->verbose?0:1;
 			}
 			if(cmd == 'p')
 			{
-				if (send_pointcloud == 0) {
+				if (base_pointcloud == 0) {
 				   fprintf(stderr, "INFO: Will send pointclouds relative to robot origin\n");
-				   send_pointcloud = 1;
-				} else if (send_pointcloud == 1) {
+				   base_pointcloud = 1;
+				} else if (base_pointcloud == 1) {
 				   fprintf(stderr, "INFO: Will send pointclouds relative to world origin\n");
-				   send_pointcloud = 2;
+				   base_pointcloud = 2;
 				} else {
 				   fprintf(stderr, "INFO: Will stop sending pointclouds\n");
-				   send_pointcloud = 0;
+				   base_pointcloud = 0;
 				} // if-else
 			} // if
 			if (cmd == 'm')
 			{
 			   sscanf(buffer+1, "%d", &cmd);
 			   fprintf(stderr, "INFO: Set midlier remove filter %s\n", ((cmd==0)?"OFF":"ON"));
-			   pulutof_command(PULUTOF_COMMAND_MIDLIER_FILTER, cmd != 0);
+			   device_command(PULUTOF_COMMAND_MIDLIER_FILTER, cmd != 0, "Midlier filter");
 			} //if
 			if (cmd == 'e')
 			{
@@ -227,60 +489,151 @@ void* main_thread()
 
 
 
-		if(tcp_client_sock >= 0 && FD_ISSET(tcp_client_sock, &fds))
+		tof3d_scan_t *p_tof;
+		
+		if( (p_tof = get_tof3d(tof)) )
 		{
-			int ret = handle_tcp_client();
-			if(ret == TCP_CR_MAINTENANCE_MID)
+			scan_cnt++;
+			uint64_t first_spi = trace_scan(p_tof);
+			update_generation();
+			tcp_clients_assess();
+
+		   	if (base_pointcloud > 0) {
+			   save_pointcloud(p_tof);
+			} else if (base_pointcloud < 0) {
+			   print_pointcloud(p_tof);
+			} // if else
+
+			if(capture_raw)
+				save_capture(p_tof);
+
+			if(shm_pub)
+				shmpub_publish(shm_pub, p_tof);
+
+			if(tcp_n_clients > 0)
 			{
-				if(msg_cr_maintenance.magic == 0x12345678)
+				tcp_payload_owner_t scan_owner = {scan_hold, scan_release, p_tof};
+				tcp_payload_owner = (n_pinned_scans < MAX_PINNED_SCANS) ? &scan_owner : NULL;
+				tcp_msg_origin_ns = first_spi;
+
+				if( (tcp_dest_mask = tcp_clients_with_sub_flags(TCP_SUB_FLAG_TIMING, TCP_SUB_FLAG_TIMING)) )
+					tcp_send_timing(scan_cnt, p_tof->sensor_mask, &p_tof->stamps);
+
+				// Each message is serialized once, for all the clients it's due for. A snapshot of a type is done
+				// for the clients it was actually queued to (tcp_sent_acc), the others get it with a later scan.
+				tcp_sent_acc = 0;
+				if(p_tof->objects_valid && (tcp_dest_mask = tcp_clients_due(TCP_SUB_OBJLIST, scan_cnt, -1)))
+					tcp_send_objlist(p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->n_objects, p_tof->objects);
+				tcp_clients_sent(TCP_SUB_OBJLIST, tcp_sent_acc);
+
+				tcp_sent_acc = 0;
+				uint32_t hmap_mask = tcp_clients_due(TCP_SUB_HMAP, scan_cnt, -1);
+				if( (tcp_dest_mask = hmap_mask & tcp_clients_with_hmap_level(0)) )
 				{
-					retval = msg_cr_maintenance.retval;
-					break;
+					if(send_packed_hmap)
+						tcp_send_hmap_packed(p_tof->grid.xs, p_tof->grid.ys, p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->grid.spot_size,
+							OBJMAP_TILE, p_tof->objmap_packed.data, p_tof->objmap_packed.n_bytes);
+					else
+						tcp_send_hmap(p_tof->grid.xs, p_tof->grid.ys, p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->grid.spot_size, p_tof->objmap);
 				}
-				else
+				for(int level=1; level<=OBJMAP_PYRAMID_LEVELS; level++)
 				{
-				        fprintf(stderr, "WARN: Illegal maintenance message magic number 0x%08x.\n", msg_cr_maintenance.magic);
+					if( (tcp_dest_mask = hmap_mask & tcp_clients_with_hmap_level(level)) )
+						tcp_send_hmap_level(level, p_tof->objmap_pyramid.xs[level], p_tof->objmap_pyramid.ys[level],
+							p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->grid.spot_size<<level,
+							objmap_pyramid_level(&p_tof->objmap_pyramid, level));
 				}
-			}		
-		}
+				tcp_clients_sent(TCP_SUB_HMAP, tcp_sent_acc);
 
-		if(FD_ISSET(tcp_listener_sock, &fds))
-		{
-			handle_tcp_listener();
-		}
+				tcp_sent_acc = 0;
+				if( (tcp_dest_mask = tcp_clients_due(TCP_SUB_HMAP_DELTA, scan_cnt, -1)) )
+					tcp_send_hmap_delta(p_tof->grid.xs, p_tof->grid.ys, p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->grid.spot_size, p_tof->objmap);
+				tcp_clients_sent(TCP_SUB_HMAP_DELTA, tcp_sent_acc);
 
+				tcp_sent_acc = 0;
+				if(p_tof->elevmap_valid && (tcp_dest_mask = tcp_clients_due(TCP_SUB_ELEVMAP, scan_cnt, -1)))
+					tcp_send_elevmap(p_tof->grid.xs, p_tof->grid.ys, p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, p_tof->grid.spot_size, p_tof->elevmap);
+				tcp_clients_sent(TCP_SUB_ELEVMAP, tcp_sent_acc);
 
-		tof3d_scan_t *p_tof;
-		
-		if( (p_tof = get_tof3d()) )
-		{
-		   	if (send_pointcloud > 0) {
-			   save_pointcloud(p_tof->n_points, p_tof->cloud);
-			} else if (send_pointcloud < 0) {
-			   print_pointcloud(p_tof->n_points, p_tof->cloud);
-			} // if else
+				// Unsubscribed clients: depth and amplitude of the -r sensor, as ids 100 and 101
+				uint32_t legacy_mask = unsubscribed_clients();
+				if(base_raw_tof >= 0 && p_tof->raw_depth_sidx == base_raw_tof && (tcp_dest_mask = legacy_mask & tcp_clients_due(TCP_SUB_DEPTH, scan_cnt, -1)))
+				{
+					if(compress_raw)
+					{
+						tcp_send_picture_packed(100, 2, 160, 60, p_tof->raw_depth);
+						tcp_send_picture_packed(101, 1, 160, 60, p_tof->ampl_images[base_raw_tof]);
+					}
+					else
+					{
+						tcp_send_picture(100, 2, 160, 60, (uint8_t*)p_tof->raw_depth);
+						tcp_send_picture(101, 1, 160, 60, p_tof->ampl_images[base_raw_tof]);
+					}
+				}
 
-			if(tcp_client_sock >= 0)
-			{
-				static int hmap_cnt = 0;
-				hmap_cnt++;
+				// Subscribed clients: depth of the sensor it's populated for, amplitudes per sensor
+				tcp_sent_acc = 0;
+				if(p_tof->raw_depth_sidx >= 0 && (tcp_dest_mask = tcp_clients_due(TCP_SUB_DEPTH, scan_cnt, p_tof->raw_depth_sidx)))
+				{
+					if(compress_raw)
+						tcp_send_picture_packed(100, 2, 160, 60, p_tof->raw_depth);
+					else
+						tcp_send_picture(100, 2, 160, 60, (uint8_t*)p_tof->raw_depth);
+				}
+				tcp_clients_sent(TCP_SUB_DEPTH, tcp_sent_acc);
+
+				tcp_sent_acc = 0;
+				for(int sidx=0; sidx<4; sidx++)
+				{
+					if( !(p_tof->sensor_mask & (1<<sidx)) || !(tcp_dest_mask = tcp_clients_due(TCP_SUB_AMPL, scan_cnt, sidx)) )
+						continue;
+					if(compress_raw)
+						tcp_send_picture_packed(TCP_AMPL_PICTURE_ID+sidx, 1, 160, 60, p_tof->ampl_images[sidx]);
+					else
+						tcp_send_picture(TCP_AMPL_PICTURE_ID+sidx, 1, 160, 60, p_tof->ampl_images[sidx]);
+				}
+				tcp_clients_sent(TCP_SUB_AMPL, tcp_sent_acc);
 
-				if(hmap_cnt >= 4)
+				// Point clouds, serialized once per variant (whole or per sensor, with or without amplitudes)
+				tcp_sent_acc = 0;
+				uint32_t pc_mask = tcp_clients_due(TCP_SUB_POINTCLOUD, scan_cnt, -1);
+				for(int variant=0; pc_mask && p_tof->n_points && variant<4; variant++)
 				{
-					tcp_send_hmap(TOF3D_HMAP_XSPOTS, TOF3D_HMAP_YSPOTS, p_tof->robot_pos.ang, p_tof->robot_pos.x, p_tof->robot_pos.y, TOF3D_HMAP_SPOT_SIZE, p_tof->objmap);			   
-				   	if(send_raw_tof >= 0 && send_raw_tof < 4)
+					if( !(tcp_dest_mask = pc_mask & tcp_clients_with_sub_flags(TCP_SUB_FLAG_PC_PER_SENSOR|TCP_SUB_FLAG_PC_AMPL|TCP_SUB_FLAG_PC_ORGANIZED, variant)) )
+						continue;
+					if(variant & TCP_SUB_FLAG_PC_PER_SENSOR)
 					{
-						tcp_send_picture(100, 2, 160, 60, (uint8_t*)p_tof->raw_depth);
-						tcp_send_picture(101, 2, 160, 60, (uint8_t*)p_tof->ampl_images[send_raw_tof]);
+						for(int sidx=0; sidx<4; sidx++)
+						{
+							if(p_tof->sensor_mask & (1<<sidx))
+								tcp_send_pointcloud(p_tof, sidx, variant & TCP_SUB_FLAG_PC_AMPL);
+						}
 					}
-					hmap_cnt = 0;
+					else
+						tcp_send_pointcloud(p_tof, -1, variant & TCP_SUB_FLAG_PC_AMPL);
 				}
+				if(p_tof->organized_valid && (tcp_dest_mask = pc_mask & tcp_clients_with_sub_flags(TCP_SUB_FLAG_PC_ORGANIZED, TCP_SUB_FLAG_PC_ORGANIZED)))
+				{
+					for(int sidx=0; sidx<4; sidx++)
+					{
+						if(p_tof->sensor_mask & (1<<sidx))
+							tcp_send_organized(p_tof, sidx);
+					}
+				}
+				tcp_clients_sent(TCP_SUB_POINTCLOUD, tcp_sent_acc);
+
+				tcp_dest_mask = TCP_ALL_CLIENTS;
+				tcp_payload_owner = NULL;
+				tcp_msg_origin_ns = 0;
 			}			
 		}
 
 	}
 
-	request_tof_quit();
+	tcp_comm_close();
+	request_tof_quit(tof);
+	if(lat_scan.n)
+		print_latency();
 
 	return NULL;
 }
@@ -293,11 +646,26 @@ void pulutof_print_info(char* command_name)
 	   "Usage: %s [Options]\n"
 	   "Options:\n"
 	   " -p           \t A continuous pointcloud output to stdout\n"
+	   " -f fmt       \t Pointcloud format: xyz (text, default), ply, pcd, i16 or f32 (raw int16/float stream, see pcio.h)\n"
+	   " -a           \t Add the sensor index and amplitude of each point to the pointcloud output\n"
+	   " -d dir       \t Directory for the saved pointcloud segment files (default .)\n"
+	   " -c MB        \t Disk usage cap of the saved pointclouds (and of the captures): the oldest segments are deleted (default 0 = no cap)\n"
+	   " -r 0..3      \t Capture the raw depth and amplitude images of the sensor to the -d directory (also sent over TCP)\n"
+	   " -u path      \t Unix domain socket for local clients, besides TCP port 22222 (default /tmp/pulutof.sock, \"\" = none)\n"
+	   " -s /name     \t Publish the scans in POSIX shared memory /name for local readers (see shmpub.h)\n"
+	   " -z           \t Compress the raw images losslessly, in the captures and over TCP (see depthcodec.h)\n"
+	   " -k           \t Send hmaps packed (4 bits per cell) over TCP\n"
+	   " -l           \t Accumulate and send the elevation map (min/max z per cell) over TCP\n"
+	   " -o           \t Cluster the obstacles and send the object list over TCP on every scan\n"
 	   " -m 0|1       \t Midlier filter off/on (default on)\n"
 	   " -e 10..10000 \t Exposure time base in microseconds (default 80 us)\n"
 	   " -h 2..16     \t Hdr-multiplier for exposure time (default 7)\n"
+	   " -b us        \t Processing time budget per frame: reduce the resolution when over it (default 0 = off)\n"
+	   " -t m|2..8    \t Temporal depth filter while the robot is stationary: median of 3 frames, or mean of n\n"
+	   "              \t (lets you run a lower exposure -e at a higher frame rate and recover the accuracy)\n"
+	   " -g XxY@mm    \t Objmap grid: X x Y spots of mm each, robot in the middle (default 200x200@40, max 240x240, 10..200 mm)\n"
 	   "\n"
-	   "Exits with q\n\n",
+	   "Exits with q, c prints the TCP client stats, i the pipeline latencies (since the previous i)\n\n",
 	   command_name);
    
 } // pulutof_print_info
@@ -308,20 +676,19 @@ int main(int argc, char** argv)
 	pthread_t thread_main, thread_tof, thread_tof2;
 
 	int ret, opt;
-	
-       
-	if ( (ret = pthread_create(&thread_main, NULL, main_thread, NULL)) ) {	   
-	   fprintf(stderr, "ERROR: main thread creation, ret = %d\n", ret);
+
+	if ( !(tof = pulutof_create(SPI_DEV)) ) {
 	   return EXIT_FAILURE;
 	} // if
-
-	if ( (ret = pthread_create(&thread_tof, NULL, pulutof_poll_thread, NULL)) ) {
+	cfg = pulutof_settings(tof);
+       
+	if ( (ret = pthread_create(&thread_tof, NULL, pulutof_poll_thread, tof)) ) {
 	   fprintf(stderr, "ERROR: tof3d access thread creation, ret = %d\n", ret);
 	   return EXIT_FAILURE;
 	} // if
 
 	#ifndef PULUTOF1_GIVE_RAWS
-	if ( (ret = pthread_create(&thread_tof2, NULL, pulutof_processing_thread, NULL)) ) {
+	if ( (ret = pthread_create(&thread_tof2, NULL, pulutof_processing_thread, tof)) ) {
 	   fprintf(stderr, "ERROR: tof3d processing thread creation, ret = %d\n", ret);
 	   return -1;
 	} // if
@@ -329,13 +696,22 @@ int main(int argc, char** argv)
 
 	usleep(10000); // gives processsor time for threads started above
 
-	while ((opt = getopt(argc, argv, "pm:e:h:?")) != -1) {
+	while ((opt = getopt(argc, argv, "pklom:e:h:t:b:g:f:ad:c:r:s:u:z?")) != -1) {
 	   switch (opt) {
 	   case 'p':  
-	      send_pointcloud = -1;
+	      cfg->send_pointcloud = -1;
+	      break;
+	   case 'k':
+	      send_packed_hmap = 1;
+	      break;
+	   case 'l':
+	      cfg->send_elevmap = 1;
+	      break;
+	   case 'o':
+	      cfg->send_objlist = 1;
 	      break;
 	   case 'm':
-	      pulutof_command(PULUTOF_COMMAND_MIDLIER_FILTER, *optarg != '0');
+	      device_command(PULUTOF_COMMAND_MIDLIER_FILTER, *optarg != '0', "Midlier filter");
 	      break;
 	   case 'e':
 	      pulutof_set_exposure(atoi(optarg));
@@ -343,6 +719,55 @@ int main(int argc, char** argv)
 	   case 'h':
 	      pulutof_set_hdr_multiplier(atoi(optarg));
 	      break;
+	   case 'b':
+	      cfg->proc_budget_us = atoi(optarg);
+	      break;
+	   case 't':
+	      cfg->temporal_filter = (*optarg == 'm') ? -1 : atoi(optarg);
+	      break;
+	   case 'f':
+	      if ((pc_format = pcio_format_by_name(optarg)) < 0) {
+		 pulutof_print_info(argv[0]);
+		 exit(EXIT_FAILURE);
+	      } // if
+	      break;
+	   case 'a':
+	      pc_columns = PCIO_COL_SIDX | PCIO_COL_AMPL;
+	      break;
+	   case 'd':
+	      pc_dir = optarg;
+	      break;
+	   case 'c':
+	      pc_max_bytes = atoll(optarg)*1024*1024;
+	      break;
+	   case 'r':
+	      cfg->send_raw_tof = atoi(optarg);
+	      if (cfg->send_raw_tof < 0 || cfg->send_raw_tof > 3) {
+		 fprintf(stderr, "ERROR: -r sensor must be 0..3, got %s\n", optarg);
+		 pulutof_print_info(argv[0]);
+		 exit(EXIT_FAILURE);
+	      } // if
+	      capture_raw = 1;
+	      break;
+	   case 'z':
+	      compress_raw = 1;
+	      break;
+	   case 'u':
+	      unix_sock_path = optarg;
+	      break;
+	   case 's':
+	      if (!(shm_pub = shmpub_create(optarg, SHMPUB_DEFAULT_SLOTS))) {
+		 exit(EXIT_FAILURE);
+	      } // if
+	      break;
+	   case 'g': {
+	      int xs, ys, spot_size;
+	      if (sscanf(optarg, "%dx%d@%d", &xs, &ys, &spot_size) != 3 || tof3d_set_grid(tof, xs, ys, spot_size) < 0) {
+		 pulutof_print_info(argv[0]);
+		 exit(EXIT_FAILURE);
+	      } // if
+	      break;
+	   }
 	   default: /* '?' */
 	      pulutof_print_info(argv[0]);
 	      exit(EXIT_FAILURE);
@@ -354,6 +779,12 @@ int main(int argc, char** argv)
 	   exit(EXIT_FAILURE);
 	} // if
 
+	// Started after the options, which configure the servers and the outputs
+	if ( (ret = pthread_create(&thread_main, NULL, main_thread, NULL)) ) {
+	   fprintf(stderr, "ERROR: main thread creation, ret = %d\n", ret);
+	   return EXIT_FAILURE;
+	} // if
+
 	pthread_join(thread_main, NULL);
 
 	pthread_join(thread_tof, NULL);
@@ -361,6 +792,13 @@ int main(int argc, char** argv)
 	pthread_join(thread_tof2, NULL);
 	#endif
 
+	stop_recorder(pc_file_rec, "Saved pointclouds");
+	stop_recorder(pc_stdout_rec, "Printed pointclouds");
+	stop_recorder(capture_rec, "Raw captures");
+	shmpub_close(shm_pub);
+
+	pulutof_destroy(tof);
+
 	return retval;
 
 } // main
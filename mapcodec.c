@@ -0,0 +1,144 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+	Objmap run-length codec, see mapcodec.h
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mapcodec.h"
+
+// Worst case: all literals, one control byte per 128 cells, plus one for a literal split by a short run
+int mcodec_max_size(int n_cells)
+{
+	return n_cells + (n_cells+127)/128 + 1;
+}
+
+static inline uint8_t cell(const int8_t* map, const int8_t* ref, int i)
+{
+	return ref ? (uint8_t)(map[i] ^ ref[i]) : (uint8_t)map[i];
+}
+
+static uint8_t* put_literals(uint8_t* p, const int8_t* map, const int8_t* ref, int start, int end)
+{
+	while(start < end)
+	{
+		int len = (end-start > 128) ? 128 : end-start;
+		*p++ = len-1;
+		for(int i=0; i<len; i++)
+			*p++ = cell(map, ref, start+i);
+		start += len;
+	}
+	return p;
+}
+
+/*
+	Codes map as a keyframe (ref = NULL) or as a delta against ref.
+	out must have room for mcodec_max_size(n_cells) bytes. Returns the number of bytes written.
+*/
+int mcodec_encode(uint8_t* out, const int8_t* map, const int8_t* ref, int n_cells)
+{
+	uint8_t* p = out;
+	int lit_start = 0;
+	int i = 0;
+
+	while(i < n_cells)
+	{
+		uint8_t v = cell(map, ref, i);
+		int run = 1;
+		while(i+run < n_cells && run < 0xffff+MCODEC_LONG_RUN && cell(map, ref, i+run) == v)
+			run++;
+
+		if(run < 3) // A run of 2 between literals is cheaper as literals
+		{
+			i += run;
+			continue;
+		}
+
+		p = put_literals(p, map, ref, lit_start, i);
+		if(run < MCODEC_LONG_RUN)
+		{
+			*p++ = 0x80 + run-2;
+		}
+		else
+		{
+			*p++ = 0xff;
+			*p++ = (run-MCODEC_LONG_RUN) & 0xff;
+			*p++ = (run-MCODEC_LONG_RUN) >> 8;
+		}
+		*p++ = v;
+		i += run;
+		lit_start = i;
+	}
+
+	p = put_literals(p, map, ref, lit_start, n_cells);
+	return p - out;
+}
+
+/*
+	Reference decoder. ref is the map the delta was made against (NULL for a keyframe); it may be the same
+	buffer as map, to update a map in place.
+	Returns 0 on success, -1 if the stream is corrupt or doesn't cover exactly n_cells.
+*/
+int mcodec_decode(int8_t* map, const int8_t* ref, int n_cells, const uint8_t* in, int in_len)
+{
+	const uint8_t* end = in + in_len;
+	int i = 0;
+
+	while(in < end)
+	{
+		int c = *in++;
+		if(c < 0x80)
+		{
+			int len = c+1;
+			if(end-in < len || n_cells-i < len)
+				return -1;
+			for(int k=0; k<len; k++, i++)
+				map[i] = ref ? (int8_t)(ref[i] ^ in[k]) : (int8_t)in[k];
+			in += len;
+		}
+		else
+		{
+			int len;
+			if(c < 0xff)
+				len = c-0x80+2;
+			else
+			{
+				if(end-in < 2)
+					return -1;
+				len = (in[0] | (in[1]<<8)) + MCODEC_LONG_RUN;
+				in += 2;
+			}
+			if(end-in < 1 || n_cells-i < len)
+				return -1;
+			uint8_t v = *in++;
+			if(!ref)
+				memset(&map[i], v, len);
+			else
+			{
+				for(int k=0; k<len; k++)
+					map[i+k] = ref[i+k] ^ v;
+			}
+			i += len;
+		}
+	}
+
+	return (i == n_cells) ? 0 : -1;
+}
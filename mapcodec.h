@@ -0,0 +1,43 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+	Run-length codec for objmaps (int8_t cells), for sending them at the full scan rate.
+
+	A keyframe codes the map itself; a delta frame codes the XOR of the map with a reference map the
+	receiver already has. Large areas of the map are TOF3D_UNSEEN (0), and from scan to scan only a small
+	fraction of the cells change, so both are mostly long runs of zeros.
+
+	Stream: a sequence of codes, each starting with a control byte c:
+		c < 0x80          Literal: c+1 bytes follow, copied as is
+		0x80 <= c < 0xff  Run: the next byte repeated (c-0x80)+2 times
+		c == 0xff         Long run: uint16_t (little endian) n, then the byte repeated n+MCODEC_LONG_RUN times
+	The codes cover exactly the n_cells of the map.
+*/
+
+#ifndef MAPCODEC_H
+#define MAPCODEC_H
+
+#include <stdint.h>
+
+#define MCODEC_LONG_RUN (0x7f+2)
+
+int mcodec_max_size(int n_cells);
+int mcodec_encode(uint8_t* out, const int8_t* map, const int8_t* ref, int n_cells);
+int mcodec_decode(int8_t* map, const int8_t* ref, int n_cells, const uint8_t* in, int in_len);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Obstacle clustering, see objlist.h
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pulutof.h"
+#include "objlist.h"
+
+static int find_root(objlist_run_t* runs, int i)
+{
+	while(runs[i].parent != i)
+	{
+		runs[i].parent = runs[runs[i].parent].parent; // path halving
+		i = runs[i].parent;
+	}
+	return i;
+}
+
+static void unite(objlist_run_t* runs, int a, int b)
+{
+	int ra = find_root(runs, a);
+	int rb = find_root(runs, b);
+	// Keep the smaller index as the root, so that roots are always the first run of the object.
+	if(ra < rb)
+		runs[rb].parent = ra;
+	else if(rb < ra)
+		runs[ra].parent = rb;
+}
+
+static int cmp_dist(const void* a, const void* b)
+{
+	return ((const tof3d_object_t*)a)->min_dist - ((const tof3d_object_t*)b)->min_dist;
+}
+
+/*
+	Finds the connected (8-neighbourhood) groups of cells with class >= min_class.
+	Groups smaller than min_cells are dropped as noise. Fills out[] with the max_out objects closest
+	to the map origin (xmid, ymid), closest first. Coordinates are in mm relative to the origin.
+	Returns the number of objects written.
+*/
+int objlist_extract(objlist_ws_t* ws, const int8_t* objmap, int xs, int ys, int xmid, int ymid, int unit_size_mm,
+	int min_class, int min_cells, tof3d_object_t* out, int max_out)
+{
+	objlist_run_t* runs = ws->runs;
+	int n_runs = 0;
+	int prev_start = 0, prev_end = 0;
+
+	if(ys*(xs/2+1) > OBJLIST_MAX_RUNS)
+	{
+		fprintf(stderr, "ERROR: objlist_extract: map size %d x %d doesn't fit\n", xs, ys);
+		return 0;
+	}
+
+	for(int y=0; y<ys; y++)
+	{
+		const int8_t* row = &objmap[y*xs];
+		int cur_start = n_runs;
+		int p = prev_start; // Runs are in x order: the previous row is walked only once per row
+
+		int x = 0;
+		while(x < xs)
+		{
+			if(row[x] < min_class)
+			{
+				x++;
+				continue;
+			}
+
+			int x0 = x;
+			int cls = row[x];
+			while(x < xs && row[x] >= min_class)
+			{
+				if(row[x] > cls) cls = row[x];
+				x++;
+			}
+			int x1 = x-1;
+
+			objlist_run_t* r = &runs[n_runs];
+			r->y = y; r->x0 = x0; r->x1 = x1; r->cls = cls; r->parent = n_runs;
+
+			while(p < prev_end && runs[p].x1+1 < x0)
+				p++;
+
+			for(int j=p; j < prev_end && runs[j].x0 <= x1+1; j++)
+				unite(runs, j, n_runs);
+
+			n_runs++;
+		}
+
+		prev_start = cur_start;
+		prev_end = n_runs;
+	}
+
+	// Gather the statistics per root. Roots always come before their children (see unite), so one pass is enough.
+	int n_objs = 0;
+	tof3d_object_t* objs = ws->objs;
+	for(int i=0; i<n_runs; i++)
+	{
+		objlist_run_t* r = &runs[i];
+		int root = find_root(runs, i);
+
+		int dx = (xmid < r->x0) ? (r->x0 - xmid) : ((xmid > r->x1) ? (r->x1 - xmid) : 0);
+		int dy = r->y - ymid;
+		int d2 = dx*dx + dy*dy;
+		int n = r->x1 - r->x0 + 1;
+
+		if(root == i)
+		{
+			ws->root_to_obj[i] = n_objs;
+			tof3d_object_t* o = &objs[n_objs++];
+			o->x0 = r->x0; o->x1 = r->x1;
+			o->y0 = o->y1 = r->y;
+			o->cls = r->cls;
+			o->min_dist = d2 > 65535 ? 65535 : d2; // Squared cells until converted below
+			o->n_cells = n;
+		}
+		else
+		{
+			tof3d_object_t* o = &objs[ws->root_to_obj[root]];
+			if(r->x0 < o->x0) o->x0 = r->x0;
+			if(r->x1 > o->x1) o->x1 = r->x1;
+			if(r->y < o->y0) o->y0 = r->y;
+			if(r->y > o->y1) o->y1 = r->y;
+			if(r->cls > o->cls) o->cls = r->cls;
+			if(d2 < o->min_dist) o->min_dist = d2;
+			o->n_cells = (o->n_cells+n > 65535) ? 65535 : o->n_cells+n;
+		}
+	}
+
+	// Drop the noise in place
+	int n_kept = 0;
+	for(int i=0; i<n_objs; i++)
+	{
+		if(objs[i].n_cells >= min_cells)
+			objs[n_kept++] = objs[i];
+	}
+
+	qsort(objs, n_kept, sizeof objs[0], cmp_dist);
+
+	if(n_kept > max_out)
+		n_kept = max_out;
+
+	for(int i=0; i<n_kept; i++)
+	{
+		out[i].x0 = (objs[i].x0 - xmid)*unit_size_mm;
+		out[i].x1 = (objs[i].x1 - xmid + 1)*unit_size_mm;
+		out[i].y0 = (objs[i].y0 - ymid)*unit_size_mm;
+		out[i].y1 = (objs[i].y1 - ymid + 1)*unit_size_mm;
+		out[i].cls = objs[i].cls;
+		out[i].min_dist = sqrtf(objs[i].min_dist)*unit_size_mm;
+		out[i].n_cells = objs[i].n_cells;
+	}
+
+	return n_kept;
+}
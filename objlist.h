@@ -0,0 +1,55 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Obstacle clustering: connected components of obstacle cells in the objmap,
+	reduced to a short list of objects (bounding box, class, distance).
+
+	Single pass over the objmap: each row is split to runs of obstacle cells, and each run is
+	union-find joined with the 8-connected runs of the previous row. Object statistics are
+	then gathered per union-find root from the runs, without touching the map again.
+*/
+
+#ifndef OBJLIST_H
+#define OBJLIST_H
+
+#include <stdint.h>
+
+#define OBJLIST_MAX_RUNS (TOF3D_HMAP_MAX_YSPOTS*(TOF3D_HMAP_MAX_XSPOTS/2+1))
+
+typedef struct
+{
+	int16_t y;
+	int16_t x0;
+	int16_t x1;
+	int16_t cls;
+	int parent; // union-find
+} objlist_run_t;
+
+// Workspace for objlist_extract(); too big for the stack.
+typedef struct
+{
+	objlist_run_t runs[OBJLIST_MAX_RUNS];
+	int root_to_obj[OBJLIST_MAX_RUNS];
+	tof3d_object_t objs[OBJLIST_MAX_RUNS];
+} objlist_ws_t;
+
+int objlist_extract(objlist_ws_t* ws, const int8_t* objmap, int xs, int ys, int xmid, int ymid, int unit_size_mm,
+	int min_class, int min_cells, tof3d_object_t* out, int max_out);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Compact objmap representations, see objmap.h
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pulutof.h"
+#include "objmap.h"
+
+int objmap_packed_init(objmap_packed_t* m, int xs, int ys)
+{
+	if(xs < 1 || ys < 1 || OBJMAP_PACKED_BYTES(xs, ys) > sizeof m->data)
+	{
+		fprintf(stderr, "ERROR: objmap_packed_init: map size %d x %d doesn't fit\n", xs, ys);
+		return -1;
+	}
+
+	m->xs = xs;
+	m->ys = ys;
+	m->tiles_x = (xs+OBJMAP_TILE-1)/OBJMAP_TILE;
+	m->n_bytes = OBJMAP_PACKED_BYTES(xs, ys);
+	objmap_packed_clear(m);
+	return 0;
+}
+
+void objmap_packed_clear(objmap_packed_t* m)
+{
+	memset(m->data, 0, m->n_bytes);
+}
+
+/*
+	Row-major int8_t objmap -> packed tiles. Walks the source linearly, one tile row (8 map rows) at the time,
+	so that the destination tile row (tiles_x*32 bytes) stays in L1. Cells past the map edge are packed as TOF3D_UNSEEN.
+*/
+void objmap_pack(objmap_packed_t* m, const int8_t* objmap)
+{
+	for(int y=0; y<m->ys; y++)
+	{
+		const int8_t* src = &objmap[y*m->xs];
+		uint8_t* dst = &m->data[(y>>OBJMAP_TILE_SHIFT)*m->tiles_x*OBJMAP_TILE_BYTES + ((y&(OBJMAP_TILE-1))<<(OBJMAP_TILE_SHIFT-1))];
+
+		int x = 0;
+		for(; x+OBJMAP_TILE <= m->xs; x+=OBJMAP_TILE)
+		{
+			dst[0] = (src[x+0]&0x0f) | (src[x+1]<<4);
+			dst[1] = (src[x+2]&0x0f) | (src[x+3]<<4);
+			dst[2] = (src[x+4]&0x0f) | (src[x+5]<<4);
+			dst[3] = (src[x+6]&0x0f) | (src[x+7]<<4);
+			dst += OBJMAP_TILE_BYTES;
+		}
+
+		if(x < m->xs) // Partial tile at the right edge
+		{
+			for(int i=0; i<OBJMAP_TILE/2; i++)
+			{
+				int lo = (x+2*i   < m->xs) ? src[x+2*i]   : TOF3D_UNSEEN;
+				int hi = (x+2*i+1 < m->xs) ? src[x+2*i+1] : TOF3D_UNSEEN;
+				dst[i] = (lo&0x0f) | (hi<<4);
+			}
+		}
+	}
+}
+
+void objmap_unpack(const objmap_packed_t* m, int8_t* objmap)
+{
+	for(int y=0; y<m->ys; y++)
+	{
+		int8_t* dst = &objmap[y*m->xs];
+		const uint8_t* src = &m->data[(y>>OBJMAP_TILE_SHIFT)*m->tiles_x*OBJMAP_TILE_BYTES + ((y&(OBJMAP_TILE-1))<<(OBJMAP_TILE_SHIFT-1))];
+
+		int x = 0;
+		for(; x+OBJMAP_TILE <= m->xs; x+=OBJMAP_TILE)
+		{
+			for(int i=0; i<OBJMAP_TILE/2; i++)
+			{
+				dst[x+2*i]   = src[i]&0x0f;
+				dst[x+2*i+1] = src[i]>>4;
+			}
+			src += OBJMAP_TILE_BYTES;
+		}
+
+		for(; x < m->xs; x++)
+			dst[x] = (src[(x&(OBJMAP_TILE-1))>>1] >> ((x&1)<<2)) & 0x0f;
+	}
+}
+
+/*
+	dst = max(dst, src) cell by cell. Both maps must have the same geometry.
+
+	SWAR: even and odd nibbles are separated into 8-bit lanes (values 0..15 never reach bit 7),
+	then (a|0x80)-b leaves bit 7 set exactly in the lanes where a >= b.
+*/
+void objmap_packed_merge(objmap_packed_t* dst, const objmap_packed_t* src)
+{
+	if(dst->xs != src->xs || dst->ys != src->ys)
+	{
+		fprintf(stderr, "ERROR: objmap_packed_merge: geometry mismatch\n");
+		return;
+	}
+
+	const uint64_t lo4 = 0x0f0f0f0f0f0f0f0fULL;
+	const uint64_t hi1 = 0x8080808080808080ULL;
+
+	for(int i=0; i < dst->n_bytes; i+=8) // n_bytes is always a multiple of OBJMAP_TILE_BYTES
+	{
+		uint64_t a, b;
+		memcpy(&a, &dst->data[i], 8);
+		memcpy(&b, &src->data[i], 8);
+
+		uint64_t res = 0;
+		for(int sh=0; sh<=4; sh+=4)
+		{
+			uint64_t la = (a>>sh) & lo4;
+			uint64_t lb = (b>>sh) & lo4;
+			uint64_t ge = (((la|hi1) - lb) & hi1) >> 7; // 1 in lanes where la >= lb
+			uint64_t mask = ge*0xff;
+			res |= ((la & mask) | (lb & ~mask)) << sh;
+		}
+
+		memcpy(&dst->data[i], &res, 8);
+	}
+}
+
+int objmap_pyramid_init(objmap_pyramid_t* p, int xs, int ys)
+{
+	if(xs < 1 || ys < 1 || OBJMAP_PYRAMID_BYTES(xs, ys) > sizeof p->cells)
+	{
+		fprintf(stderr, "ERROR: objmap_pyramid_init: map size %d x %d doesn't fit\n", xs, ys);
+		return -1;
+	}
+
+	p->xs[0] = xs;
+	p->ys[0] = ys;
+	p->offs[0] = 0;
+	int offs = 0;
+	for(int l=1; l<=OBJMAP_PYRAMID_LEVELS; l++)
+	{
+		p->xs[l] = OBJMAP_LEVEL_SIZE(xs, l);
+		p->ys[l] = OBJMAP_LEVEL_SIZE(ys, l);
+		p->offs[l] = offs;
+		offs += p->xs[l]*p->ys[l];
+	}
+	p->n_bytes = offs;
+	objmap_pyramid_clear(p);
+	return 0;
+}
+
+void objmap_pyramid_clear(objmap_pyramid_t* p)
+{
+	memset(p->cells, TOF3D_UNSEEN, p->n_bytes);
+}
+
+// Full rebuild from the base objmap, 2x2 max-pooling level by level.
+void objmap_pyramid_build(objmap_pyramid_t* p, const int8_t* objmap)
+{
+	const int8_t* src = objmap;
+	for(int l=1; l<=OBJMAP_PYRAMID_LEVELS; l++)
+	{
+		int sxs = p->xs[l-1], sys = p->ys[l-1];
+		int8_t* dst = &p->cells[p->offs[l]];
+
+		for(int y=0; y<p->ys[l]; y++)
+		{
+			const int8_t* r0 = &src[(2*y)*sxs];
+			const int8_t* r1 = (2*y+1 < sys) ? &src[(2*y+1)*sxs] : r0;
+			for(int x=0; x<p->xs[l]; x++)
+			{
+				int x1 = (2*x+1 < sxs) ? 2*x+1 : 2*x;
+				int8_t m = r0[2*x];
+				if(r0[x1] > m) m = r0[x1];
+				if(r1[2*x] > m) m = r1[2*x];
+				if(r1[x1] > m) m = r1[x1];
+				dst[y*p->xs[l]+x] = m;
+			}
+		}
+		src = dst;
+	}
+}
+
+static int region_max_descend(const objmap_pyramid_t* p, const int8_t* objmap, int l, int cx, int cy, int x0, int y0, int x1, int y1, int best)
+{
+	if(l == 0)
+		return objmap[cy*p->xs[0]+cx];
+
+	int v = p->cells[p->offs[l] + cy*p->xs[l] + cx];
+	if(v <= best)
+		return best; // Nothing bigger below this cell
+
+	int bx0 = cx<<l, by0 = cy<<l, bx1 = ((cx+1)<<l)-1, by1 = ((cy+1)<<l)-1;
+	if(bx0 >= x0 && bx1 <= x1 && by0 >= y0 && by1 <= y1)
+		return v; // Cell fully inside the region
+
+	for(int yy=2*cy; yy<=2*cy+1 && yy<p->ys[l-1]; yy++)
+	{
+		if((((yy+1)<<(l-1))-1) < y0 || (yy<<(l-1)) > y1) continue;
+		for(int xx=2*cx; xx<=2*cx+1 && xx<p->xs[l-1]; xx++)
+		{
+			if((((xx+1)<<(l-1))-1) < x0 || (xx<<(l-1)) > x1) continue;
+			int r = region_max_descend(p, objmap, l-1, xx, yy, x0, y0, x1, y1, best);
+			if(r > best) best = r;
+		}
+	}
+	return best;
+}
+
+/*
+	Highest class in the objmap rectangle (x0,y0)..(x1,y1), inclusive, in base cells. Starts from the coarsest level
+	and only descends into cells that straddle the region edge and could still raise the result, so checking
+	that a large region is clear (result <= TOF3D_THRESHOLD) only reads a handful of cells.
+*/
+int objmap_pyramid_region_max(const objmap_pyramid_t* p, const int8_t* objmap, int x0, int y0, int x1, int y1)
+{
+	if(x0 < 0) x0 = 0;
+	if(y0 < 0) y0 = 0;
+	if(x1 > p->xs[0]-1) x1 = p->xs[0]-1;
+	if(y1 > p->ys[0]-1) y1 = p->ys[0]-1;
+
+	int best = TOF3D_UNSEEN;
+	int l = OBJMAP_PYRAMID_LEVELS;
+	for(int cy = y0>>l; cy <= y1>>l; cy++)
+	{
+		for(int cx = x0>>l; cx <= x1>>l; cx++)
+		{
+			int r = region_max_descend(p, objmap, l, cx, cy, x0, y0, x1, y1, best);
+			if(r > best) best = r;
+		}
+	}
+	return best;
+}
@@ -0,0 +1,119 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Compact objmap representations.
+
+	Packed objmap: the objmap classes (TOF3D_UNSEEN..TOF3D_WALL) fit in 4 bits, so two cells are
+	stored per byte. Cells are grouped in 8x8 tiles (32 bytes each, half of a Cortex-A53 cache line),
+	tiles in row-major order, cells row-major inside the tile, even x in the low nibble:
+
+	tile index  = (y/8)*tiles_x + x/8
+	byte index  = tile index*32 + (y%8)*4 + (x%8)/2
+
+	Points of one sensor land in a compact wedge of the map, so the random-order max-writes done
+	by distances_to_objmap() touch few cache lines, and the whole map is half the size of the int8_t one.
+
+	Objmap pyramid: coarser levels of the objmap, each cell being the max (= highest priority class)
+	of the 2x2 cells below it. With 40 mm base cells, levels 1, 2, 3 have 80, 160 and 320 mm cells
+	(100x100, 50x50 and 25x25 for the 200x200 map). Level 0 is the objmap itself and isn't stored here.
+	Kept up to date while the scan is accumulated: a write only climbs up as long as it raises the parent.
+*/
+
+#ifndef OBJMAP_H
+#define OBJMAP_H
+
+#include <stdint.h>
+
+#define OBJMAP_TILE_SHIFT 3
+#define OBJMAP_TILE       (1<<OBJMAP_TILE_SHIFT)
+#define OBJMAP_TILE_BYTES (OBJMAP_TILE*OBJMAP_TILE/2)
+
+#define OBJMAP_PACKED_BYTES(xs_, ys_) ( (((xs_)+OBJMAP_TILE-1)/OBJMAP_TILE) * (((ys_)+OBJMAP_TILE-1)/OBJMAP_TILE) * OBJMAP_TILE_BYTES )
+
+typedef struct
+{
+	int xs;      // map size in cells
+	int ys;
+	int tiles_x; // tiles per tile row
+	int n_bytes; // used bytes in data[]
+	uint8_t data[OBJMAP_PACKED_BYTES(TOF3D_HMAP_MAX_XSPOTS, TOF3D_HMAP_MAX_YSPOTS)];
+} objmap_packed_t;
+
+static inline int objmap_packed_idx(const objmap_packed_t* m, int x, int y)
+{
+	return ((y>>OBJMAP_TILE_SHIFT)*m->tiles_x + (x>>OBJMAP_TILE_SHIFT))*OBJMAP_TILE_BYTES + ((y&(OBJMAP_TILE-1))<<(OBJMAP_TILE_SHIFT-1)) + ((x&(OBJMAP_TILE-1))>>1);
+}
+
+static inline int objmap_packed_get(const objmap_packed_t* m, int x, int y)
+{
+	return (m->data[objmap_packed_idx(m, x, y)] >> ((x&1)<<2)) & 0x0f;
+}
+
+// Writes val to the cell only if it's bigger than the current value (class priority order)
+static inline void objmap_packed_max(objmap_packed_t* m, int x, int y, int val)
+{
+	uint8_t* p = &m->data[objmap_packed_idx(m, x, y)];
+	int sh = (x&1)<<2;
+	if(val > ((*p >> sh) & 0x0f))
+		*p = (*p & ~(0x0f<<sh)) | (val<<sh);
+}
+
+#define OBJMAP_PYRAMID_LEVELS 3
+
+#define OBJMAP_LEVEL_SIZE(s_, l_) ( ((s_)+(1<<(l_))-1)>>(l_) )
+#define OBJMAP_PYRAMID_BYTES(xs_, ys_) ( OBJMAP_LEVEL_SIZE(xs_,1)*OBJMAP_LEVEL_SIZE(ys_,1) + OBJMAP_LEVEL_SIZE(xs_,2)*OBJMAP_LEVEL_SIZE(ys_,2) + OBJMAP_LEVEL_SIZE(xs_,3)*OBJMAP_LEVEL_SIZE(ys_,3) )
+
+typedef struct
+{
+	int xs[OBJMAP_PYRAMID_LEVELS+1]; // Level sizes in cells, [0] is the base objmap
+	int ys[OBJMAP_PYRAMID_LEVELS+1];
+	int offs[OBJMAP_PYRAMID_LEVELS+1]; // Start of each level in cells[]; [0] unused
+	int n_bytes;
+	int8_t cells[OBJMAP_PYRAMID_BYTES(TOF3D_HMAP_MAX_XSPOTS, TOF3D_HMAP_MAX_YSPOTS)];
+} objmap_pyramid_t;
+
+// Propagates a base level (level 0) write of val at (x,y) upwards.
+static inline void objmap_pyramid_max(objmap_pyramid_t* p, int x, int y, int val)
+{
+	for(int l=1; l<=OBJMAP_PYRAMID_LEVELS; l++)
+	{
+		int8_t* c = &p->cells[p->offs[l] + (y>>l)*p->xs[l] + (x>>l)];
+		if(*c >= val)
+			break; // All the levels above are at least this, too
+		*c = val;
+	}
+}
+
+static inline int8_t* objmap_pyramid_level(objmap_pyramid_t* p, int level)
+{
+	return &p->cells[p->offs[level]];
+}
+
+int  objmap_packed_init(objmap_packed_t* m, int xs, int ys);
+void objmap_packed_clear(objmap_packed_t* m);
+void objmap_pack(objmap_packed_t* m, const int8_t* objmap);
+void objmap_unpack(const objmap_packed_t* m, int8_t* objmap);
+void objmap_packed_merge(objmap_packed_t* dst, const objmap_packed_t* src);
+
+int  objmap_pyramid_init(objmap_pyramid_t* p, int xs, int ys);
+void objmap_pyramid_clear(objmap_pyramid_t* p);
+void objmap_pyramid_build(objmap_pyramid_t* p, const int8_t* objmap);
+int  objmap_pyramid_region_max(const objmap_pyramid_t* p, const int8_t* objmap, int x0, int y0, int x1, int y1);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Objmap representation check: packing, the SWAR merge and the pyramid against plain per-cell versions,
+	on random maps of the default size and of sizes that leave partial tiles and odd pyramid levels.
+	Build and run with make check.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pulutof.h"
+#include "objmap.h"
+
+#define N_BOXES 2000
+
+static int failed;
+
+static void check(int ok, const char* what, int xs, int ys)
+{
+	fprintf(stderr, "%s: %s (%d x %d)\n", ok ? "ok" : "FAIL", what, xs, ys);
+	if(!ok)
+		failed = 1;
+}
+
+// Mostly floor and unseen, obstacles sparse, so that region maxima vary
+static void random_map(int8_t* map, int n)
+{
+	for(int i=0; i<n; i++)
+	{
+		int r = rand()%100;
+		map[i] = (r < 90) ? r%3 : TOF3D_SMALL_DROP + r%(TOF3D_WALL-TOF3D_SMALL_DROP+1);
+	}
+}
+
+static int brute_max(const int8_t* map, int xs, int x0, int y0, int x1, int y1)
+{
+	int m = TOF3D_UNSEEN;
+	for(int y=y0; y<=y1; y++)
+		for(int x=x0; x<=x1; x++)
+			if(map[y*xs+x] > m)
+				m = map[y*xs+x];
+	return m;
+}
+
+static void test_size(int xs, int ys)
+{
+	static int8_t a[TOF3D_HMAP_MAX_XSPOTS*TOF3D_HMAP_MAX_YSPOTS], b[TOF3D_HMAP_MAX_XSPOTS*TOF3D_HMAP_MAX_YSPOTS];
+	static int8_t out[TOF3D_HMAP_MAX_XSPOTS*TOF3D_HMAP_MAX_YSPOTS];
+	static objmap_packed_t pa, pb;
+	static objmap_pyramid_t pyr, inc;
+	int n = xs*ys;
+
+	random_map(a, n);
+	random_map(b, n);
+
+	// Pack and unpack, and the per-cell accessors agree with the bulk ones
+	objmap_packed_init(&pa, xs, ys);
+	objmap_pack(&pa, a);
+	memset(out, -1, n);
+	objmap_unpack(&pa, out);
+	int ok = !memcmp(out, a, n);
+	for(int i=0; ok && i<n; i++)
+		ok = objmap_packed_get(&pa, i%xs, i/xs) == a[i];
+	check(ok, "pack -> unpack is the identity", xs, ys);
+
+	// Merge
+	objmap_packed_init(&pb, xs, ys);
+	objmap_pack(&pb, b);
+	objmap_packed_merge(&pa, &pb);
+	objmap_unpack(&pa, out);
+	ok = 1;
+	for(int i=0; ok && i<n; i++)
+		ok = out[i] == ((a[i] > b[i]) ? a[i] : b[i]);
+	check(ok, "merge is the per-cell max", xs, ys);
+
+	// Pyramid: each level cell is the max of its base cells, the same built at once or write by write
+	objmap_pyramid_init(&pyr, xs, ys);
+	objmap_pyramid_build(&pyr, a);
+	ok = 1;
+	for(int l=1; ok && l<=OBJMAP_PYRAMID_LEVELS; l++)
+	{
+		const int8_t* lv = objmap_pyramid_level(&pyr, l);
+		for(int y=0; ok && y<pyr.ys[l]; y++)
+			for(int x=0; ok && x<pyr.xs[l]; x++)
+			{
+				int x1 = ((x+1)<<l)-1, y1 = ((y+1)<<l)-1;
+				ok = lv[y*pyr.xs[l]+x] == brute_max(a, xs, x<<l, y<<l, (x1<xs)?x1:xs-1, (y1<ys)?y1:ys-1);
+			}
+	}
+	check(ok, "pyramid levels are the max of their cells", xs, ys);
+
+	objmap_pyramid_init(&inc, xs, ys);
+	for(int i=0; i<n; i++)
+		objmap_pyramid_max(&inc, i%xs, i/xs, a[i]);
+	check(!memcmp(inc.cells, pyr.cells, pyr.n_bytes), "incremental pyramid equals the built one", xs, ys);
+
+	// Region max over random boxes, some reaching outside the map
+	ok = 1;
+	for(int i=0; ok && i<N_BOXES; i++)
+	{
+		int x0 = rand()%(xs+8)-4, y0 = rand()%(ys+8)-4;
+		int w = (i%4) ? rand()%16 : rand()%xs, h = (i%4) ? rand()%16 : rand()%ys;
+		int x1 = x0+w, y1 = y0+h;
+		int cx0 = (x0<0)?0:x0, cy0 = (y0<0)?0:y0, cx1 = (x1<xs)?x1:xs-1, cy1 = (y1<ys)?y1:ys-1;
+		if(cx0 > cx1 || cy0 > cy1)
+			continue;
+		ok = objmap_pyramid_region_max(&pyr, a, x0, y0, x1, y1) == brute_max(a, xs, cx0, cy0, cx1, cy1);
+		if(!ok)
+			fprintf(stderr, "  box %d,%d .. %d,%d\n", x0, y0, x1, y1);
+	}
+	check(ok, "region max equals brute force", xs, ys);
+}
+
+int main()
+{
+	srand(1);
+	test_size(TOF3D_HMAP_XSPOTS, TOF3D_HMAP_YSPOTS);
+	test_size(37, 53);
+	test_size(TOF3D_HMAP_MAX_XSPOTS, TOF3D_HMAP_MAX_YSPOTS);
+	test_size(1, 9);
+
+	fprintf(stderr, failed ? "FAILED\n" : "All passed\n");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
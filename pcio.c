@@ -0,0 +1,260 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Point cloud output, see pcio.h
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "pulutof.h"
+#include "pcio.h"
+
+static const char* const format_names[] = {"xyz", "ply", "pcd", "i16", "f32"};
+
+int pcio_format_by_name(const char* name)
+{
+	for(int i=0; i < (int)(sizeof format_names / sizeof format_names[0]); i++)
+	{
+		if(!strcmp(name, format_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+const char* pcio_file_ext(int format)
+{
+	return (format >= 0 && format <= PCIO_RAW_F32) ? format_names[format] : "bin";
+}
+
+static int n_columns(int columns)
+{
+	return ((columns & PCIO_COL_SIDX) != 0) + ((columns & PCIO_COL_AMPL) != 0);
+}
+
+int pcio_write_all(int fd, const uint8_t* buf, int len)
+{
+	while(len > 0)
+	{
+		ssize_t ret = write(fd, buf, len);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "ERROR: pcio_write_all: write failed: %d (%s)\n", errno, strerror(errno));
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/*
+	Decimal integer to text, without the locale and FILE locking overhead of printf.
+	Two digits at a time into a small buffer from the end, then copied out. Returns the new end of out.
+*/
+static inline char* put_int(char* out, int32_t v)
+{
+	char tmp[12];
+	char* p = tmp + sizeof tmp;
+	uint32_t u = v;
+
+	if(v < 0)
+	{
+		*out++ = '-';
+		u = -u;
+	}
+
+	while(u >= 100)
+	{
+		int d = (u % 100) * 2;
+		u /= 100;
+		*--p = digit_pairs[d+1];
+		*--p = digit_pairs[d];
+	}
+	if(u >= 10)
+	{
+		*--p = digit_pairs[u*2+1];
+		*--p = digit_pairs[u*2];
+	}
+	else
+		*--p = '0' + u;
+
+	int n = tmp + sizeof tmp - p;
+	memcpy(out, p, n);
+	return out + n;
+}
+
+static int16_t sat16(int32_t v)
+{
+	return (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : v);
+}
+
+static int header_ply(char* out, int n, int columns)
+{
+	return sprintf(out,
+		"ply\n"
+		"format binary_little_endian 1.0\n"
+		"element vertex %d\n"
+		"property float x\n"
+		"property float y\n"
+		"property float z\n"
+		"%s"
+		"%s"
+		"end_header\n",
+		n,
+		(columns & PCIO_COL_SIDX) ? "property uchar sensor\n" : "",
+		(columns & PCIO_COL_AMPL) ? "property uchar amplitude\n" : "");
+}
+
+static int header_pcd(char* out, int n, int columns)
+{
+	int sidx = columns & PCIO_COL_SIDX, ampl = columns & PCIO_COL_AMPL;
+	return sprintf(out,
+		"# .PCD v0.7 - Point Cloud Data file format\n"
+		"VERSION 0.7\n"
+		"FIELDS x y z%s%s\n"
+		"SIZE 4 4 4%s%s\n"
+		"TYPE F F F%s%s\n"
+		"COUNT 1 1 1%s%s\n"
+		"WIDTH %d\n"
+		"HEIGHT 1\n"
+		"VIEWPOINT 0 0 0 1 0 0 0\n"
+		"POINTS %d\n"
+		"DATA binary\n",
+		sidx ? " sensor" : "", ampl ? " intensity" : "",
+		sidx ? " 1" : "", ampl ? " 1" : "",
+		sidx ? " U" : "", ampl ? " U" : "",
+		sidx ? " 1" : "", ampl ? " 1" : "",
+		n, n);
+}
+
+// Upper bound of the pcio_format() output size
+int pcio_max_size(int format, int columns, int n_points)
+{
+	int coord_size = (format == PCIO_RAW_I16) ? 2 : 4;
+	int point_size = (format == PCIO_XYZ) ? 64 : 3*coord_size + n_columns(columns); // Text: worst case line length
+	return 512 + n_points*point_size;
+}
+
+/*
+	Formats the whole cloud of the scan (header included) into out, which must have room for pcio_max_size() bytes.
+	Returns the number of bytes.
+*/
+int pcio_format(uint8_t* out, int format, int columns, const tof3d_scan_t* scan)
+{
+	int n = scan->n_points;
+	uint8_t* p = out;
+
+	switch(format)
+	{
+		case PCIO_PLY: p += header_ply((char*)p, n, columns); break;
+		case PCIO_PCD: p += header_pcd((char*)p, n, columns); break;
+		case PCIO_RAW_I16:
+		case PCIO_RAW_F32:
+		{
+			pcio_raw_header_t hdr;
+			hdr.magic = PCIO_RAW_MAGIC;
+			hdr.n_points = n;
+			hdr.format = format;
+			hdr.columns = columns;
+			hdr.point_size = 3*((format == PCIO_RAW_I16) ? 2 : 4) + n_columns(columns);
+			hdr.robot_pos = scan->robot_pos;
+			memcpy(p, &hdr, sizeof hdr);
+			p += sizeof hdr;
+		}
+		break;
+		default: break;
+	}
+
+	for(int i=0; i<n; i++)
+	{
+		int32_t x = scan->cloud[i].x, y = -1*scan->cloud[i].y, z = scan->cloud[i].z;
+
+		if(format == PCIO_XYZ)
+		{
+			char* t = (char*)p;
+			t = put_int(t, x); *t++ = ' ';
+			t = put_int(t, y); *t++ = ' ';
+			t = put_int(t, z);
+			if(columns)
+			{
+				*t++ = ' '; t = put_int(t, (columns & PCIO_COL_SIDX) ? scan->cloud_sidx[i] : 0);
+				*t++ = ' '; t = put_int(t, (columns & PCIO_COL_AMPL) ? scan->cloud_ampl[i] : 0);
+			}
+			*t++ = '\n';
+			p = (uint8_t*)t;
+			continue;
+		}
+
+		if(format == PCIO_RAW_I16)
+		{
+			int16_t v[3] = {sat16(x), sat16(y), sat16(z)};
+			memcpy(p, v, sizeof v);
+			p += sizeof v;
+		}
+		else
+		{
+			float v[3] = {x, y, z};
+			memcpy(p, v, sizeof v);
+			p += sizeof v;
+		}
+
+		if(columns & PCIO_COL_SIDX) *p++ = scan->cloud_sidx[i];
+		if(columns & PCIO_COL_AMPL) *p++ = scan->cloud_ampl[i];
+	}
+
+	return p-out;
+}
+
+/*
+	Formats the cloud in one buffer and writes it with one write() (more only if the fd takes it in parts).
+	Returns 0 on success, -1 on error.
+*/
+int pcio_write(int fd, int format, int columns, const tof3d_scan_t* scan)
+{
+	uint8_t* buf = malloc(pcio_max_size(format, columns, scan->n_points));
+	if(!buf)
+	{
+		fprintf(stderr, "ERROR: Out of memory in pcio_write\n");
+		return -1;
+	}
+
+	int ret = pcio_write_all(fd, buf, pcio_format(buf, format, columns, scan));
+	free(buf);
+	return ret;
+}
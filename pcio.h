@@ -0,0 +1,72 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Point cloud output: the cloud of one scan is formatted in memory and written with a single write().
+
+	Formats:
+	PCIO_XYZ      "x y z\n" text, one point per line (the original format); rendered without printf, see pcio_bench.c
+	PCIO_PLY      Binary little endian PLY, float x, y, z
+	PCIO_PCD      Binary PCD v0.7, float x, y, z
+	PCIO_RAW_I16  Raw stream, int16_t x, y, z (mm, saturated)
+	PCIO_RAW_F32  Raw stream, float x, y, z (mm)
+
+	The raw stream is meant for piping: each scan starts with pcio_raw_header_t, followed by n_points points.
+	PORTABILITY WARNING: the binary formats are written in host byte order, assuming little endian (as the Raspi is).
+
+	Optional columns (PCIO_COL_*) add uint8_t fields after z: the sensor index, and the amplitude of the pixel.
+	(The text format always has both extra columns when any is enabled; a disabled one is 0.)
+	All coordinates are in mm with y flipped, like in the original text output: +x forward, +y left, +z up.
+*/
+
+#ifndef PCIO_H
+#define PCIO_H
+
+#include <stdint.h>
+
+#include "pulutof.h"
+
+#define PCIO_XYZ     0
+#define PCIO_PLY     1
+#define PCIO_PCD     2
+#define PCIO_RAW_I16 3
+#define PCIO_RAW_F32 4
+
+#define PCIO_COL_SIDX 1
+#define PCIO_COL_AMPL 2
+
+#define PCIO_RAW_MAGIC 0x444c4350 // "PCLD"
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint32_t n_points;
+	uint8_t  format;   // PCIO_RAW_I16 or PCIO_RAW_F32
+	uint8_t  columns;  // PCIO_COL_* bits
+	uint16_t point_size; // bytes per point
+	pos_t    robot_pos;
+} pcio_raw_header_t;
+
+int pcio_format_by_name(const char* name);
+const char* pcio_file_ext(int format);
+int pcio_max_size(int format, int columns, int n_points);
+int pcio_format(uint8_t* out, int format, int columns, const tof3d_scan_t* scan);
+int pcio_write(int fd, int format, int columns, const tof3d_scan_t* scan);
+int pcio_write_all(int fd, const uint8_t* buf, int len);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Point cloud text output benchmark: the original printf per point vs. pcio_format(), in points per second.
+	Doesn't need the sensors. Build with make bench, run ./pcio_bench [scans]
+
+	The output goes to /dev/null, so this measures the formatting and syscall cost only.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pulutof.h"
+#include "pcio.h"
+
+static double timestamp()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (double)spec.tv_sec + (double)spec.tv_nsec/1.0e9;
+}
+
+static tof3d_scan_t scan;
+
+// Full scan of plausible values: a room of +-5 m, floor and walls, some negative coordinates
+static void gen_scan()
+{
+	srand(1);
+	scan.n_points = 4*TOF_XS*TOF_YS;
+	for(int i=0; i<scan.n_points; i++)
+	{
+		scan.cloud[i].x = rand()%10000 - 5000;
+		scan.cloud[i].y = rand()%10000 - 5000;
+		scan.cloud[i].z = rand()%2000 - 100;
+		scan.cloud_sidx[i] = i/(TOF_XS*TOF_YS);
+		scan.cloud_ampl[i] = rand()%256;
+	}
+}
+
+// How print_pointcloud() used to do it
+static void print_printf(FILE* f)
+{
+	for(int i=0; i<scan.n_points; i++)
+		fprintf(f, "%d %d %d\n", scan.cloud[i].x, -1*scan.cloud[i].y, scan.cloud[i].z);
+	fflush(f);
+}
+
+int main(int argc, char** argv)
+{
+	int n_scans = (argc > 1) ? atoi(argv[1]) : 100;
+	if(n_scans < 1) n_scans = 1;
+
+	gen_scan();
+
+	int fd = open("/dev/null", O_WRONLY);
+	FILE* f = fdopen(fd, "w");
+	if(fd < 0 || !f)
+	{
+		fprintf(stderr, "ERROR: opening /dev/null failed\n");
+		return EXIT_FAILURE;
+	}
+
+	// The outputs must be identical
+	char* ref; size_t ref_len;
+	FILE* mf = open_memstream(&ref, &ref_len);
+	print_printf(mf);
+	fclose(mf);
+	uint8_t* buf = malloc(pcio_max_size(PCIO_XYZ, 0, scan.n_points));
+	int len = pcio_format(buf, PCIO_XYZ, 0, &scan);
+	if(len != (int)ref_len || memcmp(buf, ref, len))
+	{
+		fprintf(stderr, "ERROR: pcio_format output differs from printf\n");
+		return EXIT_FAILURE;
+	}
+	free(ref);
+
+	double t0 = timestamp();
+	for(int s=0; s<n_scans; s++)
+		print_printf(f);
+	double t_printf = timestamp() - t0;
+
+	t0 = timestamp();
+	for(int s=0; s<n_scans; s++)
+		pcio_write_all(fd, buf, pcio_format(buf, PCIO_XYZ, 0, &scan));
+	double t_pcio = timestamp() - t0;
+
+	double n = (double)n_scans*scan.n_points;
+	printf("%d scans of %d points, %d bytes of text each\n", n_scans, scan.n_points, len);
+	printf("printf per point: %8.3f ms/scan %7.2f Mpoints/s\n", 1000.0*t_printf/n_scans, n/t_printf/1.0e6);
+	printf("pcio_format:      %8.3f ms/scan %7.2f Mpoints/s (%.1fx)\n", 1000.0*t_pcio/n_scans, n/t_pcio/1.0e6, t_printf/t_pcio);
+
+	free(buf);
+	fclose(f);
+	return 0;
+}
@@ -49,30 +49,118 @@
 #include <stdbool.h>
 
 #include "pulutof.h"
-
-#define PULUTOF_SPI_DEVICE "/dev/spidev0.0"
-
-extern volatile int verbose_mode;
-
-static int spi_fd;
-static volatile bool running     = true;
-static volatile bool configurate = false;
+#include "objmap.h"
+#include "objlist.h"
+#include "tempfilt.h"
+#include "latency.h"
 
 static const unsigned char spi_mode = SPI_MODE_0;
 static const unsigned char spi_bits_per_word = 8;
 static const unsigned int spi_speed = 32000000; // Hz
 
-static pthread_mutex_t mutex_poll_availabity = PTHREAD_MUTEX_INITIALIZER;
+#define PULUTOF_RINGBUF_LEN 16
+#define PULUTOF_CMD_QUEUE_LEN 16
+#define TOF3D_RING_BUF_LEN 32
+#define NUM_PULUTOFS 4
 
+/*
+	distances_to_objmap() works in two passes over the frame. The first pass filters
+	the depth image and converts it to points in robot coordinates, stored in pixel
+	order. The floor plane is estimated from those points, and the second pass
+	classifies them relative to the floor plane into the objmap (and the optional
+	outputs).
+*/
 
+#define PT_NONE   0 // No point at this pixel
+#define PT_WEAK   1 // Few conforming neighbours: only accepted on level floor and high up
+#define PT_STRONG 2
 
-static int init_spi()
+typedef struct
 {
-	spi_fd = open(PULUTOF_SPI_DEVICE, O_RDWR);
+	float x[TOF_XS*TOF_YS];
+	float y[TOF_XS*TOF_YS];
+	float z[TOF_XS*TOF_YS];
+	float d[TOF_XS*TOF_YS];
+	uint8_t flags[TOF_XS*TOF_YS];
+} frame_points_t;
 
-	if(spi_fd < 0)
+#define NUM_PROC_LEVELS 3 // See proc_levels[]
+
+/*
+	Everything of one PULUTOF kit: the SPI connection, the frame and scan ring buffers, and the processing state.
+	The frame ring buffer is written by the poll thread (or pulutof_feed_frame()) and read by the processing thread;
+	the scan ring buffer is written by the processing thread and read by get_tof3d(). The rest of the processing
+	state is only touched by the processing thread.
+*/
+struct pulutof_ctx
+{
+	pulutof_settings_t set;
+
+	char spi_dev[64];
+	int spi_fd;
+	volatile bool running;
+	volatile bool configurate;
+	volatile int dbg_id;
+	uint8_t txbuf[65536];
+
+	volatile pulutof_frame_t ringbuf[PULUTOF_RINGBUF_LEN];
+	volatile int ringbuf_wr;
+	volatile int ringbuf_rd;
+	uint64_t ringbuf_stamps[PULUTOF_RINGBUF_LEN]; // When each frame came in, see latency.h
+
+	// Device commands, see pulutof_command(). Command with handle h is in cmds[h % PULUTOF_CMD_QUEUE_LEN];
+	// cmd_next is the handle of the next one queued, cmd_cur of the one the poll thread is on.
+	pthread_mutex_t mutex_cmd;
+	struct { int handle; pulutof_command_frame_t frame; int state; } cmds[PULUTOF_CMD_QUEUE_LEN];
+	int cmd_next, cmd_cur;
+	int cmd_phase;       // Poll thread only, see service_commands()
+	int cmd_finished;    // Count of finished commands (atomic): the depth output may have changed after each
+	double cmd_deadline;
+
+	volatile tof3d_scan_t tof3ds[TOF3D_RING_BUF_LEN];
+	volatile int tof3d_wr;
+	volatile int tof3d_rd;
+	int tof3d_pins[TOF3D_RING_BUF_LEN]; // See pulutof_pin_scan(); atomic
+	volatile uint8_t tof3d_stale[TOF3D_RING_BUF_LEN]; // Pinned slot the writer stepped past: get_tof3d() skips it
+	int pinned_skips;                   // Processing thread only
+
+	pulutof_scan_cb_t scan_cb;
+	void* scan_cb_arg;
+
+	pthread_mutex_t mutex_grid;
+	tof3d_grid_t grid; // Latched to the scan when it's opened (see open_scan()), so that a change never lands in the middle of a scan
+
+	// Processing thread only:
+	frame_points_t frame_pts;
+	uint16_t binned[(TOF_XS/2)*(TOF_YS/2)];
+	tempfilt_t tempfilts[NUM_PULUTOFS];
+	int tempfilt_cmds;   // cmd_finished when the filter histories were started
+	objlist_ws_t objlist_ws;
+
+	volatile int proc_level;               // Active processing level (index to proc_levels[])
+	double proc_cost_us[NUM_PROC_LEVELS];  // Average cost per level, only kept for the current one; 0 = not measured yet
+	int proc_hold;
+
+	int scan_mask;         // Sensors accumulated to tof3ds[tof3d_wr] so far, 0 = no scan open
+	double scan_start;
+	int prev_missing_mask; // For logging only when the set of missing sensors changes
+};
+
+static double timestamp()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (double)spec.tv_sec + (double)spec.tv_nsec/1.0e9;
+}
+
+static int init_spi(pulutof_ctx_t* ctx)
+{
+	ctx->spi_fd = open(ctx->spi_dev, O_RDWR);
+
+	if(ctx->spi_fd < 0)
 	{
-		fprintf(stderr,"ERROR: Opening PULUTOF SPI device %s failed: %d (%s).\n", PULUTOF_SPI_DEVICE, errno, strerror(errno));
+		fprintf(stderr,"ERROR: Opening PULUTOF SPI device %s failed: %d (%s).\n", ctx->spi_dev, errno, strerror(errno));
 		return -1;
 	}
 
@@ -93,19 +181,19 @@ static int init_spi()
 		Here, we just set what we need.
 	*/
 
-	if(ioctl(spi_fd, SPI_IOC_WR_MODE, &spi_mode) < 0)
+	if(ioctl(ctx->spi_fd, SPI_IOC_WR_MODE, &spi_mode) < 0)
 	{
 		fprintf(stderr, "ERROR: Opening PULUTOF SPI devide: ioctl SPI_IOC_WR_MODE failed: %d (%s).\n", errno, strerror(errno));
 		return -2;
 	}
 
-	if(ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &spi_bits_per_word) < 0)
+	if(ioctl(ctx->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &spi_bits_per_word) < 0)
 	{
 		fprintf(stderr, "ERROR: Opening PULUTOF SPI devide: ioctl SPI_IOC_WR_BITS_PER_WORD failed: %d (%s).\n", errno, strerror(errno));
 		return -2;
 	}
 
-	if(ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) < 0)
+	if(ioctl(ctx->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed) < 0)
 	{
 		fprintf(stderr, "ERROR: Opening PULUTOF SPI devide: ioctl SPI_IOC_WR_MAX_SPEED_HZ failed: %d (%s).\n", errno, strerror(errno));
 		return -2;
@@ -115,9 +203,12 @@ static int init_spi()
 }
 
 
-static int deinit_spi()
+static int deinit_spi(pulutof_ctx_t* ctx)
 {
-	if(close(spi_fd) < 0)
+	if(ctx->spi_fd < 0)
+		return 0;
+
+	if(close(ctx->spi_fd) < 0)
 	{
 		fprintf(stderr, "WARNING: Closing PULUTOF SPI devide failed: %d (%s).\n", errno, strerror(errno));
 		return -1;
@@ -126,59 +217,80 @@ static int deinit_spi()
 	return 0;
 }
 
-volatile int dbg_id = 0;
-
-void pulutof_decr_dbg()
+void pulutof_decr_dbg(pulutof_ctx_t* ctx)
 {
-	if(dbg_id) dbg_id--;
-	fprintf(stderr, "PULUTOF dbg_id=%d\n", dbg_id);
+	if(ctx->dbg_id) ctx->dbg_id--;
+	fprintf(stderr, "PULUTOF dbg_id=%d\n", ctx->dbg_id);
 }
 
-void pulutof_incr_dbg()
+void pulutof_incr_dbg(pulutof_ctx_t* ctx)
 {
-	dbg_id++;
-	fprintf(stderr, "PULUTOF dbg_id=%d\n", dbg_id);
+	ctx->dbg_id++;
+	fprintf(stderr, "PULUTOF dbg_id=%d\n", ctx->dbg_id);
 }
 
-#define PULUTOF_RINGBUF_LEN 16
-volatile pulutof_frame_t pulutof_ringbuf[PULUTOF_RINGBUF_LEN];
-volatile int pulutof_ringbuf_wr = 0;
-volatile int pulutof_ringbuf_rd = 0;
-
-#define TOF3D_RING_BUF_LEN 32
-
-volatile tof3d_scan_t tof3ds[TOF3D_RING_BUF_LEN];
-volatile int tof3d_wr;
-volatile int tof3d_rd;
-
-tof3d_scan_t* get_tof3d()
+tof3d_scan_t* get_tof3d(pulutof_ctx_t* ctx)
 {
-	if(tof3d_wr == tof3d_rd)
+	while(ctx->tof3d_wr != ctx->tof3d_rd)
 	{
-		return 0;
+		int rd = ctx->tof3d_rd;
+		ctx->tof3d_rd++; if(ctx->tof3d_rd >= TOF3D_RING_BUF_LEN) ctx->tof3d_rd = 0;
+		if(!__atomic_load_n(&ctx->tof3d_stale[rd], __ATOMIC_ACQUIRE))
+			return (tof3d_scan_t*)&ctx->tof3ds[rd];
 	}
-	
-	tof3d_scan_t* ret = &tof3ds[tof3d_rd];
-	tof3d_rd++; if(tof3d_rd >= TOF3D_RING_BUF_LEN) tof3d_rd = 0;
-	return ret;
+	return 0;
+}
+
+/*
+	A scan got from get_tof3d() is only valid until the ring wraps around to it again. Pinning keeps its slot
+	from being reused: the processing thread steps past pinned slots to the next free one, so one scan pinned
+	for long (a stalled client) only takes its own slot out of the ring.
+	Pins nest, and can be released from any thread. Both return the scan's new pin count.
+*/
+int pulutof_pin_scan(pulutof_ctx_t* ctx, const tof3d_scan_t* scan)
+{
+	return __atomic_add_fetch(&ctx->tof3d_pins[scan - (const tof3d_scan_t*)ctx->tof3ds], 1, __ATOMIC_ACQ_REL);
+}
+
+int pulutof_unpin_scan(pulutof_ctx_t* ctx, const tof3d_scan_t* scan)
+{
+	return __atomic_sub_fetch(&ctx->tof3d_pins[scan - (const tof3d_scan_t*)ctx->tof3ds], 1, __ATOMIC_ACQ_REL);
 }
 
+static int ringbuf_backlog(pulutof_ctx_t* ctx)
+{
+	int n = ctx->ringbuf_wr - ctx->ringbuf_rd;
+	return (n < 0) ? n+PULUTOF_RINGBUF_LEN : n;
+}
 
-pulutof_frame_t* get_pulutof_frame()
+pulutof_frame_t* get_pulutof_frame(pulutof_ctx_t* ctx)
 {
-	if(pulutof_ringbuf_wr == pulutof_ringbuf_rd)
+	if(ctx->ringbuf_wr == ctx->ringbuf_rd)
 	{
 		return 0;
 	}
 	
-	pulutof_frame_t* ret = &pulutof_ringbuf[pulutof_ringbuf_rd];
-	pulutof_ringbuf_rd++; if(pulutof_ringbuf_rd >= PULUTOF_RINGBUF_LEN) pulutof_ringbuf_rd = 0;
+	pulutof_frame_t* ret = (pulutof_frame_t*)&ctx->ringbuf[ctx->ringbuf_rd];
+	ctx->ringbuf_rd++; if(ctx->ringbuf_rd >= PULUTOF_RINGBUF_LEN) ctx->ringbuf_rd = 0;
 	return ret;
 }
 
+/*
+	Replay: queues a recorded frame for the processing thread, like the poll thread does with the frames
+	read from the hardware. Only for contexts without the poll thread running. Returns -1 when the queue is
+	full; try again after the processing thread has caught up.
+*/
+int pulutof_feed_frame(pulutof_ctx_t* ctx, const pulutof_frame_t* frame)
+{
+	int next = ctx->ringbuf_wr+1; if(next >= PULUTOF_RINGBUF_LEN) next = 0;
+	if(next == ctx->ringbuf_rd)
+		return -1;
 
-static float x_angs[TOF_XS*TOF_YS];
-static float y_angs[TOF_XS*TOF_YS];
+	memcpy((void*)&ctx->ringbuf[ctx->ringbuf_wr], frame, sizeof *frame);
+	ctx->ringbuf_stamps[ctx->ringbuf_wr] = lat_now_ns();
+	ctx->ringbuf_wr = next;
+	return 0;
+}
 
 #define GEOCAL_N_X 5
 #define GEOCAL_N_Y 6
@@ -205,6 +317,11 @@ static const geocal_point_t lens_quadrant_coords[GEOCAL_N_Y+1][GEOCAL_N_X+1] =
 	{ { 10,  29,   50.0,  0.0}, { 18,  29,   45.0,  0.0}, { 26,  29,   40.0,  0.0}, { 42,  29,   30.0,  0.0}, { 62,  29,   15.0,  0.0}, { 80,  29,   0,  0.0} }
 };
 
+/*
+	Pixel angle tables: only depend on the constant lens calibration above, so they are shared by all the contexts,
+	generated once by the first pulutof_create().
+*/
+static pthread_once_t ang_tables_once = PTHREAD_ONCE_INIT;
 static float x_angs[TOF_XS*TOF_YS];
 static float y_angs[TOF_XS*TOF_YS];
 
@@ -253,8 +370,6 @@ typedef struct
 	float z_rel_ground;         // sensor height from the ground	
 } sensor_mount_t;
 
-#define NUM_PULUTOFS 4
-
 #ifndef M_PI
 #define M_PI 3.14159265358979
 #endif
@@ -270,39 +385,74 @@ static const sensor_mount_t sensor_mounts[NUM_PULUTOFS] =
  /*3:                */ { 4,     0,    70, DEGTORAD(     270), DEGTORAD(  0),   0 }
 };
 
-static void distances_to_objmap(pulutof_frame_t *in)
+/*
+	Processing levels, from full resolution to coarsest. Binning averages the valid pixels of each 2x2 block
+	into an 80x30 image before the filtering; step processes only every step'th row and column of the (binned) image.
+	Points are stored at the pixel of the top left corner of their bin, so the outputs keep the pixel order.
+*/
+typedef struct
 {
-	int sidx = in->sensor_idx;
-	if(sidx > NUM_PULUTOFS-1)
+	int bin;
+	int step;
+	const char* name;
+} proc_level_t;
+
+static const proc_level_t proc_levels[NUM_PROC_LEVELS] =
+{
+	{1, 1, "full resolution"},
+	{2, 1, "2x2 binning"},
+	{2, 2, "2x2 binning, row/column stride 2"}
+};
+
+static float x_angs_bin[(TOF_XS/2)*(TOF_YS/2)];
+static float y_angs_bin[(TOF_XS/2)*(TOF_YS/2)];
+
+static void bin_depth(const uint16_t* restrict in, uint16_t* restrict out)
+{
+	for(int by=0; by<TOF_YS/2; by++)
 	{
-		fprintf(stderr, "WARNING: distances_to_objmap: illegal sensor idx coming from hw.\n");
-		return;
+		const uint16_t* r0 = &in[(2*by)*TOF_XS];
+		const uint16_t* r1 = &in[(2*by+1)*TOF_XS];
+		for(int bx=0; bx<TOF_XS/2; bx++)
+		{
+			int n = (r0[2*bx]!=0) + (r0[2*bx+1]!=0) + (r1[2*bx]!=0) + (r1[2*bx+1]!=0);
+			int sum = r0[2*bx] + r0[2*bx+1] + r1[2*bx] + r1[2*bx+1];
+			out[by*(TOF_XS/2)+bx] = (n >= 2) ? sum/n : 0;
+		}
 	}
+}
 
-	/*
-		for converting to absolute world coordinates, if that's needed in the future:
-	
-	float robot_ang = ANG32TORAD(in->robot_pos.ang);
-	float robot_x = in->robot_pos.x;
-	float robot_y = in->robot_pos.y;
-previous
-	float sensor_ang = robot_ang + sensor_mounts[sidx].ang_rel_robot;
-	float sensor_x = robot_x + cos(robot_ang)*sensor_mounts[sidx].x_rel_robot;
-	float sensor_y = robot_y + sin(robot_ang)*sensor_mounts[sidx].y_rel_robot;
-	*/
+static int frame_to_points(pulutof_ctx_t* ctx, pulutof_frame_t *in, int sidx, int level, frame_points_t* pts)
+{
+	uint16_t* binned = ctx->binned;
+
+	const uint16_t* depth = pulutof_frame_depth(in);
+	const float* xa = x_angs;
+	const float* ya = y_angs;
+	int w = TOF_XS, h = TOF_YS;
+	int bin = proc_levels[level].bin;
+	int step = proc_levels[level].step;
+
+	if(bin == 2)
+	{
+		bin_depth(depth, binned);
+		depth = binned;
+		xa = x_angs_bin;
+		ya = y_angs_bin;
+		w = TOF_XS/2; h = TOF_YS/2;
+	}
 
 	float sensor_ang = sensor_mounts[sidx].ang_rel_robot;
 	float sensor_x = sensor_mounts[sidx].x_rel_robot;
 	float sensor_y = sensor_mounts[sidx].y_rel_robot;
 	float sensor_yang = sensor_mounts[sidx].vert_ang_rel_ground;
 	float sensor_z = sensor_mounts[sidx].z_rel_ground;
-	
-	int do_send_pointcloud = abs(send_pointcloud);
 
+	memset(pts->flags, PT_NONE, sizeof pts->flags);
 
-	for(int pyy = 1; pyy < TOF_YS-1; pyy++)
+	for(int pyy = step; pyy < h-1; pyy += step)
 	{
-		for(int pxx = 1; pxx < TOF_XS-1; pxx++)
+		for(int pxx = step; pxx < w-1; pxx += step)
 		{
 			int n_valids = 0;
 			int avg = 0;
@@ -310,7 +460,7 @@ previous
 			{
 				for(int dxx=-1; dxx<=1; dxx++)
 				{
-					int dist = in->depth[(pyy+dyy)*TOF_XS+(pxx+dxx)];
+					int dist = depth[(pyy+dyy)*w+(pxx+dxx)];
 					if(dist != 0)
 					{
 						n_valids++;
@@ -329,7 +479,7 @@ previous
 				{
 					for(int dxx=-1; dxx<=1; dxx++)
 					{
-						int dist = in->depth[(pyy+dyy)*TOF_XS+(pxx+dxx)];
+						int dist = depth[(pyy+dyy)*w+(pxx+dxx)];
 						if(dist != 0 && dist > avg-350 && dist < avg+350)
 						{
 							n_conforming++;
@@ -351,135 +501,601 @@ previous
 					switch(sensor_mounts[sidx].mount_mode)
 					{
 						case 1: 
-						hor_ang = -1*y_angs[py*TOF_XS+px];
-						ver_ang = x_angs[py*TOF_XS+px];
+						hor_ang = -1*ya[py*w+px];
+						ver_ang = xa[py*w+px];
 						break;
 
 						case 2: 
-						hor_ang = y_angs[py*TOF_XS+px];
-						ver_ang = -1*x_angs[py*TOF_XS+px];
+						hor_ang = ya[py*w+px];
+						ver_ang = -1*xa[py*w+px];
 						break;
 
 						case 3: // direction in which the original geometrical calibration was calculated in
-						hor_ang = -1*x_angs[py*TOF_XS+px];
-						ver_ang = -1*y_angs[py*TOF_XS+px];
+						hor_ang = -1*xa[py*w+px];
+						ver_ang = -1*ya[py*w+px];
 						break;
 
 						case 4: // Same as 3, but upside down
-						hor_ang = x_angs[py*TOF_XS+px];
-						ver_ang = y_angs[py*TOF_XS+px];
+						hor_ang = xa[py*w+px];
+						ver_ang = ya[py*w+px];
 						break;
 
-						default: fprintf(stderr, "ERROR: illegal mount_mode in sensor mount table.\n"); return;
+						default: fprintf(stderr, "ERROR: illegal mount_mode in sensor mount table.\n"); return -1;
 					}
 
 					// From spherical to cartesian coordinates
 
 					float d = (float)avg_conforming/(float)n_conforming;
 
-					float x = d * cos(ver_ang + sensor_yang) * cos(hor_ang + sensor_ang) + sensor_x;
-					float y = -1* (d * cos(ver_ang + sensor_yang) * sin(hor_ang + sensor_ang)) + sensor_y;
-					float z = d * sin(ver_ang + sensor_yang) + sensor_z;
-					if(z > 700 || (z > -180.0 && z < 130.0) || (n_valids > 7 && n_conforming > 5))
-					{
-						// Data proving level floor is accepted with fewer samples
-						// High-z data is also accepted with fewer samples; else we miss obvious small high obstacles
-						// Otherwise, we require enough samples to be sure.
+					int i = (pyy*bin)*TOF_XS + pxx*bin;
+					pts->x[i] = d * cos(ver_ang + sensor_yang) * cos(hor_ang + sensor_ang) + sensor_x;
+					pts->y[i] = -1* (d * cos(ver_ang + sensor_yang) * sin(hor_ang + sensor_ang)) + sensor_y;
+					pts->z[i] = d * sin(ver_ang + sensor_yang) + sensor_z;
+					pts->d[i] = d;
+					pts->flags[i] = (n_valids > 7 && n_conforming > 5) ? PT_STRONG : PT_WEAK;
+				}
+			}
+		}
+	}
 
-						int xspot = (int)(x / (float)TOF3D_HMAP_SPOT_SIZE) + TOF3D_HMAP_XMIDDLE;
-						int yspot = (int)(y / (float)TOF3D_HMAP_SPOT_SIZE) + TOF3D_HMAP_YMIDDLE;
+	return 0;
+}
 
-						//printf("DIST = %.0f  x=%.0f  y=%.0f  z=%.0f  xspot=%d  yspot=%d  ver_ang=%.2f  sensor_yang=%.2f  hor_ang=%.2f  sensor_ang=%.2f\n", d, x, y, z, xspot, yspot, ver_ang, sensor_yang, hor_ang, sensor_ang); 
+/*
+	Floor plane estimation: z = a*x + b*y + c, from floor candidate points (near z=0
+	according to the mount table). Walls and objects near the floor would be
+	candidates, too, and pull a plain least squares fit. Points on steep surfaces
+	are dropped by comparing with the next point down the pixel column, and the
+	plane is first found by RANSAC (planes through random triplets of candidates,
+	keeping the one with the most candidates close to it), then refined by least
+	squares over its inliers.
+
+	The candidates are taken from a fixed sparse pixel grid and the number of
+	hypotheses is fixed, so the cost is bounded regardless of the scene: at most
+	FLOOR_MAX_SAMPLES points, FLOOR_RANSAC_ITERS hypotheses, one 3x3 solve.
+	Returns 0 and leaves plane[] at z=0 if the fit isn't believable (too few
+	samples, or too tilted / offset to be a floor seen from a robot).
+*/
 
-						if(xspot < 0 || xspot >= TOF3D_HMAP_XSPOTS || yspot < 0 || yspot >= TOF3D_HMAP_YSPOTS)
-						{
-							//ignored++;
-							continue;
-						}
+#define FLOOR_SAMPLE_STEP   3      // Pixel grid step for the candidates
+#define FLOOR_MAX_SAMPLES   512
+#define FLOOR_MIN_SAMPLES   60
+#define FLOOR_CAND_Z        150.0  // Candidate window around z=0, mm
+#define FLOOR_CAND_D        2500.0 // Max distance of the candidates, mm
+#define FLOOR_INLIER_Z      40.0   // Inlier window, mm
+#define FLOOR_RANSAC_ITERS  24
+#define FLOOR_MAX_SLOPE     0.105  // tan(6 deg)
+#define FLOOR_MAX_OFFSET    120.0  // mm
+
+static int fit_plane(int n, const float* xs, const float* ys, const float* zs, const uint8_t* use, float plane[3])
+{
+	double mx = 0.0, my = 0.0, mz = 0.0;
+	int cnt = 0;
+	for(int i=0; i<n; i++)
+	{
+		if(!use[i]) continue;
+		mx += xs[i]; my += ys[i]; mz += zs[i];
+		cnt++;
+	}
 
-	/*					int zi = z;
-						if(zi > -2000 && zi < 2000)
-						{
-							if(zi > hmap_accum[xspot][yspot])
-								hmap_accum[xspot][yspot] = zi;
-							hmap_nsamples[xspot][yspot]++;
-						}
+	if(cnt < FLOOR_MIN_SAMPLES)
+		return 0;
+
+	mx /= cnt; my /= cnt; mz /= cnt;
+
+	// Centered normal equations: the constant term drops out, leaving a 2x2 system for the slopes.
+	double sxx = 0.0, sxy = 0.0, syy = 0.0, sxz = 0.0, syz = 0.0;
+	for(int i=0; i<n; i++)
+	{
+		if(!use[i]) continue;
+		double x = xs[i]-mx, y = ys[i]-my, z = zs[i]-mz;
+		sxx += x*x; sxy += x*y; syy += y*y;
+		sxz += x*z; syz += y*z;
+	}
+
+	double det = sxx*syy - sxy*sxy;
+	if(fabs(det) < 1e-6*(sxx*syy+1.0))
+		return 0; // Degenerate: all samples on a line
+
+	plane[0] = (sxz*syy - syz*sxy)/det;
+	plane[1] = (syz*sxx - sxz*sxy)/det;
+	plane[2] = mz - plane[0]*mx - plane[1]*my;
+	return 1;
+}
+
+static int estimate_floor(const frame_points_t* pts, int level, float plane[3])
+{
+	// Sample on a grid aligned with the points of the processing level
+	int spacing = proc_levels[level].bin*proc_levels[level].step;
+	int sample_step = spacing*((FLOOR_SAMPLE_STEP+spacing-1)/spacing);
+
+	float xs[FLOOR_MAX_SAMPLES], ys[FLOOR_MAX_SAMPLES], zs[FLOOR_MAX_SAMPLES];
+	uint8_t use[FLOOR_MAX_SAMPLES];
+	int n = 0;
+
+	plane[0] = plane[1] = plane[2] = 0.0;
+
+	for(int pyy = 0; pyy < TOF_YS && n < FLOOR_MAX_SAMPLES; pyy += sample_step)
+	{
+		for(int pxx = 0; pxx < TOF_XS && n < FLOOR_MAX_SAMPLES; pxx += sample_step)
+		{
+			int i = pyy*TOF_XS+pxx;
+			if(pts->flags[i] != PT_STRONG || pts->d[i] > FLOOR_CAND_D || pts->z[i] < -FLOOR_CAND_Z || pts->z[i] > FLOOR_CAND_Z)
+				continue;
+
+			// Skip steep surfaces (wall bottoms, object sides): the next point
+			// down the column moves more in z than sideways
+			if(pyy+spacing < TOF_YS)
+			{
+				int j = i + spacing*TOF_XS;
+				if(pts->flags[j] != PT_NONE)
+				{
+					float dx = pts->x[j]-pts->x[i], dy = pts->y[j]-pts->y[i], dz = pts->z[j]-pts->z[i];
+					if(dz*dz > dx*dx + dy*dy)
+						continue;
+				}
+			}
+
+			xs[n] = pts->x[i]; ys[n] = pts->y[i]; zs[n] = pts->z[i];
+			n++;
+		}
+	}
+
+	if(n < FLOOR_MIN_SAMPLES)
+		return 0;
+
+	float best[3];
+	int best_inliers = 0;
+	uint32_t rnd = 12345; // Fixed seed: the same frame always gives the same plane
+
+	for(int iter=0; iter<FLOOR_RANSAC_ITERS; iter++)
+	{
+		int k[3];
+		for(int j=0; j<3; j++)
+		{
+			rnd = rnd*1103515245 + 12345;
+			k[j] = (rnd>>8) % n;
+		}
+
+		float ux = xs[k[1]]-xs[k[0]], uy = ys[k[1]]-ys[k[0]], uz = zs[k[1]]-zs[k[0]];
+		float vx = xs[k[2]]-xs[k[0]], vy = ys[k[2]]-ys[k[0]], vz = zs[k[2]]-zs[k[0]];
+		float nx = uy*vz - uz*vy, ny = uz*vx - ux*vz, nz = ux*vy - uy*vx;
+		if(fabsf(nz) < 1.0f) // Degenerate or vertical triplet
+			continue;
+
+		float hyp[3];
+		hyp[0] = -nx/nz;
+		hyp[1] = -ny/nz;
+		hyp[2] = zs[k[0]] - hyp[0]*xs[k[0]] - hyp[1]*ys[k[0]];
+		if(fabsf(hyp[0]) > FLOOR_MAX_SLOPE || fabsf(hyp[1]) > FLOOR_MAX_SLOPE || fabsf(hyp[2]) > FLOOR_MAX_OFFSET)
+			continue;
+
+		int inliers = 0;
+		for(int i=0; i<n; i++)
+			inliers += fabsf(zs[i] - (hyp[0]*xs[i] + hyp[1]*ys[i] + hyp[2])) < FLOOR_INLIER_Z;
+
+		if(inliers > best_inliers)
+		{
+			best_inliers = inliers;
+			best[0] = hyp[0]; best[1] = hyp[1]; best[2] = hyp[2];
+		}
+	}
+
+	if(best_inliers < FLOOR_MIN_SAMPLES)
+		return 0;
+
+	for(int i=0; i<n; i++)
+		use[i] = fabsf(zs[i] - (best[0]*xs[i] + best[1]*ys[i] + best[2])) < FLOOR_INLIER_Z;
+
+	float refit[3];
+	if(!fit_plane(n, xs, ys, zs, use, refit))
+		return 0;
+
+	if(fabsf(refit[0]) > FLOOR_MAX_SLOPE || fabsf(refit[1]) > FLOOR_MAX_SLOPE || fabsf(refit[2]) > FLOOR_MAX_OFFSET)
+		return 0;
+
+	plane[0] = refit[0]; plane[1] = refit[1]; plane[2] = refit[2];
+	return 1;
+}
+
+int tof3d_set_grid(pulutof_ctx_t* ctx, int xs, int ys, int spot_size)
+{
+	if(xs < OBJMAP_TILE || xs > TOF3D_HMAP_MAX_XSPOTS || ys < OBJMAP_TILE || ys > TOF3D_HMAP_MAX_YSPOTS ||
+	   spot_size < TOF3D_HMAP_MIN_SPOT_SIZE || spot_size > TOF3D_HMAP_MAX_SPOT_SIZE)
+	{
+		fprintf(stderr, "ERROR: tof3d_set_grid: %d x %d spots of %d mm not supported (max %d x %d, %d..%d mm)\n",
+			xs, ys, spot_size, TOF3D_HMAP_MAX_XSPOTS, TOF3D_HMAP_MAX_YSPOTS, TOF3D_HMAP_MIN_SPOT_SIZE, TOF3D_HMAP_MAX_SPOT_SIZE);
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->mutex_grid);
+	ctx->grid.xs = xs;
+	ctx->grid.ys = ys;
+	ctx->grid.xmid = xs/2;
+	ctx->grid.ymid = ys/2;
+	ctx->grid.spot_size = spot_size;
+	pthread_mutex_unlock(&ctx->mutex_grid);
+
+	fprintf(stderr, "INFO: objmap grid %d x %d spots of %d mm (%.1f x %.1f m)\n", xs, ys, spot_size, xs*spot_size/1000.0, ys*spot_size/1000.0);
+	return 0;
+}
+
+/*
+	The geometry parameters of points_to_objmap_kernel() are constants in the specialized calls in points_to_objmap(),
+	so the compiler can fold them in: the per-point spot divide becomes a multiply by a constant (default geometry),
+	or a shift (power-of-two spot sizes). Both give the same spots as the generic divide, truncating towards zero.
+*/
+static inline __attribute__((always_inline)) void points_to_objmap_kernel(pulutof_ctx_t* ctx, pulutof_frame_t *in, int sidx,
+	const frame_points_t* pts, const float plane[3], int xs, int ys, int xmid, int ymid, int spot_size, int use_shift, int spot_shift)
+{
+	volatile tof3d_scan_t* scan = &ctx->tof3ds[ctx->tof3d_wr];
+
+	/*
+		for converting to absolute world coordinates, if that's needed in the future:
+	
+	float robot_ang = ANG32TORAD(in->robot_pos.ang);
+	float robot_x = in->robot_pos.x;
+	float robot_y = in->robot_pos.y;
+previous
+	float sensor_ang = robot_ang + sensor_mounts[sidx].ang_rel_robot;
+	float sensor_x = robot_x + cos(robot_ang)*sensor_mounts[sidx].x_rel_robot;
+	float sensor_y = robot_y + sin(robot_ang)*sensor_mounts[sidx].y_rel_robot;
 	*/
 
-						if(do_send_pointcloud == 1) // relative to robot
-						{
-							if(tof3ds[tof3d_wr].n_points < 4*TOF_XS*TOF_YS)
-							{
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].x = x;
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].y = y;
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].z = z;
-								tof3ds[tof3d_wr].n_points++;
-							}
-						}
-						else if(do_send_pointcloud == 2) // in world coordinates
-						{
-							if(tof3ds[tof3d_wr].n_points < 4*TOF_XS*TOF_YS)
-							{
-								float robot_ang = ANG32TORAD(-1*in->robot_pos.ang);
-								float x_world = d * cos(ver_ang + sensor_yang) * cos(hor_ang + sensor_ang + robot_ang) + sensor_x + in->robot_pos.x;
-								float y_world = -1* (d * cos(ver_ang + sensor_yang) * sin(hor_ang + sensor_ang + robot_ang)) + sensor_y + in->robot_pos.y;
-
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].x = x_world;
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].y = y_world;
-								tof3ds[tof3d_wr].cloud[tof3ds[tof3d_wr].n_points].z = z;
-								tof3ds[tof3d_wr].n_points++;
-							}
-						}
+	float sensor_x = sensor_mounts[sidx].x_rel_robot;
+	float sensor_y = sensor_mounts[sidx].y_rel_robot;
+
+	int do_send_pointcloud = abs(ctx->set.send_pointcloud);
+	int do_elevmap = scan->elevmap_valid;
 
-						uint8_t new_val = 0;
-						if( z < -230.0)
-							new_val = TOF3D_BIG_DROP;
-						else if(z < -180.0)
-							new_val = TOF3D_SMALL_DROP;
-						else if((d < 600.0 && z < 80.0) || z < 120.0)
-							new_val = TOF3D_FLOOR;
-						else if((d < 600.0 && z < 110.0) || z < 150.0)
-							new_val = TOF3D_THRESHOLD;
-						else if(z < 265.0)
-							new_val = TOF3D_SMALL_ITEM;
-						else if(z < 295.0)
-							new_val = TOF3D_WALL;
-						else if(z < 1500.0)
-							new_val = TOF3D_BIG_ITEM;
-						else if(z < 2050.0)
-							new_val = TOF3D_LOW_CEILING;
-
-						if(new_val > tof3ds[tof3d_wr].objmap[yspot*TOF3D_HMAP_XSPOTS+xspot])
-							tof3ds[tof3d_wr].objmap[yspot*TOF3D_HMAP_XSPOTS+xspot] = new_val;
+	for(int i = 0; i < TOF_XS*TOF_YS; i++)
+	{
+		if(pts->flags[i] == PT_NONE)
+			continue;
+
+		float x = pts->x[i];
+		float y = pts->y[i];
+		float d = pts->d[i];
+		float z = pts->z[i] - (plane[0]*x + plane[1]*y + plane[2]); // Height above the estimated floor
+
+		if(z > 700 || (z > -180.0 && z < 130.0) || pts->flags[i] == PT_STRONG)
+		{
+			// Data proving level floor is accepted with fewer samples
+			// High-z data is also accepted with fewer samples; else we miss obvious small high obstacles
+			// Otherwise, we require enough samples to be sure.
+
+			int xi = (int)x, yi = (int)y; // trunc(trunc(x)/n) == trunc(x/n)
+			int xspot, yspot;
+			if(use_shift)
+			{
+				int round = (1<<spot_shift)-1;
+				xspot = ((xi + (xi < 0 ? round : 0)) >> spot_shift) + xmid;
+				yspot = ((yi + (yi < 0 ? round : 0)) >> spot_shift) + ymid;
+			}
+			else
+			{
+				xspot = xi/spot_size + xmid;
+				yspot = yi/spot_size + ymid;
+			}
+
+			if(xspot < 0 || xspot >= xs || yspot < 0 || yspot >= ys)
+			{
+				//ignored++;
+				continue;
+			}
+
+			if(do_elevmap)
+			{
+				int zi = z;
+				if(zi > -2000 && zi < 2000)
+				{
+					volatile tof3d_elev_t* e = &scan->elevmap[yspot*xs+xspot];
+					if(e->n_samples == 0)
+					{
+						e->min_z = e->max_z = zi;
 					}
+					else
+					{
+						if(zi < e->min_z) e->min_z = zi;
+						if(zi > e->max_z) e->max_z = zi;
+					}
+					if(e->n_samples < UINT16_MAX)
+						e->n_samples++;
+				}
+			}
 
+			// The point cloud keeps the geometry of the mount table; only the
+			// classification is relative to the estimated floor.
+			if(do_send_pointcloud == 1) // relative to robot
+			{
+				if(scan->n_points < 4*TOF_XS*TOF_YS)
+				{
+					scan->cloud[scan->n_points].x = x;
+					scan->cloud[scan->n_points].y = y;
+					scan->cloud[scan->n_points].z = pts->z[i];
+					scan->cloud_sidx[scan->n_points] = sidx;
+					scan->cloud_ampl[scan->n_points] = in->ampl[i];
+					scan->n_points++;
 				}
-				
 			}
-			
+			else if(do_send_pointcloud == 2) // in world coordinates
+			{
+				if(scan->n_points < 4*TOF_XS*TOF_YS)
+				{
+					// Rotate the sensor-relative part of the point by the robot angle
+					float robot_ang = ANG32TORAD(-1*in->robot_pos.ang);
+					float rx = x - sensor_x, ry = sensor_y - y;
+					float x_world = rx*cos(robot_ang) - ry*sin(robot_ang) + sensor_x + in->robot_pos.x;
+					float y_world = -1*(ry*cos(robot_ang) + rx*sin(robot_ang)) + sensor_y + in->robot_pos.y;
+
+					scan->cloud[scan->n_points].x = x_world;
+					scan->cloud[scan->n_points].y = y_world;
+					scan->cloud[scan->n_points].z = pts->z[i];
+					scan->cloud_sidx[scan->n_points] = sidx;
+					scan->cloud_ampl[scan->n_points] = in->ampl[i];
+					scan->n_points++;
+				}
+			}
+
+			uint8_t new_val = 0;
+			if( z < -230.0)
+				new_val = TOF3D_BIG_DROP;
+			else if(z < -180.0)
+				new_val = TOF3D_SMALL_DROP;
+			else if((d < 600.0 && z < 80.0) || z < 120.0)
+				new_val = TOF3D_FLOOR;
+			else if((d < 600.0 && z < 110.0) || z < 150.0)
+				new_val = TOF3D_THRESHOLD;
+			else if(z < 265.0)
+				new_val = TOF3D_SMALL_ITEM;
+			else if(z < 295.0)
+				new_val = TOF3D_WALL;
+			else if(z < 1500.0)
+				new_val = TOF3D_BIG_ITEM;
+			else if(z < 2050.0)
+				new_val = TOF3D_LOW_CEILING;
+
+			objmap_packed_max((objmap_packed_t*)&scan->objmap_packed, xspot, yspot, new_val);
+			objmap_pyramid_max((objmap_pyramid_t*)&scan->objmap_pyramid, xspot, yspot, new_val);
 		}
 	}
 }
 
-static void process_pulutof_frame(pulutof_frame_t *in);
+static void points_to_objmap(pulutof_ctx_t* ctx, pulutof_frame_t *in, int sidx, const frame_points_t* pts, const float plane[3])
+{
+	tof3d_grid_t g = ctx->tof3ds[ctx->tof3d_wr].grid;
+
+	if(g.xs == TOF3D_HMAP_XSPOTS && g.ys == TOF3D_HMAP_YSPOTS && g.xmid == TOF3D_HMAP_XMIDDLE && g.ymid == TOF3D_HMAP_YMIDDLE &&
+	   g.spot_size == TOF3D_HMAP_SPOT_SIZE)
+	{
+		points_to_objmap_kernel(ctx, in, sidx, pts, plane, TOF3D_HMAP_XSPOTS, TOF3D_HMAP_YSPOTS, TOF3D_HMAP_XMIDDLE, TOF3D_HMAP_YMIDDLE,
+			TOF3D_HMAP_SPOT_SIZE, 0, 0);
+	}
+	else if((g.spot_size & (g.spot_size-1)) == 0)
+	{
+		int shift = 0;
+		while((1<<shift) < g.spot_size)
+			shift++;
+		points_to_objmap_kernel(ctx, in, sidx, pts, plane, g.xs, g.ys, g.xmid, g.ymid, g.spot_size, 1, shift);
+	}
+	else
+	{
+		points_to_objmap_kernel(ctx, in, sidx, pts, plane, g.xs, g.ys, g.xmid, g.ymid, g.spot_size, 0, 0);
+	}
+}
+
+/*
+	Organized point cloud: the points of the frame in pixel order, with a normal and a curvature estimate
+	per pixel from the 4-neighbourhood:
 
-static volatile int prev_sidx = -1;
+	normal    = (p[right]-p[left]) x (p[down]-p[up]), normalized, pointing towards the sensor
+	curvature = distance of p from the plane of its neighbours, relative to the neighbour spacing (0 = flat, 255 = sharp edge)
 
-void* pulutof_processing_thread()
+	Pixels without all four neighbours get a zero normal. The loops are branch-free over the rows so that the
+	compiler can vectorize them.
+*/
+static int16_t sat16(float v)
+{
+	return (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : v);
+}
+
+static void points_to_organized(int sidx, int level, const frame_points_t* pts, tof3d_organized_t* out)
 {
-   while (running) {
+	// Neighbours are g pixels apart at the coarser processing levels
+	const int g = proc_levels[level].bin*proc_levels[level].step;
+	const int gy = g*TOF_XS;
+	const float sx = sensor_mounts[sidx].x_rel_robot;
+	const float sy = sensor_mounts[sidx].y_rel_robot;
+	const float sz = sensor_mounts[sidx].z_rel_ground;
+
+	for(int i=0; i<TOF_XS*TOF_YS; i++)
+	{
+		float v = pts->flags[i] != PT_NONE;
+		out->x[i] = sat16(v*pts->x[i]);
+		out->y[i] = sat16(v*pts->y[i]);
+		out->z[i] = sat16(v*pts->z[i]);
+	}
+
+	for(int i=0; i<TOF_XS*TOF_YS/8; i++)
+	{
+		const uint8_t* f = &pts->flags[i*8];
+		out->valid[i] = (f[0]!=0) | (f[1]!=0)<<1 | (f[2]!=0)<<2 | (f[3]!=0)<<3 | (f[4]!=0)<<4 | (f[5]!=0)<<5 | (f[6]!=0)<<6 | (f[7]!=0)<<7;
+	}
+
+	memset(out->nx, 0, sizeof out->nx);
+	memset(out->ny, 0, sizeof out->ny);
+	memset(out->nz, 0, sizeof out->nz);
+	memset(out->curvature, 0, sizeof out->curvature);
+
+	for(int pyy = g; pyy < TOF_YS-g; pyy++)
+	{
+		const float* restrict x = &pts->x[pyy*TOF_XS];
+		const float* restrict y = &pts->y[pyy*TOF_XS];
+		const float* restrict z = &pts->z[pyy*TOF_XS];
+		const uint8_t* restrict f = &pts->flags[pyy*TOF_XS];
+		int8_t* restrict onx = &out->nx[pyy*TOF_XS];
+		int8_t* restrict ony = &out->ny[pyy*TOF_XS];
+		int8_t* restrict onz = &out->nz[pyy*TOF_XS];
+		uint8_t* restrict ocurv = &out->curvature[pyy*TOF_XS];
+
+		for(int pxx = g; pxx < TOF_XS-g; pxx++)
+		{
+			float ok = (f[pxx]!=0) & (f[pxx-g]!=0) & (f[pxx+g]!=0) & (f[pxx-gy]!=0) & (f[pxx+gy]!=0);
+
+			float ax = x[pxx+g]-x[pxx-g],   ay = y[pxx+g]-y[pxx-g],   az = z[pxx+g]-z[pxx-g];
+			float bx = x[pxx+gy]-x[pxx-gy], by = y[pxx+gy]-y[pxx-gy], bz = z[pxx+gy]-z[pxx-gy];
+
+			float nx = ay*bz - az*by;
+			float ny = az*bx - ax*bz;
+			float nz = ax*by - ay*bx;
+
+			// Flip towards the sensor, and zero out the invalid ones, without branches
+			float dot_view = nx*(x[pxx]-sx) + ny*(y[pxx]-sy) + nz*(z[pxx]-sz);
+			float sgn = (dot_view > 0.0f) ? -1.0f : 1.0f;
+			float inv = ok*sgn/sqrtf(nx*nx + ny*ny + nz*nz + 1e-6f);
+			nx *= inv; ny *= inv; nz *= inv;
+
+			float mx = 0.25f*(x[pxx+g]+x[pxx-g]+x[pxx+gy]+x[pxx-gy]);
+			float my = 0.25f*(y[pxx+g]+y[pxx-g]+y[pxx+gy]+y[pxx-gy]);
+			float mz = 0.25f*(z[pxx+g]+z[pxx-g]+z[pxx+gy]+z[pxx-gy]);
+			float off = fabsf(nx*(x[pxx]-mx) + ny*(y[pxx]-my) + nz*(z[pxx]-mz));
+			float spacing = 0.25f*(sqrtf(ax*ax+ay*ay+az*az) + sqrtf(bx*bx+by*by+bz*bz)) + 1e-3f;
+			float curv = 255.0f*off/spacing;
+
+			onx[pxx] = 127.0f*nx;
+			ony[pxx] = 127.0f*ny;
+			onz[pxx] = 127.0f*nz;
+			ocurv[pxx] = (curv > 255.0f) ? 255 : curv;
+		}
+	}
+}
+
+/*
+	Load adaptation: the processing time of each frame is measured, and the processing level is
+	stepped coarser when the average goes over the budget (or when frames pile up in the ring buffer),
+	and finer again when the finer level is expected to fit in the budget with some margin.
+	Average cost is tracked for the current level only: the cost of a level that was left is reset, since the load
+	may be quite different by the time it's considered again. The finer level is predicted from the current
+	level's cost, scaled by the number of pixels processed.
+*/
+
+#define PROC_LEVEL_HOLD 8      // Frames to stay on a level before stepping finer
+#define PROC_EWMA_ALPHA 0.125
+
+static void adapt_proc_level(pulutof_ctx_t* ctx, double elapsed_us)
+{
+	double* proc_cost_us = ctx->proc_cost_us;
+	int proc_budget_us = ctx->set.proc_budget_us;
+	int level = ctx->proc_level;
+
+	if(proc_cost_us[level] == 0.0)
+		proc_cost_us[level] = elapsed_us;
+	else
+		proc_cost_us[level] += PROC_EWMA_ALPHA*(elapsed_us - proc_cost_us[level]);
+
+	int new_level = level;
+	ctx->proc_hold++;
+
+	if(proc_budget_us <= 0)
+	{
+		new_level = 0;
+	}
+	else if(level < NUM_PROC_LEVELS-1 && (proc_cost_us[level] > proc_budget_us || ringbuf_backlog(ctx) > PULUTOF_RINGBUF_LEN/2))
+	{
+		new_level = level+1;
+	}
+	else if(level > 0 && ctx->proc_hold >= PROC_LEVEL_HOLD)
+	{
+		double ratio = (double)(proc_levels[level].bin*proc_levels[level].step)/(proc_levels[level-1].bin*proc_levels[level-1].step);
+		double finer = proc_cost_us[level]*ratio*ratio;
+
+		if(finer < 0.7*proc_budget_us && ringbuf_backlog(ctx) <= 1)
+			new_level = level-1;
+	}
+
+	if(new_level != level)
+	{
+		fprintf(stderr, "INFO: processing level %d (%s), average %.0f us per frame, budget %d us\n",
+			new_level, proc_levels[new_level].name, proc_cost_us[level], proc_budget_us);
+		ctx->proc_level = new_level;
+		ctx->proc_hold = 0;
+		proc_cost_us[level] = 0.0;
+	}
+}
+
+static void distances_to_objmap(pulutof_ctx_t* ctx, pulutof_frame_t *in)
+{
+	volatile tof3d_scan_t* scan = &ctx->tof3ds[ctx->tof3d_wr];
+	frame_points_t* frame_pts = &ctx->frame_pts;
+
+	int sidx = in->sensor_idx;
+	if(sidx > NUM_PULUTOFS-1)
+	{
+		fprintf(stderr, "WARNING: distances_to_objmap: illegal sensor idx coming from hw.\n");
+		return;
+	}
+
+	int level = ctx->proc_level;
+	double t_start = timestamp();
+
+	if(frame_to_points(ctx, in, sidx, level, frame_pts) < 0)
+		return;
+
+	float plane[3] = {0.0, 0.0, 0.0};
+	int plane_ok = 0;
+	if(ctx->set.floor_estimation)
+		plane_ok = estimate_floor(frame_pts, level, plane);
+
+	scan->floor_planes[sidx][0] = plane[0];
+	scan->floor_planes[sidx][1] = plane[1];
+	scan->floor_planes[sidx][2] = plane[2];
+	if(plane_ok)
+		scan->floor_plane_mask |= 1<<sidx;
+
+	points_to_objmap(ctx, in, sidx, frame_pts, plane);
+
+	if(scan->organized_valid)
+		points_to_organized(sidx, level, frame_pts, (tof3d_organized_t*)&scan->organized[sidx]);
+
+	if(level > scan->proc_level)
+		scan->proc_level = level;
+
+	adapt_proc_level(ctx, (timestamp() - t_start)*1.0e6);
+}
+
+/*
+	Scan assembly: frames are placed in the scan by their sensor index, in whatever order they come.
+	The scan is published when every sensor has contributed, when a sensor already in the scan sends
+	its next frame (the others missed this round), or when TOF3D_SCAN_TIMEOUT has passed since the
+	scan was started. sensor_mask of the published scan tells which sensors are included, so one
+	glitching sensor only loses its own part of the coverage.
+*/
+
+#define TOF3D_SCAN_TIMEOUT 0.5 // s
+
+static void process_pulutof_frame(pulutof_ctx_t* ctx, pulutof_frame_t *in);
+static void publish_scan(pulutof_ctx_t* ctx);
+
+void* pulutof_processing_thread(void* arg)
+{
+   pulutof_ctx_t* ctx = arg;
+
+   while (ctx->running) {
 	   
       pulutof_frame_t* p_tof;
 
-      if (p_tof = get_pulutof_frame()) {
-	 process_pulutof_frame(p_tof);
+      if ((p_tof = get_pulutof_frame(ctx))) {
+	 process_pulutof_frame(ctx, p_tof);
       } else {	 
 	 usleep(5000);
       } // if-else
 
-      if (configurate) {                               // start from the begin after configurate
-	 pulutof_ringbuf_wr = pulutof_ringbuf_rd = 0;
-	 prev_sidx = -1;
+      if (ctx->scan_mask && timestamp() - ctx->scan_start > TOF3D_SCAN_TIMEOUT)
+	 publish_scan(ctx);
+
+      if (ctx->configurate) {                          // start from the begin after configurate
+	 ctx->ringbuf_wr = ctx->ringbuf_rd = 0;
+	 ctx->scan_mask = 0;
       } // if
 
    } // while
@@ -488,60 +1104,161 @@ void* pulutof_processing_thread()
 
 } // pulutof_processing_thread
 
+static void open_scan(pulutof_ctx_t* ctx, pulutof_frame_t *in)
+{
+	volatile tof3d_scan_t* scan = &ctx->tof3ds[ctx->tof3d_wr];
+
+	pthread_mutex_lock(&ctx->mutex_grid);
+	scan->grid = ctx->grid;
+	pthread_mutex_unlock(&ctx->mutex_grid);
+	int xs = scan->grid.xs, ys = scan->grid.ys;
+
+	// The scan is accumulated in the packed map (half the working set); objmap is expanded from it when the scan is complete.
+	objmap_packed_init((objmap_packed_t*)&scan->objmap_packed, xs, ys);
+	objmap_pyramid_init((objmap_pyramid_t*)&scan->objmap_pyramid, xs, ys);
+	scan->robot_pos = in->robot_pos; // Replaced by the sensor 2 pose, if it arrives
+	scan->n_points = 0;
+	scan->floor_plane_mask = 0;
+	scan->organized_valid = ctx->set.send_organized;
+	scan->proc_level = 0;
+	scan->raw_depth_sidx = -1;
+	memset((void*)&scan->stamps, 0, sizeof scan->stamps);
+
+	// Latched for the whole scan, so that a half-accumulated elevmap is never marked valid
+	scan->elevmap_valid = ctx->set.send_elevmap;
+	if(scan->elevmap_valid)
+		memset((void*)scan->elevmap, 0, xs*ys*sizeof scan->elevmap[0]);
+
+	ctx->scan_start = timestamp();
+}
 
-static void process_pulutof_frame(pulutof_frame_t *in)
+/*
+	With a scan callback set, the callback gets the scan here, in the processing thread, and the scan is valid until the
+	callback returns. Without one, the scan goes to the ring buffer read by get_tof3d().
+*/
+static void publish_scan(pulutof_ctx_t* ctx)
 {
-	static int running_ok = 0;
+	volatile tof3d_scan_t* scan = &ctx->tof3ds[ctx->tof3d_wr];
+	int missing = ((1<<NUM_PULUTOFS)-1) & ~ctx->scan_mask;
 
-	int sidx = in->sensor_idx;
+	if(missing != ctx->prev_missing_mask)
+	{
+		if(missing)
+			fprintf(stderr, "WARNING: publishing scans without sensors (mask 0x%x missing)\n", missing);
+		else
+			fprintf(stderr, "INFO: all sensors present in scans again\n");
+		ctx->prev_missing_mask = missing;
+	}
 
-	if(sidx > NUM_PULUTOFS-1)
+	for(int i=0; i<NUM_PULUTOFS; i++)
 	{
-		fprintf(stderr, "WARNING:process_pulutof_frame: illegal sensor idx coming from hw.\n");
-		return;
+		if(!(missing & (1<<i)))
+			continue;
+
+		memset((void*)scan->ampl_images[i], 0, sizeof scan->ampl_images[i]);
+		memset((void*)scan->floor_planes[i], 0, sizeof scan->floor_planes[i]);
+		if(scan->organized_valid)
+			memset((void*)scan->organized[i].valid, 0, sizeof scan->organized[i].valid);
 	}
 
-	int expected_sidx = prev_sidx+1; if(expected_sidx >= NUM_PULUTOFS) expected_sidx = 0;
+	scan->sensor_mask = ctx->scan_mask;
 
-	if(running_ok && expected_sidx != sidx)
+	objmap_unpack((objmap_packed_t*)&scan->objmap_packed, (int8_t*)scan->objmap);
+
+	scan->n_objects = 0;
+	scan->objects_valid = ctx->set.send_objlist;
+	if(scan->objects_valid)
 	{
-		fprintf(stderr, "WARNING:process_pulutof_frame: unexpected sensor idx %d, previous was %d, was expecting %d. Ignoring until 0\n", sidx, prev_sidx, expected_sidx);
-		running_ok = 0;
+		tof3d_grid_t g = scan->grid;
+		scan->n_objects = objlist_extract(&ctx->objlist_ws, (int8_t*)scan->objmap,
+			g.xs, g.ys, g.xmid, g.ymid, g.spot_size,
+			TOF3D_OBJECT_MIN_CLASS, 2, (tof3d_object_t*)scan->objects, TOF3D_MAX_OBJECTS);
 	}
 
-	if(sidx == 0)
+	scan->stamps.published = lat_now_ns();
+	if(ctx->scan_cb)
 	{
-		running_ok = 1;
-		
-		memset(tof3ds[tof3d_wr].objmap, 0, 1*TOF3D_HMAP_YSPOTS*TOF3D_HMAP_XSPOTS);
-		tof3ds[tof3d_wr].n_points = 0;
+		ctx->scan_cb(ctx, (tof3d_scan_t*)scan, ctx->scan_cb_arg);
 	}
-
-	if(running_ok)
+	else
 	{
-		distances_to_objmap(in);
-
+		// The consumer may still have output referencing the next slots: those are marked stale (already read)
+		// and stepped past. Only if every other slot is pinned, this scan is dropped and its slot reused.
+		int next = ctx->tof3d_wr;
+		int n_pinned = 0;
+		do
+		{
+			next++; if(next >= TOF3D_RING_BUF_LEN) next = 0;
+		} while(__atomic_load_n(&ctx->tof3d_pins[next], __ATOMIC_ACQUIRE) && ++n_pinned < TOF3D_RING_BUF_LEN-1);
 
-		if(sidx == 2)
+		if(n_pinned == TOF3D_RING_BUF_LEN-1)
 		{
-			tof3ds[tof3d_wr].robot_pos = in->robot_pos;
+			ctx->pinned_skips++;
+			if(ctx->pinned_skips == 1 || ctx->pinned_skips%100 == 0)
+				fprintf(stderr, "WARNING: scan ring full of pinned scans, %d scans dropped so far\n", ctx->pinned_skips);
 		}
-
-		if(sidx == send_raw_tof)
+		else
 		{
-			memcpy(tof3ds[tof3d_wr].raw_depth, in->depth, sizeof tof3ds[tof3d_wr].raw_depth);
+			for(int i=ctx->tof3d_wr+1, k=0; k<n_pinned; i++, k++)
+				__atomic_store_n(&ctx->tof3d_stale[i % TOF3D_RING_BUF_LEN], 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&ctx->tof3d_stale[ctx->tof3d_wr], 0, __ATOMIC_RELEASE);
+			ctx->tof3d_wr = next;
 		}
+	}
 
-		memcpy(tof3ds[tof3d_wr].ampl_images[sidx], in->ampl, sizeof in->ampl);
+	ctx->scan_mask = 0;
+}
 
-		if(sidx == NUM_PULUTOFS-1)
-		{
-			// All sensors done.
-			tof3d_wr++; if(tof3d_wr >= TOF3D_RING_BUF_LEN) tof3d_wr = 0;
-		}
+static void process_pulutof_frame(pulutof_ctx_t* ctx, pulutof_frame_t *in)
+{
+	int sidx = in->sensor_idx;
+
+	if(sidx > NUM_PULUTOFS-1)
+	{
+		fprintf(stderr, "WARNING:process_pulutof_frame: illegal sensor idx coming from hw.\n");
+		return;
+	}
+
+	if(ctx->scan_mask & (1<<sidx))
+		publish_scan(ctx); // Next round already started: the rest of the sensors missed this one
+
+	if(!ctx->scan_mask)
+		open_scan(ctx, in);
+
+	volatile tof3d_scan_t* scan = &ctx->tof3ds[ctx->tof3d_wr];
+
+	// The raw picture is the one from the sensor, before the temporal filter
+	if(sidx == ctx->set.send_raw_tof)
+	{
+		memcpy((void*)scan->raw_depth, in->depth, sizeof scan->raw_depth);
+		scan->raw_depth_sidx = sidx;
+	}
+
+	// Frames from before an exposure change (or any other device command) don't mix with the ones after it
+	int cmds = __atomic_load_n(&ctx->cmd_finished, __ATOMIC_ACQUIRE);
+	if(cmds != ctx->tempfilt_cmds)
+	{
+		for(int i=0; i<NUM_PULUTOFS; i++)
+			tempfilt_reset(&ctx->tempfilts[i]);
+		ctx->tempfilt_cmds = cmds;
 	}
+	tempfilt_apply(&ctx->tempfilts[sidx], ctx->set.temporal_filter, in); // Also notes when it's off
 
-	prev_sidx = sidx;
+	distances_to_objmap(ctx, in);
+	scan->stamps.spi[sidx] = ctx->ringbuf_stamps[(volatile pulutof_frame_t*)in - ctx->ringbuf];
+	scan->stamps.processed[sidx] = lat_now_ns();
+
+	if(sidx == 2)
+	{
+		scan->robot_pos = in->robot_pos;
+	}
+
+	memcpy((void*)scan->ampl_images[sidx], in->ampl, sizeof in->ampl);
+
+	ctx->scan_mask |= 1<<sidx;
+
+	if(ctx->scan_mask == (1<<NUM_PULUTOFS)-1)
+		publish_scan(ctx); // All sensors done.
 }
 
 
@@ -713,6 +1430,17 @@ static void gen_ang_tables()
 		}
 	}
 
+	// Angles at the bin centers for the binned processing levels
+	for(int by=0; by<TOF_YS/2; by++)
+	{
+		for(int bx=0; bx<TOF_XS/2; bx++)
+		{
+			int i0 = (2*by)*TOF_XS+2*bx, i1 = (2*by+1)*TOF_XS+2*bx;
+			x_angs_bin[by*(TOF_XS/2)+bx] = 0.25*(x_angs[i0] + x_angs[i0+1] + x_angs[i1] + x_angs[i1+1]);
+			y_angs_bin[by*(TOF_XS/2)+bx] = 0.25*(y_angs[i0] + y_angs[i0+1] + y_angs[i1] + y_angs[i1+1]);
+		}
+	}
+
 //	print_table();
 
 }
@@ -734,22 +1462,20 @@ static void gen_ang_tables()
 */
 
 
-static uint8_t txbuf[65536]; 
-
-static int poll_availability()
+static int poll_availability(pulutof_ctx_t* ctx)
 {
-	txbuf[4] = dbg_id&0xff;	
+	ctx->txbuf[4] = ctx->dbg_id&0xff;	
 	struct spi_ioc_transfer xfer;
 	struct response { uint32_t header; uint8_t status;} response;
 
 	memset(&xfer, 0, sizeof(xfer)); // unused fields need to be initialized zero.
 	//xfer.tx_buf left at 0 - documented spidev feature to send out zeroes - we don't have anything to send, just want to get what the sensor wants to send us!
-	xfer.tx_buf = txbuf;
+	xfer.tx_buf = ctx->txbuf;
 	xfer.rx_buf = &response;
 	xfer.len = sizeof response;
 	xfer.cs_change = 0; // deassert chip select after the transfer
  
-	if(ioctl(spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+	if(ioctl(ctx->spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
 	{
 		fprintf(stderr, "ERROR: spi ioctl transfer operation failed: %d (%s)\n", errno, strerror(errno));
 		return -1;
@@ -764,119 +1490,254 @@ static int poll_availability()
 	return response.status;
 }
 
-static int read_frame()
+static int read_frame(pulutof_ctx_t* ctx)
 {
-	txbuf[4] = dbg_id&0xff;	
+	volatile pulutof_frame_t* frame = &ctx->ringbuf[ctx->ringbuf_wr];
+	ctx->txbuf[4] = ctx->dbg_id&0xff;	
 	struct spi_ioc_transfer xfer;
 	memset(&xfer, 0, sizeof(xfer)); // unused fields need to be initialized zero.
 
 	//xfer.tx_buf left at 0 - documented spidev feature to send out zeroes - we don't have anything to send, just want to get what the sensor wants to send us!
-	xfer.tx_buf = txbuf;
-	xfer.rx_buf = &pulutof_ringbuf[pulutof_ringbuf_wr];
+	xfer.tx_buf = ctx->txbuf;
+	xfer.rx_buf = frame;
 	xfer.len = sizeof(pulutof_frame_t);
 	xfer.cs_change = 0; // deassert chip select after the transfer
 
-	if(ioctl(spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+	if(ioctl(ctx->spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
 	{
 		fprintf(stderr, "ERROR: spi ioctl transfer operation failed: %d (%s)\n", errno, strerror(errno));
 		return -1;
 	}
+	ctx->ringbuf_stamps[ctx->ringbuf_wr] = lat_now_ns();
 
-	if(verbose_mode)
+	if(ctx->set.verbose)
 	{
 		fprintf(stderr, "Frame (sensor_idx= %d) read ok, pose=(%d,%d,%d). Timing data:\n",
-			pulutof_ringbuf[pulutof_ringbuf_wr].sensor_idx, pulutof_ringbuf[pulutof_ringbuf_wr].robot_pos.x,
-			pulutof_ringbuf[pulutof_ringbuf_wr].robot_pos.y, pulutof_ringbuf[pulutof_ringbuf_wr].robot_pos.ang);
+			frame->sensor_idx, frame->robot_pos.x,
+			frame->robot_pos.y, frame->robot_pos.ang);
 		for(int i=0; i<24; i++)
 		{
-			fprintf(stderr, "%d:%.1f ", i, (float)pulutof_ringbuf[pulutof_ringbuf_wr].timestamps[i]/10.0);
+			fprintf(stderr, "%d:%.1f ", i, (float)frame->timestamps[i]/10.0);
 		}
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Time deltas to:\n");
 		for(int i=1; i<24; i++)
 		{
-			fprintf(stderr, ">%d:%.1f ", i, (float)(pulutof_ringbuf[pulutof_ringbuf_wr].timestamps[i]-pulutof_ringbuf[pulutof_ringbuf_wr].timestamps[i-1])/10.0);
+			fprintf(stderr, ">%d:%.1f ", i, (float)(frame->timestamps[i]-frame->timestamps[i-1])/10.0);
 		}
 		fprintf(stderr, "\n");
 		fprintf(stderr, "dbg_i32:\n");
 		for(int i=0; i<8; i++)
 		{
-			fprintf(stderr, "[%d] %11d  ", i, pulutof_ringbuf[pulutof_ringbuf_wr].dbg_i32[i]);
+			fprintf(stderr, "[%d] %11d  ", i, frame->dbg_i32[i]);
 		}
 		fprintf(stderr, "\n");
 		fprintf(stderr, "\n");
 	}
 
-	int ret = pulutof_ringbuf[pulutof_ringbuf_wr].status;
+	int ret = frame->status;
 
-	pulutof_ringbuf_wr++; if(pulutof_ringbuf_wr >= PULUTOF_RINGBUF_LEN) pulutof_ringbuf_wr = 0;
+	int next = ctx->ringbuf_wr+1; if(next >= PULUTOF_RINGBUF_LEN) next = 0;
+	ctx->ringbuf_wr = next;
 
 	return ret;
 }
 
-void request_tof_quit()
+void request_tof_quit(pulutof_ctx_t* ctx)
+{
+	ctx->running = 0;
+}
+
+/*
+	Queues the command for the poll thread, see pulutof.h. Returns its handle, or -1.
+*/
+int pulutof_command(pulutof_ctx_t* ctx, enum pulutof_commands command_number, int parameter)
 {
-	running = 0;
+	if(!ctx->spi_dev[0])
+	{
+		fprintf(stderr, "ERROR: pulutof_command: no PULUTOF device\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&ctx->mutex_cmd);
+	if(ctx->cmd_next - ctx->cmd_cur >= PULUTOF_CMD_QUEUE_LEN)
+	{
+		pthread_mutex_unlock(&ctx->mutex_cmd);
+		fprintf(stderr, "ERROR: pulutof_command: %d commands already waiting for the device\n", PULUTOF_CMD_QUEUE_LEN);
+		return -1;
+	}
+
+	int handle = ctx->cmd_next++;
+	int i = handle % PULUTOF_CMD_QUEUE_LEN;
+	ctx->cmds[i].handle = handle;
+	ctx->cmds[i].frame.header = command_number;
+	ctx->cmds[i].frame.parameter = (uint32_t)parameter;
+	ctx->cmds[i].state = PULUTOF_CMD_QUEUED;
+	pthread_mutex_unlock(&ctx->mutex_cmd);
+
+	return handle;
 }
 
-void pulutof_command(enum pulutof_commands command_number, int parameter)
+int pulutof_command_state(pulutof_ctx_t* ctx, int handle)
 {
-   struct spi_ioc_transfer xfer;
-   pulutof_command_frame_t cmd;
+	int i = handle % PULUTOF_CMD_QUEUE_LEN;
+	pthread_mutex_lock(&ctx->mutex_cmd);
+	int state = (handle > 0 && ctx->cmds[i].handle == handle) ? ctx->cmds[i].state : -1;
+	pthread_mutex_unlock(&ctx->mutex_cmd);
+	return state;
+}
 
-   cmd.header    = command_number;
-   cmd.parameter = (uint32_t) parameter;
+/*
+	Command state machine of the poll thread:
 
-   memset(&xfer, 0, sizeof(xfer)); // unused fields need to be initialized zero.
-   xfer.tx_buf = &cmd;
-   xfer.rx_buf = NULL;
-   xfer.len = sizeof cmd;
-   xfer.cs_change = 0;              // deassert chip select after the transfer
+	CMD_IDLE -> CMD_FLASHING: the offset calibration writes the flash, and the firmware doesn't answer polls
+	             until it's done; no polling for PULUTOF_CMD_FLASH_MS.
+	CMD_IDLE -> CMD_ACK: the firmware goes to PULUTOF_STATUS_CONFIGURATE once it has taken the command. If it
+	             doesn't within PULUTOF_CMD_ACK_MS, the command didn't need configurating.
+	CMD_FLASHING, CMD_ACK -> CMD_CONFIGURATE: polls until the status is anything else, then the next command
+	             (or the frames) carries on right away.
 
-   pthread_mutex_lock(&mutex_poll_availabity);
-   
-   if (ioctl(spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0) {	   
+	Returns 1 while a command is going on; no frames are read meanwhile.
+*/
+#define CMD_IDLE       0
+#define CMD_FLASHING   1
+#define CMD_ACK        2
+#define CMD_CONFIGURATE 3
 
-      fprintf(stderr, "ERROR: spi ioctl transfer operation failed: %d (%s)\n", errno, strerror(errno));
+#define PULUTOF_CMD_FLASH_MS   7000
+#define PULUTOF_CMD_ACK_MS     1000
+#define PULUTOF_CMD_TIMEOUT_MS 30000 // Gives up waiting for the firmware to leave PULUTOF_STATUS_CONFIGURATE
 
-   } else {
+static void finish_command(pulutof_ctx_t* ctx, int state)
+{
+	pthread_mutex_lock(&ctx->mutex_cmd);
+	ctx->cmds[ctx->cmd_cur % PULUTOF_CMD_QUEUE_LEN].state = state;
+	ctx->cmd_cur++;
+	pthread_mutex_unlock(&ctx->mutex_cmd);
+	__atomic_add_fetch(&ctx->cmd_finished, 1, __ATOMIC_RELEASE);
+
+	ctx->cmd_phase = CMD_IDLE;
+	ctx->configurate = false;
+}
 
-      configurate = true;
-               
-      if (command_number == PULUTOF_COMMAND_CALIBRATE_OFFSET) {
-	 sleep(7);                                               // sleep enough flashing done to be able poll PuluToF
-      } else {
-	 sleep(1);                                               // sleep enough to be able poll PuluToF (no flashing)
-      } // if-else
-	   
-      while (poll_availability() == PULUTOF_STATUS_CONFIGURATE)
-	 ; 
+static int service_commands(pulutof_ctx_t* ctx)
+{
+	if(ctx->cmd_phase == CMD_IDLE)
+	{
+		pthread_mutex_lock(&ctx->mutex_cmd);
+		int pending = ctx->cmd_cur != ctx->cmd_next;
+		pulutof_command_frame_t cmd = ctx->cmds[ctx->cmd_cur % PULUTOF_CMD_QUEUE_LEN].frame;
+		if(pending)
+			ctx->cmds[ctx->cmd_cur % PULUTOF_CMD_QUEUE_LEN].state = PULUTOF_CMD_ACTIVE;
+		pthread_mutex_unlock(&ctx->mutex_cmd);
+
+		if(!pending)
+			return 0;
+
+		struct spi_ioc_transfer xfer;
+		memset(&xfer, 0, sizeof(xfer)); // unused fields need to be initialized zero.
+		xfer.tx_buf = &cmd;
+		xfer.rx_buf = NULL;
+		xfer.len = sizeof cmd;
+		xfer.cs_change = 0;              // deassert chip select after the transfer
+
+		if(ioctl(ctx->spi_fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+		{
+			fprintf(stderr, "ERROR: spi ioctl transfer operation failed: %d (%s)\n", errno, strerror(errno));
+			finish_command(ctx, PULUTOF_CMD_FAILED);
+			return 1;
+		}
+
+		ctx->configurate = true;
+		if(cmd.header == PULUTOF_COMMAND_CALIBRATE_OFFSET)
+		{
+			ctx->cmd_phase = CMD_FLASHING;
+			ctx->cmd_deadline = timestamp() + PULUTOF_CMD_FLASH_MS/1000.0;
+		}
+		else
+		{
+			ctx->cmd_phase = CMD_ACK;
+			ctx->cmd_deadline = timestamp() + PULUTOF_CMD_ACK_MS/1000.0;
+		}
+		return 1;
+	}
 
-      configurate = false;
+	double now = timestamp();
+
+	if(ctx->cmd_phase == CMD_FLASHING)
+	{
+		if(now < ctx->cmd_deadline)
+		{
+			usleep(10000);
+			return 1;
+		}
+		ctx->cmd_phase = CMD_CONFIGURATE;
+		ctx->cmd_deadline = now + PULUTOF_CMD_TIMEOUT_MS/1000.0;
+	}
+
+	int status = poll_availability(ctx);
+
+	if(ctx->cmd_phase == CMD_ACK)
+	{
+		if(status == PULUTOF_STATUS_CONFIGURATE)
+		{
+			ctx->cmd_phase = CMD_CONFIGURATE;
+			ctx->cmd_deadline = now + PULUTOF_CMD_TIMEOUT_MS/1000.0;
+		}
+		else if(now >= ctx->cmd_deadline)
+			finish_command(ctx, PULUTOF_CMD_DONE);
+		else
+			usleep((status < 0) ? 100000 : 1000);
+		return 1;
+	}
 
-   } // if-else
+	if(status != PULUTOF_STATUS_CONFIGURATE)
+		finish_command(ctx, PULUTOF_CMD_DONE);
+	else if(now >= ctx->cmd_deadline)
+	{
+		fprintf(stderr, "ERROR: PULUTOF still configurating %d s after command 0x%08x\n",
+			PULUTOF_CMD_TIMEOUT_MS/1000, ctx->cmds[ctx->cmd_cur % PULUTOF_CMD_QUEUE_LEN].frame.header);
+		finish_command(ctx, PULUTOF_CMD_FAILED);
+	}
+	else
+		usleep(1000);
+	return 1;
+}
 
-   pthread_mutex_unlock(&mutex_poll_availabity);
-	 
-} // pulutof_command
+// The poll thread is gone: nobody will send the queued commands
+static void fail_commands(pulutof_ctx_t* ctx)
+{
+	pthread_mutex_lock(&ctx->mutex_cmd);
+	for(; ctx->cmd_cur != ctx->cmd_next; ctx->cmd_cur++)
+		ctx->cmds[ctx->cmd_cur % PULUTOF_CMD_QUEUE_LEN].state = PULUTOF_CMD_FAILED;
+	pthread_mutex_unlock(&ctx->mutex_cmd);
+	ctx->configurate = false;
+}
 
-void* pulutof_poll_thread()
+void* pulutof_poll_thread(void* arg)
 {
-	gen_ang_tables();
-	init_spi();
-	while (running)
+	pulutof_ctx_t* ctx = arg;
+
+	if(init_spi(ctx) < 0)
+	{
+		fail_commands(ctx);
+		return NULL;
+	}
+
+	while (ctx->running)
 	{
-		int next = pulutof_ringbuf_wr+1; if(next >= PULUTOF_RINGBUF_LEN) next = 0;
-		if (next == pulutof_ringbuf_rd)
+		if(service_commands(ctx))
+			continue;
+
+		int next = ctx->ringbuf_wr+1; if(next >= PULUTOF_RINGBUF_LEN) next = 0;
+		if (next == ctx->ringbuf_rd)
 		{
 			fprintf(stderr, "WARNING: PULUTOF ringbuf overflow prevented, ignoring images...\n");
 			usleep(250000);
 			continue;
 		}
 
-		pthread_mutex_lock(&mutex_poll_availabity);
-		int avail = poll_availability();
-		pthread_mutex_unlock(&mutex_poll_availabity);
+		int avail = poll_availability(ctx);
 
 		if (avail < 0)
 		{
@@ -896,13 +1757,72 @@ void* pulutof_poll_thread()
 			continue;
 		}
 
-		read_frame();
+		read_frame(ctx);
 
 
 		usleep(1000);
 	}
-	deinit_spi();
+	deinit_spi(ctx);
+	fail_commands(ctx);
 
 	return NULL;
 }
 
+/*
+	spi_dev = NULL: no hardware, frames only come from pulutof_feed_frame().
+	The context is big (the scan ring buffer), so it lives on the heap.
+*/
+pulutof_ctx_t* pulutof_create(const char* spi_dev)
+{
+	pthread_once(&ang_tables_once, gen_ang_tables);
+
+	pulutof_ctx_t* ctx = calloc(1, sizeof *ctx);
+	if(!ctx)
+	{
+		fprintf(stderr, "ERROR: Out of memory in pulutof_create\n");
+		return NULL;
+	}
+
+	if(spi_dev)
+		snprintf(ctx->spi_dev, sizeof ctx->spi_dev, "%s", spi_dev);
+	ctx->spi_fd = -1;
+	ctx->running = true;
+	ctx->cmd_next = ctx->cmd_cur = 1;
+	pthread_mutex_init(&ctx->mutex_cmd, NULL);
+	pthread_mutex_init(&ctx->mutex_grid, NULL);
+
+	ctx->set.send_raw_tof = -1;
+	ctx->set.floor_estimation = 1;
+	ctx->grid = (tof3d_grid_t){TOF3D_HMAP_XSPOTS, TOF3D_HMAP_YSPOTS, TOF3D_HMAP_XMIDDLE, TOF3D_HMAP_YMIDDLE, TOF3D_HMAP_SPOT_SIZE};
+
+	return ctx;
+}
+
+// The threads using the context must have been stopped (request_tof_quit()) and joined first.
+void pulutof_destroy(pulutof_ctx_t* ctx)
+{
+	if(!ctx)
+		return;
+
+	pthread_mutex_destroy(&ctx->mutex_cmd);
+	pthread_mutex_destroy(&ctx->mutex_grid);
+	free(ctx);
+}
+
+pulutof_settings_t* pulutof_settings(pulutof_ctx_t* ctx)
+{
+	return &ctx->set;
+}
+
+int pulutof_proc_level(pulutof_ctx_t* ctx)
+{
+	return ctx->proc_level;
+}
+
+// Set before starting the processing thread.
+void pulutof_set_scan_callback(pulutof_ctx_t* ctx, pulutof_scan_cb_t cb, void* arg)
+{
+	ctx->scan_cb = cb;
+	ctx->scan_cb_arg = arg;
+}
+
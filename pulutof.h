@@ -25,6 +25,9 @@
 #ifndef PULUTOF_H
 #define PULUTOF_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define ANG32TORAD(x) ( ((float)((uint32_t)(x)))/683565275.576432)
 
 typedef struct __attribute__((packed))
@@ -56,6 +59,19 @@ enum pulutof_commands {
    PULUTOF_COMMAND_HDR_MULTIPLIER   = 0x00000003
 };
 
+/*
+	Device commands are queued, and the poll thread applies them one at a time: it sends the command, stops
+	reading frames while the firmware is in PULUTOF_STATUS_CONFIGURATE, and carries on as soon as it's out.
+	pulutof_command() returns right away with a handle (> 0) for pulutof_command_state(), or -1 if there's
+	no device or the queue is full.
+*/
+enum pulutof_command_state {
+   PULUTOF_CMD_QUEUED,
+   PULUTOF_CMD_ACTIVE,  // Sent, the firmware is configurating
+   PULUTOF_CMD_DONE,
+   PULUTOF_CMD_FAILED
+};
+
 #define TOF_XS 160
 #define TOF_YS 60
 
@@ -88,20 +104,45 @@ typedef struct __attribute__((packed))
 
 } pulutof_frame_t;
 
+// depth[] is aligned even though the frame struct is packed: it starts at byte 20, and frames are a multiple of 4 bytes.
+static inline uint16_t* pulutof_frame_depth(pulutof_frame_t* f)
+{
+	return (uint16_t*)((uint8_t*)f + offsetof(pulutof_frame_t, depth));
+}
+
 typedef struct __attribute__((packed)) pulutof_command {
    uint32_t header;
    uint32_t parameter;
 } pulutof_command_frame_t;
 
-void pulutof_command(enum pulutof_commands command_number, int parameter);
-void request_tof_quit();
-void* pulutof_poll_thread();
-void* pulutof_processing_thread();
+/*
+	All the state of one PULUTOF kit lives in a context, so that several kits (or a replay next to live data) can
+	be run in one process. The driver is built as libpulutof.a.
+
+	Typical use:
+		ctx = pulutof_create("/dev/spidev0.0");
+		start pulutof_poll_thread(ctx) and pulutof_processing_thread(ctx) as threads
+		get_tof3d(ctx) for each finished scan, or a pulutof_set_scan_callback() set before starting the threads
+		request_tof_quit(ctx), join the threads, pulutof_destroy(ctx)
+
+	For replay, create the context with spi_dev = NULL, only start the processing thread, and pulutof_feed_frame() the frames.
+*/
+typedef struct pulutof_ctx pulutof_ctx_t;
 
-pulutof_frame_t* get_pulutof_frame();
+pulutof_ctx_t* pulutof_create(const char* spi_dev);
+void pulutof_destroy(pulutof_ctx_t* ctx);
 
-void pulutof_decr_dbg();
-void pulutof_incr_dbg();
+int pulutof_command(pulutof_ctx_t* ctx, enum pulutof_commands command_number, int parameter);
+int pulutof_command_state(pulutof_ctx_t* ctx, int handle); // -1 = unknown handle (or too old to remember)
+void request_tof_quit(pulutof_ctx_t* ctx);
+void* pulutof_poll_thread(void* ctx);
+void* pulutof_processing_thread(void* ctx);
+
+pulutof_frame_t* get_pulutof_frame(pulutof_ctx_t* ctx);
+int pulutof_feed_frame(pulutof_ctx_t* ctx, const pulutof_frame_t* frame);
+
+void pulutof_decr_dbg(pulutof_ctx_t* ctx);
+void pulutof_incr_dbg(pulutof_ctx_t* ctx);
 void pulutof_cal_offset(uint8_t idx);
 
 /*
@@ -132,6 +173,12 @@ void pulutof_cal_offset(uint8_t idx);
 #define TOF3D_FLOOR          1
 #define TOF3D_UNSEEN         0
 
+/*
+	Objmap grid geometry. The defaults below can be changed at startup with tof3d_set_grid() (-g on the command line);
+	the map buffers are allocated for the maximum size, TOF3D_HMAP_MAX_XSPOTS x TOF3D_HMAP_MAX_YSPOTS.
+	Limited so that the whole map still fits in one TCP hmap message.
+*/
+
 #define TOF3D_HMAP_SPOT_SIZE 40
 
 
@@ -142,22 +189,147 @@ void pulutof_cal_offset(uint8_t idx);
 
 #define HMAP_BLOCK_MM 40
 
-extern volatile int send_raw_tof; // which sensor id to send as raw_depth, <0 = N/A
-extern volatile int send_pointcloud; // 0 = off, 1 = relative to robot, 2 = relative to actual world coords
+#define TOF3D_HMAP_MAX_XSPOTS 240
+#define TOF3D_HMAP_MAX_YSPOTS 240
+#define TOF3D_HMAP_MIN_SPOT_SIZE 10
+#define TOF3D_HMAP_MAX_SPOT_SIZE 200 // The hmap messages carry the spot size in one byte
+
+typedef struct
+{
+	int xs;        // Map size in spots
+	int ys;
+	int xmid;      // Robot origin in spots
+	int ymid;
+	int spot_size; // mm
+} tof3d_grid_t;
+
+int tof3d_set_grid(pulutof_ctx_t* ctx, int xs, int ys, int spot_size);
+
+#include "objmap.h"
+
+/*
+	Processing settings of a context, see pulutof_settings(). Can be changed at any time; the ones affecting
+	the scan contents take effect from the next scan.
+*/
+typedef struct
+{
+	volatile int verbose; // Print the timing data of every frame read
+	volatile int send_raw_tof; // which sensor id to send as raw_depth, <0 = N/A
+	volatile int send_pointcloud; // 0 = off, 1 = relative to robot, 2 = relative to actual world coords (negative: same, abs value used)
+	volatile int send_elevmap; // 0 = off, 1 = accumulate tof3d_scan_t elevmap
+	volatile int temporal_filter; // 0 = off, -1 = median of the last 3 frames, 2..8 = mean of the last n frames (see tempfilt.h)
+	volatile int proc_budget_us; // Processing time budget per frame; over it, processing steps to coarser levels. 0 = off
+	volatile int floor_estimation; // 1 = classify relative to the floor plane estimated per frame, 0 = relative to z=0
+	volatile int send_organized; // 0 = off, 1 = populate tof3d_scan_t organized clouds
+	volatile int send_objlist; // 0 = off, 1 = cluster the objmap into tof3d_scan_t objects
+} pulutof_settings_t;
+
+pulutof_settings_t* pulutof_settings(pulutof_ctx_t* ctx);
+int pulutof_proc_level(pulutof_ctx_t* ctx); // Active processing level: 0 = full resolution, 1 = 2x2 binning, 2 = 2x2 binning + stride 2
+
+/*
+	2.5D elevation map cell: z range (mm, relative to the ground) of all the points hitting the cell.
+	n_samples == 0: no data, min_z and max_z are meaningless.
+*/
+typedef struct
+{
+	int16_t min_z;
+	int16_t max_z;
+	uint16_t n_samples;
+} tof3d_elev_t;
+
+/*
+	Obstacle found by clustering the objmap (see objlist.h). Coordinates in mm relative to the robot, like the objmap.
+*/
+typedef struct
+{
+	int16_t x0;        // Bounding box
+	int16_t y0;
+	int16_t x1;
+	int16_t y1;
+	uint8_t cls;       // Highest priority class (TOF3D_*) in the object
+	uint16_t min_dist; // Distance of the closest cell to the robot origin
+	uint16_t n_cells;
+} tof3d_object_t;
+
+/*
+	Organized point cloud of one sensor: robot coordinates (mm, mount table geometry, saturated to int16) in
+	pixel order, bit i%8 of valid[i/8] set when pixel i has a point. Normal (unit length scaled to 127) and
+	curvature are zero where they couldn't be computed.
+*/
+typedef struct
+{
+	int16_t x[TOF_XS*TOF_YS];
+	int16_t y[TOF_XS*TOF_YS];
+	int16_t z[TOF_XS*TOF_YS];
+	int8_t nx[TOF_XS*TOF_YS];
+	int8_t ny[TOF_XS*TOF_YS];
+	int8_t nz[TOF_XS*TOF_YS];
+	uint8_t curvature[TOF_XS*TOF_YS];
+	uint8_t valid[TOF_XS*TOF_YS/8];
+} tof3d_organized_t;
+
+/*
+	Pipeline stamps of a scan, CLOCK_MONOTONIC in ns (see latency.h); 0 = not stamped, e.g. the sensor isn't in the scan.
+*/
+typedef struct
+{
+	uint64_t spi[4];       // Frame of sensor n read from SPI (or fed with pulutof_feed_frame())
+	uint64_t processed[4]; // distances_to_objmap() done with that frame
+	uint64_t published;    // Scan complete, handed to the callback or to get_tof3d()
+	uint64_t consumed;     // Set by the consumer, for its own latency tracking
+} tof3d_stamps_t;
+
+#define TOF3D_MAX_OBJECTS 16
+#define TOF3D_OBJECT_MIN_CLASS TOF3D_SMALL_DROP // Cells with this class or above are obstacles
 
 typedef struct
 {
 	pos_t robot_pos;
-	int8_t objmap[TOF3D_HMAP_YSPOTS*TOF3D_HMAP_XSPOTS];
+	tof3d_grid_t grid; // Geometry of the maps of this scan; the map arrays are used up to grid.xs*grid.ys
+	int sensor_mask; // Bit n is set when sensor n contributed to this scan; the others' data is empty
+	int8_t objmap[TOF3D_HMAP_MAX_YSPOTS*TOF3D_HMAP_MAX_XSPOTS];
+	objmap_packed_t objmap_packed; // Same map, 4 bits per cell in 8x8 tiles, see objmap.h
+	objmap_pyramid_t objmap_pyramid; // Max-pooled coarse levels (80, 160, 320 mm)
 	uint16_t raw_depth[160*60]; // for development purposes: populated only when enabled, with only 1 sensor at the time
+	int raw_depth_sidx; // Sensor of raw_depth, -1 = not populated in this scan
 	uint8_t ampl_images[4][160*60];
 
+	// Estimated floor plane per sensor, z = [0]*x + [1]*y + [2] in robot coordinates (mm)
+	// Bit n of floor_plane_mask is set when the estimate of sensor n was good; else its plane is z=0.
+	float floor_planes[4][3];
+	int floor_plane_mask;
+
+	int proc_level; // Coarsest processing level used for this scan (see proc_level)
+
+	tof3d_stamps_t stamps;
+
+	// Elevation map is only populated when enabled:
+	int elevmap_valid;
+	tof3d_elev_t elevmap[TOF3D_HMAP_MAX_YSPOTS*TOF3D_HMAP_MAX_XSPOTS];
+
+	// Organized clouds, only populated when enabled:
+	int organized_valid;
+	tof3d_organized_t organized[4];
+
+	// Obstacle list, only populated when enabled:
+	int objects_valid;
+	int n_objects;
+	tof3d_object_t objects[TOF3D_MAX_OBJECTS];
+
 	// Point cloud is only populated when enabled:
 	int n_points;
 	xyz_t cloud[4*TOF_XS*TOF_YS];
+	uint8_t cloud_sidx[4*TOF_XS*TOF_YS]; // Sensor index of each point
+	uint8_t cloud_ampl[4*TOF_XS*TOF_YS]; // Amplitude of the pixel of each point
 } tof3d_scan_t;
 
-tof3d_scan_t* get_tof3d();
+tof3d_scan_t* get_tof3d(pulutof_ctx_t* ctx);
+int pulutof_pin_scan(pulutof_ctx_t* ctx, const tof3d_scan_t* scan);   // Keeps a get_tof3d() scan valid until unpinned
+int pulutof_unpin_scan(pulutof_ctx_t* ctx, const tof3d_scan_t* scan);
+
+typedef void (*pulutof_scan_cb_t)(pulutof_ctx_t* ctx, tof3d_scan_t* scan, void* arg);
+void pulutof_set_scan_callback(pulutof_ctx_t* ctx, pulutof_scan_cb_t cb, void* arg);
 
 
 
@@ -0,0 +1,376 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Asynchronous point cloud recorder, see recorder.h
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pulutof.h"
+#include "pcio.h"
+#include "depthcodec.h"
+#include "recorder.h"
+
+#define MAX_SEGMENTS 4096 // Remembered for the disk usage cap
+
+/*
+	Slot i is owned by the submitter when it's not in the queue, by the writer thread while it is.
+	Only the fields pcio (or the capture) uses are copied to the slot scans.
+*/
+struct recorder
+{
+	recorder_cfg_t cfg;
+	char dir[256];
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+
+	tof3d_scan_t** slots;
+	int rd, n_queued;
+
+	recorder_stats_t stats;
+
+	// Writer thread only:
+	uint8_t* buf;
+	int seg_fd;
+	int seg_idx;
+	long seg_bytes;
+	int unsynced;
+	int seg_ring[MAX_SEGMENTS]; // Indices of the segments written, oldest first
+	long seg_sizes[MAX_SEGMENTS];
+	int seg_first, seg_count;
+	long long total_bytes;
+};
+
+static void segment_name(recorder_t* rec, int idx, char* out, int len)
+{
+	if(rec->cfg.format == RECORDER_CAPTURE)
+		snprintf(out, len, "%s/capture_%06d.tofcap", rec->dir, idx);
+	else
+		snprintf(out, len, "%s/cloud_%06d.%s", rec->dir, idx, pcio_file_ext(rec->cfg.format));
+}
+
+static int capture_max_size()
+{
+	return sizeof(recorder_capture_header_t) + dcodec_max_size(2, TOF_XS, TOF_YS) + dcodec_max_size(1, TOF_XS, TOF_YS);
+}
+
+static int format_capture(uint8_t* out, const tof3d_scan_t* scan, int compress)
+{
+	int sidx = scan->raw_depth_sidx;
+	recorder_capture_header_t hdr;
+	uint8_t* p = out + sizeof hdr;
+
+	hdr.magic = RECORDER_CAPTURE_MAGIC;
+	hdr.sensor = sidx;
+	hdr.compressed = compress;
+	hdr.xs = TOF_XS;
+	hdr.ys = TOF_YS;
+	hdr.robot_pos = scan->robot_pos;
+
+	if(compress)
+	{
+		hdr.depth_len = dcodec_encode(p, scan->raw_depth, 2, TOF_XS, TOF_YS);
+		hdr.ampl_len = dcodec_encode(p + hdr.depth_len, scan->ampl_images[sidx], 1, TOF_XS, TOF_YS);
+	}
+	else
+	{
+		hdr.depth_len = sizeof scan->raw_depth;
+		hdr.ampl_len = sizeof scan->ampl_images[sidx];
+		memcpy(p, scan->raw_depth, hdr.depth_len);
+		memcpy(p + hdr.depth_len, scan->ampl_images[sidx], hdr.ampl_len);
+	}
+
+	memcpy(out, &hdr, sizeof hdr);
+	return sizeof hdr + hdr.depth_len + hdr.ampl_len;
+}
+
+static void close_segment(recorder_t* rec)
+{
+	if(rec->seg_fd < 0)
+		return;
+
+	if(rec->cfg.fsync_every >= 0)
+		fsync(rec->seg_fd);
+	close(rec->seg_fd);
+	rec->seg_fd = -1;
+	rec->unsynced = 0;
+
+	if(rec->seg_count == MAX_SEGMENTS) // Forget the oldest one; it just won't be deleted
+	{
+		rec->seg_first = (rec->seg_first+1) % MAX_SEGMENTS;
+		rec->seg_count--;
+	}
+	int i = (rec->seg_first + rec->seg_count) % MAX_SEGMENTS;
+	rec->seg_ring[i] = rec->seg_idx;
+	rec->seg_sizes[i] = rec->seg_bytes;
+	rec->seg_count++;
+	rec->seg_idx++;
+}
+
+static void enforce_cap(recorder_t* rec)
+{
+	while(rec->cfg.max_total_bytes > 0 && rec->total_bytes > rec->cfg.max_total_bytes && rec->seg_count > 0)
+	{
+		char fname[300];
+		segment_name(rec, rec->seg_ring[rec->seg_first], fname, sizeof fname);
+		if(unlink(fname) < 0)
+			fprintf(stderr, "WARNING: recorder: deleting %s failed: %d (%s)\n", fname, errno, strerror(errno));
+
+		rec->total_bytes -= rec->seg_sizes[rec->seg_first];
+		rec->seg_first = (rec->seg_first+1) % MAX_SEGMENTS;
+		rec->seg_count--;
+
+		pthread_mutex_lock(&rec->mutex);
+		rec->stats.segments_deleted++;
+		pthread_mutex_unlock(&rec->mutex);
+	}
+}
+
+static int open_segment(recorder_t* rec)
+{
+	char fname[300];
+	segment_name(rec, rec->seg_idx, fname, sizeof fname);
+	rec->seg_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(rec->seg_fd < 0)
+	{
+		fprintf(stderr, "ERROR: recorder: opening %s failed: %d (%s)\n", fname, errno, strerror(errno));
+		return -1;
+	}
+	rec->seg_bytes = 0;
+	return 0;
+}
+
+// Returns the number of bytes written, or -1 on error
+static int write_scan(recorder_t* rec, const tof3d_scan_t* scan)
+{
+	int len;
+	if(rec->cfg.format == RECORDER_CAPTURE)
+		len = format_capture(rec->buf, scan, rec->cfg.compress);
+	else
+		len = pcio_format(rec->buf, rec->cfg.format, rec->cfg.columns, scan);
+
+	if(!rec->cfg.dir)
+		return (pcio_write_all(rec->cfg.fd, rec->buf, len) < 0) ? -1 : len;
+
+	int one_per_file = rec->cfg.format == PCIO_PLY || rec->cfg.format == PCIO_PCD;
+
+	if(rec->seg_fd >= 0 && (one_per_file || rec->seg_bytes + len > rec->cfg.segment_bytes))
+		close_segment(rec);
+
+	if(rec->seg_fd < 0 && open_segment(rec) < 0)
+		return -1;
+
+	int ret = pcio_write_all(rec->seg_fd, rec->buf, len);
+	rec->seg_bytes += len;
+	rec->total_bytes += len;
+
+	if(rec->cfg.fsync_every > 0 && ++rec->unsynced >= rec->cfg.fsync_every)
+	{
+		fsync(rec->seg_fd);
+		rec->unsynced = 0;
+	}
+
+	// The segment being written counts towards the cap, but only closed ones are deleted.
+	enforce_cap(rec);
+	return (ret < 0) ? -1 : len;
+}
+
+static void* recorder_thread(void* arg)
+{
+	recorder_t* rec = arg;
+
+	while(1)
+	{
+		pthread_mutex_lock(&rec->mutex);
+		while(rec->n_queued == 0 && !rec->stop)
+			pthread_cond_wait(&rec->cond, &rec->mutex);
+		if(rec->n_queued == 0) // Stopped, and everything written
+		{
+			pthread_mutex_unlock(&rec->mutex);
+			break;
+		}
+		tof3d_scan_t* scan = rec->slots[rec->rd];
+		pthread_mutex_unlock(&rec->mutex);
+
+		int len = write_scan(rec, scan);
+
+		pthread_mutex_lock(&rec->mutex);
+		rec->rd = (rec->rd+1) % rec->cfg.queue_len;
+		rec->n_queued--;
+		if(len < 0)
+			rec->stats.failed++;
+		else
+		{
+			rec->stats.written++;
+			rec->stats.bytes += len;
+		}
+		pthread_mutex_unlock(&rec->mutex);
+	}
+
+	close_segment(rec);
+	return NULL;
+}
+
+recorder_t* recorder_start(const recorder_cfg_t* cfg)
+{
+	recorder_t* rec = calloc(1, sizeof *rec);
+	if(!rec)
+	{
+		fprintf(stderr, "ERROR: Out of memory in recorder_start\n");
+		return NULL;
+	}
+
+	rec->cfg = *cfg;
+	if(rec->cfg.queue_len <= 0) rec->cfg.queue_len = RECORDER_DEFAULT_QUEUE_LEN;
+	if(rec->cfg.segment_bytes <= 0) rec->cfg.segment_bytes = RECORDER_DEFAULT_SEGMENT_BYTES;
+	if(rec->cfg.fsync_every == 0) rec->cfg.fsync_every = RECORDER_DEFAULT_FSYNC_EVERY;
+	if(cfg->dir)
+	{
+		snprintf(rec->dir, sizeof rec->dir, "%s", cfg->dir);
+		rec->cfg.dir = rec->dir;
+	}
+	rec->seg_fd = -1;
+
+	if(rec->cfg.format == RECORDER_CAPTURE)
+		rec->buf = malloc(capture_max_size());
+	else
+		rec->buf = malloc(pcio_max_size(rec->cfg.format, rec->cfg.columns, 4*TOF_XS*TOF_YS));
+	rec->slots = calloc(rec->cfg.queue_len, sizeof rec->slots[0]);
+	if(!rec->buf || !rec->slots)
+		goto fail;
+	for(int i=0; i<rec->cfg.queue_len; i++)
+	{
+		if(!(rec->slots[i] = malloc(sizeof(tof3d_scan_t))))
+			goto fail;
+	}
+
+	pthread_mutex_init(&rec->mutex, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+
+	int ret;
+	if( (ret = pthread_create(&rec->thread, NULL, recorder_thread, rec)) )
+	{
+		fprintf(stderr, "ERROR: recorder thread creation, ret = %d\n", ret);
+		pthread_mutex_destroy(&rec->mutex);
+		pthread_cond_destroy(&rec->cond);
+		goto fail;
+	}
+
+	return rec;
+
+	fail:
+	if(rec->slots)
+	{
+		for(int i=0; i<rec->cfg.queue_len; i++)
+			free(rec->slots[i]);
+	}
+	free(rec->slots);
+	free(rec->buf);
+	free(rec);
+	fprintf(stderr, "ERROR: recorder_start failed\n");
+	return NULL;
+}
+
+/*
+	Never blocks on the writer. Returns 0 if the scan was queued, -1 if it was dropped.
+*/
+int recorder_submit(recorder_t* rec, const tof3d_scan_t* scan)
+{
+	int capture = rec->cfg.format == RECORDER_CAPTURE;
+	if(capture && (scan->raw_depth_sidx < 0 || scan->raw_depth_sidx >= 4))
+		return 0; // Nothing to capture
+
+	pthread_mutex_lock(&rec->mutex);
+	rec->stats.submitted++;
+	if(rec->n_queued == rec->cfg.queue_len)
+	{
+		uint64_t dropped = ++rec->stats.dropped;
+		pthread_mutex_unlock(&rec->mutex);
+		if(dropped == 1 || dropped%100 == 0)
+			fprintf(stderr, "WARNING: recorder can't keep up, %llu scans dropped so far\n", (unsigned long long)dropped);
+		return -1;
+	}
+	tof3d_scan_t* slot = rec->slots[(rec->rd + rec->n_queued) % rec->cfg.queue_len];
+	pthread_mutex_unlock(&rec->mutex);
+
+	// The slot isn't in the queue yet, so the writer doesn't touch it
+	slot->robot_pos = scan->robot_pos;
+	if(capture)
+	{
+		int sidx = scan->raw_depth_sidx;
+		slot->raw_depth_sidx = sidx;
+		memcpy(slot->raw_depth, scan->raw_depth, sizeof slot->raw_depth);
+		memcpy(slot->ampl_images[sidx], scan->ampl_images[sidx], sizeof slot->ampl_images[sidx]);
+	}
+	else
+	{
+		int n = scan->n_points;
+		slot->n_points = n;
+		memcpy(slot->cloud, scan->cloud, n*sizeof scan->cloud[0]);
+		memcpy(slot->cloud_sidx, scan->cloud_sidx, n);
+		memcpy(slot->cloud_ampl, scan->cloud_ampl, n);
+	}
+
+	pthread_mutex_lock(&rec->mutex);
+	rec->n_queued++;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->mutex);
+	return 0;
+}
+
+void recorder_get_stats(recorder_t* rec, recorder_stats_t* stats)
+{
+	pthread_mutex_lock(&rec->mutex);
+	*stats = rec->stats;
+	pthread_mutex_unlock(&rec->mutex);
+}
+
+// Writes out what's queued, then stops the thread and frees the recorder.
+void recorder_stop(recorder_t* rec)
+{
+	if(!rec)
+		return;
+
+	pthread_mutex_lock(&rec->mutex);
+	rec->stop = 1;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->mutex);
+	pthread_join(rec->thread, NULL);
+
+	pthread_mutex_destroy(&rec->mutex);
+	pthread_cond_destroy(&rec->cond);
+	for(int i=0; i<rec->cfg.queue_len; i++)
+		free(rec->slots[i]);
+	free(rec->slots);
+	free(rec->buf);
+	free(rec);
+}
@@ -0,0 +1,93 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Asynchronous point cloud recorder: scans are formatted (pcio.h) and written by a dedicated thread,
+	so that a slow SD card (or a slow reader on a pipe) never stalls the caller.
+
+	recorder_submit() copies the cloud of the scan to a free slot of a bounded queue and returns at once.
+	When all the slots are full, the scan is dropped and counted instead of waiting.
+
+	To a directory, the scans go to segment files named <dir>/cloud_<n>.<ext>. The streamable formats
+	(xyz, i16, f32) are appended to a segment until it reaches segment_bytes; PLY and PCD hold one scan
+	per file. When the segments written in this run take more than max_total_bytes, the oldest ones are deleted.
+	Written data is fsync()ed every fsync_every scans, and when a segment is closed.
+	To a file descriptor (e.g. stdout), all the scans are written to it, without segments or fsync.
+
+	With format RECORDER_CAPTURE, the raw depth and amplitude images of the scan (raw_depth, one sensor) are
+	recorded instead of the pointcloud, to .tofcap segments: per scan, recorder_capture_header_t followed by
+	the depth image and the amplitude image, optionally compressed with depthcodec.h (the compress flag).
+	Scans without raw_depth are skipped.
+*/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+#include "pulutof.h"
+
+#define RECORDER_DEFAULT_QUEUE_LEN     4
+#define RECORDER_DEFAULT_SEGMENT_BYTES (16*1024*1024)
+#define RECORDER_DEFAULT_FSYNC_EVERY   10
+
+#define RECORDER_CAPTURE 16 // Format: raw images instead of a pointcloud format
+#define RECORDER_CAPTURE_MAGIC 0x50414354 // "TCAP"
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint8_t  sensor;
+	uint8_t  compressed; // 1 = the images are dcodec streams, 0 = uint16_t and uint8_t images
+	uint16_t xs, ys;
+	pos_t    robot_pos;
+	uint32_t depth_len;  // Bytes of the depth image that follows, then ampl_len bytes of the amplitude image
+	uint32_t ampl_len;
+} recorder_capture_header_t;
+
+typedef struct
+{
+	const char* dir;        // Output directory, or NULL to write to fd
+	int fd;
+	int format;             // PCIO_* or RECORDER_CAPTURE
+	int columns;            // PCIO_COL_*
+	int queue_len;          // Scan slots; 0 = RECORDER_DEFAULT_QUEUE_LEN
+	long segment_bytes;     // 0 = RECORDER_DEFAULT_SEGMENT_BYTES
+	long long max_total_bytes; // 0 = no cap
+	int fsync_every;        // Scans between fsyncs; 0 = RECORDER_DEFAULT_FSYNC_EVERY, <0 = never
+	int compress;           // RECORDER_CAPTURE: compress the images with depthcodec.h
+} recorder_cfg_t;
+
+typedef struct
+{
+	uint64_t submitted;
+	uint64_t written;
+	uint64_t dropped;          // Queue full
+	uint64_t failed;           // Write errors
+	uint64_t bytes;
+	uint64_t segments_deleted; // Over max_total_bytes
+} recorder_stats_t;
+
+typedef struct recorder recorder_t;
+
+recorder_t* recorder_start(const recorder_cfg_t* cfg);
+int recorder_submit(recorder_t* rec, const tof3d_scan_t* scan);
+void recorder_get_stats(recorder_t* rec, recorder_stats_t* stats);
+void recorder_stop(recorder_t* rec);
+
+#endif
@@ -0,0 +1,170 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Scan ring check: a TCP client that stalls in the middle of a message keeps the scan it references pinned,
+	and new scans must still keep coming. Once the client is coalesced, the pin must go, and the message still
+	arrive intact. Doesn't need the sensors. Build and run with make check.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pulutof.h"
+#include "tcp_comm.h"
+#include "tcp_parser.h"
+
+#define SOCK_PATH "/tmp/scanring_test.sock"
+
+static pulutof_ctx_t* ctx;
+static int failed;
+
+static void check(int ok, const char* what)
+{
+	fprintf(stderr, "%s: %s\n", ok ? "ok" : "FAIL", what);
+	if(!ok)
+		failed = 1;
+}
+
+static void scan_hold(void* scan)    { pulutof_pin_scan(ctx, scan); }
+static void scan_release(void* scan) { pulutof_unpin_scan(ctx, scan); }
+
+static int pins(const tof3d_scan_t* scan)
+{
+	pulutof_pin_scan(ctx, scan);
+	return pulutof_unpin_scan(ctx, scan);
+}
+
+// Feeds one full scan, with its number in robot x, and waits for it to come out
+static tof3d_scan_t* next_scan(int id)
+{
+	static pulutof_frame_t frame;
+	frame.robot_pos.x = id;
+	for(int s=0; s<4; s++)
+	{
+		frame.sensor_idx = s;
+		while(pulutof_feed_frame(ctx, &frame) < 0)
+			usleep(1000);
+	}
+
+	for(int i=0; i<2000; i++)
+	{
+		tof3d_scan_t* scan = get_tof3d(ctx);
+		if(scan)
+			return scan;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+int main()
+{
+	ctx = pulutof_create(NULL);
+	pthread_t proc;
+	if(!ctx || pthread_create(&proc, NULL, pulutof_processing_thread, ctx))
+		return EXIT_FAILURE;
+
+	unlink(SOCK_PATH);
+	if(init_tcp_comm(SOCK_PATH, NULL) < 0)
+		return EXIT_FAILURE;
+	// Over TCP, where a full socket takes any part of a message
+	int client = socket(AF_INET, SOCK_STREAM, 0);
+	int rcvbuf = 4096;
+	setsockopt(client, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(TCP_PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if(connect(client, (struct sockaddr*)&addr, sizeof addr) < 0)
+	{
+		perror("connect");
+		return EXIT_FAILURE;
+	}
+	for(int i=0; i<10 && !tcp_n_clients; i++)
+		tcp_comm_poll(10, -1);
+	check(tcp_n_clients == 1, "client connected");
+
+	// The client never reads: the socket fills up in the middle of these, and the rest stay queued
+	tof3d_scan_t* stalled = next_scan(1);
+	static uint16_t depth[TOF_XS*TOF_YS];
+	memcpy(depth, stalled->raw_depth, sizeof depth);
+	tcp_payload_owner_t owner = {scan_hold, scan_release, stalled};
+	tcp_payload_owner = &owner;
+	for(int i=0; i<TCP_CLIENT_QUEUE_LEN/2; i++)
+		tcp_send_picture(100, 2, TOF_XS, TOF_YS, (uint8_t*)stalled->raw_depth);
+	tcp_payload_owner = NULL;
+	tcp_client_t* cl = &tcp_clients[0];
+	check(cl->q_n > 0 && cl->q_off > 0, "client stalled in the middle of a message");
+	check(pins(stalled) > 0, "its scan is pinned");
+
+	// Several times around the ring
+	int n_new = 0, n_stalled = 0;
+	for(int id=2; id<2+4*32; id++)
+	{
+		tof3d_scan_t* scan = next_scan(id);
+		if(!scan)
+			break;
+		if(scan->robot_pos.x == id)
+			n_new++;
+		if(scan == stalled)
+			n_stalled++;
+	}
+	check(n_new == 4*32, "new scans keep coming past the pinned one");
+	check(n_stalled == 0, "the pinned scan isn't overwritten or handed out again");
+	check(stalled->robot_pos.x == 1, "the pinned scan is intact");
+
+	// Far behind: the queue is coalesced, and the rest of the partly written message copied out of the scan
+	tcp_clients_assess();
+	check(cl->degrade == TCP_DEGRADE_COALESCE, "the client is coalesced");
+	check(cl->q_n == 1, "only the partly written message is left");
+	check(pins(stalled) == 0, "the scan isn't pinned anymore");
+
+	// The client catches up: what it gets must be whole pictures
+	static uint8_t rx[TCP_CLIENT_QUEUE_LEN/2*(10+sizeof depth)];
+	int n_rx = 0;
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	for(int i=0, ret=1; i<1000 && (cl->q_n || ret > 0); i++)
+	{
+		tcp_comm_poll(1, -1);
+		ret = read(client, rx+n_rx, sizeof rx - n_rx);
+		if(ret > 0)
+			n_rx += ret;
+	}
+	int n_pictures = 0, ok = (n_rx > 0 && n_rx % (10+sizeof depth) == 0);
+	for(uint8_t* p = rx; ok && p < rx+n_rx; p += 10+sizeof depth, n_pictures++)
+		ok = p[0] == TCP_RC_PICTURE_MID && ((p[1]<<8) | p[2]) == 7+sizeof depth && p[4] == 100 && !memcmp(p+10, depth, sizeof depth);
+	check(ok && cl->q_n == 0, "the client got whole pictures");
+	fprintf(stderr, "%d pictures, %d bytes\n", n_pictures, n_rx);
+
+	close(client);
+	tcp_comm_close();
+	request_tof_quit(ctx);
+	pthread_join(proc, NULL);
+	pulutof_destroy(ctx);
+	unlink(SOCK_PATH);
+
+	fprintf(stderr, failed ? "FAILED\n" : "All passed\n");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,240 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Shared memory scan publisher, see shmpub.h
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "pulutof.h"
+#include "shmpub.h"
+
+#define HEADER_SIZE 64
+#define SLOT_STRIDE ((sizeof(shmpub_slot_t)+63) & ~(size_t)63)
+
+struct shmpub
+{
+	char name[64];
+	int publisher;
+	size_t size;
+	shmpub_header_t* hdr;
+	uint32_t scan_cnt; // Publisher only
+};
+
+static shmpub_slot_t* slot_at(shmpub_t* shm, uint32_t scan_cnt)
+{
+	return (shmpub_slot_t*)((uint8_t*)shm->hdr + HEADER_SIZE + (scan_cnt % shm->hdr->n_slots)*SLOT_STRIDE);
+}
+
+/*
+	Creates (or replaces) the shared memory object. Returns NULL on failure.
+*/
+shmpub_t* shmpub_create(const char* name, int n_slots)
+{
+	if(n_slots < 2)
+		n_slots = SHMPUB_DEFAULT_SLOTS;
+
+	shmpub_t* shm = calloc(1, sizeof *shm);
+	if(!shm)
+	{
+		fprintf(stderr, "ERROR: Out of memory in shmpub_create\n");
+		return NULL;
+	}
+	snprintf(shm->name, sizeof shm->name, "%s", name);
+	shm->publisher = 1;
+	shm->size = HEADER_SIZE + n_slots*SLOT_STRIDE;
+
+	int fd = shm_open(shm->name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		fprintf(stderr, "ERROR: shmpub: shm_open %s failed: %d (%s)\n", shm->name, errno, strerror(errno));
+		free(shm);
+		return NULL;
+	}
+
+	if(ftruncate(fd, shm->size) < 0 ||
+	   (shm->hdr = mmap(NULL, shm->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR: shmpub: mapping %s failed: %d (%s)\n", shm->name, errno, strerror(errno));
+		close(fd);
+		shm_unlink(shm->name);
+		free(shm);
+		return NULL;
+	}
+	close(fd);
+
+	// ftruncate zeroed it: all the slots are at seq 0, and latest = 0 (nothing published)
+	shm->hdr->slot_size = sizeof(shmpub_slot_t);
+	shm->hdr->n_slots = n_slots;
+	__atomic_store_n(&shm->hdr->magic, SHMPUB_MAGIC, __ATOMIC_RELEASE);
+
+	return shm;
+}
+
+/*
+	Copies the scan to the next slot, then wakes up the readers. Only the used parts are copied:
+	the objmap up to the grid size, raw_depth when populated, and the n_points of the cloud.
+*/
+void shmpub_publish(shmpub_t* shm, const tof3d_scan_t* scan)
+{
+	uint32_t cnt = ++shm->scan_cnt;
+	if(cnt == 0) // 0 means "none"; skip it on wraparound
+		cnt = ++shm->scan_cnt;
+
+	shmpub_slot_t* slot = slot_at(shm, cnt);
+
+	uint32_t seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->scan_cnt = cnt;
+	slot->robot_pos = scan->robot_pos;
+	slot->grid = scan->grid;
+	slot->sensor_mask = scan->sensor_mask;
+	slot->raw_depth_sidx = scan->raw_depth_sidx;
+	slot->n_points = scan->n_points;
+	slot->stamps = scan->stamps;
+	memcpy(slot->objmap, scan->objmap, scan->grid.xs*scan->grid.ys);
+	if(scan->raw_depth_sidx >= 0)
+		memcpy(slot->raw_depth, scan->raw_depth, sizeof slot->raw_depth);
+	memcpy(slot->ampl_images, scan->ampl_images, sizeof slot->ampl_images);
+	memcpy(slot->cloud, scan->cloud, scan->n_points*sizeof scan->cloud[0]);
+
+	__atomic_store_n(&slot->seq, seq+2, __ATOMIC_RELEASE);
+	__atomic_store_n(&shm->hdr->latest, cnt, __ATOMIC_RELEASE);
+
+	// Not FUTEX_PRIVATE: the waiters are in other processes
+	syscall(SYS_futex, &shm->hdr->latest, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+	Maps an existing object read-only. Returns NULL if it doesn't exist (the publisher isn't running)
+	or if it's from an incompatible build.
+*/
+shmpub_t* shmpub_open_reader(const char* name)
+{
+	shmpub_t* shm = calloc(1, sizeof *shm);
+	if(!shm)
+	{
+		fprintf(stderr, "ERROR: Out of memory in shmpub_open_reader\n");
+		return NULL;
+	}
+	snprintf(shm->name, sizeof shm->name, "%s", name);
+
+	int fd = shm_open(shm->name, O_RDONLY, 0);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < HEADER_SIZE + 2*SLOT_STRIDE)
+	{
+		fprintf(stderr, "ERROR: shmpub: opening %s failed\n", shm->name);
+		if(fd >= 0) close(fd);
+		free(shm);
+		return NULL;
+	}
+	shm->size = st.st_size;
+	shm->hdr = mmap(NULL, shm->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm->hdr == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR: shmpub: mapping %s failed: %d (%s)\n", shm->name, errno, strerror(errno));
+		free(shm);
+		return NULL;
+	}
+
+	if(__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != SHMPUB_MAGIC || shm->hdr->slot_size != sizeof(shmpub_slot_t) ||
+	   shm->size < HEADER_SIZE + shm->hdr->n_slots*SLOT_STRIDE)
+	{
+		fprintf(stderr, "ERROR: shmpub: %s has a different layout (built from another pulutof.h?)\n", shm->name);
+		munmap(shm->hdr, shm->size);
+		free(shm);
+		return NULL;
+	}
+
+	return shm;
+}
+
+/*
+	Returns the newest scan_cnt once it differs from last; sleeps on the futex meanwhile.
+	Returns last on timeout (timeout_ms < 0: wait forever).
+*/
+uint32_t shmpub_wait(shmpub_t* shm, uint32_t last, int timeout_ms)
+{
+	struct timespec ts = {timeout_ms/1000, (timeout_ms%1000)*1000000L};
+
+	while(1)
+	{
+		uint32_t cur = __atomic_load_n(&shm->hdr->latest, __ATOMIC_ACQUIRE);
+		if(cur != last)
+			return cur;
+
+		// Sleeps only if latest still equals last, so a publish in between isn't missed
+		if(syscall(SYS_futex, &shm->hdr->latest, FUTEX_WAIT, last, (timeout_ms < 0) ? NULL : &ts, NULL, 0) < 0 && errno == ETIMEDOUT)
+			return __atomic_load_n(&shm->hdr->latest, __ATOMIC_ACQUIRE);
+	}
+}
+
+const shmpub_slot_t* shmpub_slot(shmpub_t* shm, uint32_t scan_cnt)
+{
+	return slot_at(shm, scan_cnt);
+}
+
+// Waits until the slot isn't being written, and returns its seq for shmpub_read_ok()
+uint32_t shmpub_read_begin(const shmpub_slot_t* slot)
+{
+	while(1)
+	{
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(!(seq & 1))
+			return seq;
+		sched_yield();
+	}
+}
+
+// Call after using the slot data: 0 if the slot was (being) rewritten meanwhile, and the data may be torn
+int shmpub_read_ok(const shmpub_slot_t* slot, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+void shmpub_close(shmpub_t* shm)
+{
+	if(!shm)
+		return;
+
+	munmap(shm->hdr, shm->size);
+	if(shm->publisher)
+		shm_unlink(shm->name);
+	free(shm);
+}
@@ -0,0 +1,96 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Shared memory scan publisher, for local consumers without the TCP round trip.
+
+	The publisher (main -s /name) creates the POSIX shared memory object /name with a ring of n_slots
+	scan slots, and copies every scan to the next slot. Any number of readers map it read-only and
+	use the slots in place: no copies and no syscalls, except for waiting for the next scan.
+
+	Each slot has a seqlock: seq is odd while the slot is being written, and changes whenever it's
+	rewritten, which happens n_slots scans later. The header's latest is the number of the newest complete
+	scan; it's also a futex word that's woken on every publish, so readers can sleep on it (shmpub_wait).
+
+	Reader:
+		shmpub_t* shm = shmpub_open_reader("/pulutof");
+		uint32_t last = 0;
+		while(1)
+		{
+			last = shmpub_wait(shm, last, 1000);
+			const shmpub_slot_t* slot = shmpub_slot(shm, last);
+			uint32_t seq = shmpub_read_begin(slot);
+			... use slot->objmap etc. in place ...
+			if(!shmpub_read_ok(slot, seq))
+				... the slot was rewritten meanwhile (the reader was n_slots scans late): discard ...
+		}
+
+	Both sides must be built from the same pulutof.h (the layout check is the magic and slot_size).
+*/
+
+#ifndef SHMPUB_H
+#define SHMPUB_H
+
+#include <stdint.h>
+
+#include "pulutof.h"
+
+#define SHMPUB_MAGIC 0x42555053 // "SPUB"
+#define SHMPUB_DEFAULT_SLOTS 4
+
+typedef struct
+{
+	uint32_t seq;        // Seqlock, see above
+	uint32_t scan_cnt;   // Number of the scan in this slot (counts from 1)
+	pos_t robot_pos;
+	tof3d_grid_t grid;   // objmap is grid.xs*grid.ys
+	int32_t sensor_mask;
+	int32_t raw_depth_sidx; // -1: raw_depth not populated
+	int32_t n_points;
+	tof3d_stamps_t stamps;
+	int8_t objmap[TOF3D_HMAP_MAX_YSPOTS*TOF3D_HMAP_MAX_XSPOTS];
+	uint16_t raw_depth[TOF_XS*TOF_YS];
+	uint8_t ampl_images[4][TOF_XS*TOF_YS];
+	xyz_t cloud[4*TOF_XS*TOF_YS];
+} shmpub_slot_t;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t slot_size;  // sizeof(shmpub_slot_t)
+	uint32_t n_slots;
+	uint32_t latest;     // Newest complete scan_cnt, 0 = none yet; futex word
+	// Slots follow, each at a multiple of 64 bytes
+} shmpub_header_t;
+
+typedef struct shmpub shmpub_t;
+
+// Publisher
+shmpub_t* shmpub_create(const char* name, int n_slots);
+void shmpub_publish(shmpub_t* shm, const tof3d_scan_t* scan);
+
+// Reader
+shmpub_t* shmpub_open_reader(const char* name);
+uint32_t shmpub_wait(shmpub_t* shm, uint32_t last, int timeout_ms);
+const shmpub_slot_t* shmpub_slot(shmpub_t* shm, uint32_t scan_cnt);
+uint32_t shmpub_read_begin(const shmpub_slot_t* slot);
+int shmpub_read_ok(const shmpub_slot_t* slot, uint32_t seq);
+
+void shmpub_close(shmpub_t* shm); // The publisher also removes the object
+
+#endif
@@ -0,0 +1,232 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Message codec check: the limits of a compiled types string (TCP_CODEC_MAX_OPS field size changes,
+	runs of more than 255 fields), the big endian wire format, and the receive side: messages split over
+	reads, and ones too big for the receive buffer skipped. Also the objmap codec: keyframes and deltas
+	decoded back with mcodec_decode(), in place too, and corrupt streams rejected. Build and run with make check.
+*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tcp_comm.h"
+#include "tcp_parser.h"
+#include "mapcodec.h"
+
+#define SOCK_PATH "/tmp/tcp_codec_test.sock"
+
+#define N_SHORTS 300
+
+#define MAP_CELLS 70000 // More than the longest run, so that one is split
+
+static int failed;
+
+static void check(int ok, const char* what)
+{
+	fprintf(stderr, "%s: %s\n", ok ? "ok" : "FAIL", what);
+	if(!ok)
+		failed = 1;
+}
+
+// Reads exactly len bytes
+static int read_all(int fd, uint8_t* buf, int len)
+{
+	int got = 0;
+	while(got < len)
+	{
+		int ret = read(fd, buf+got, len-got);
+		if(ret <= 0)
+			return -1;
+		got += ret;
+	}
+	return 0;
+}
+
+static int rx_levels[8], n_rx_levels;
+
+static void rx(tcp_client_t* cl, int mid)
+{
+	if(mid == TCP_CR_HMAP_LEVEL_MID && n_rx_levels < 8)
+		rx_levels[n_rx_levels++] = msg_cr_hmap_level.level;
+}
+
+typedef struct __attribute__ ((packed))
+{
+	uint8_t first;
+	uint16_t shorts[N_SHORTS];
+	uint32_t last;
+} long_run_t;
+
+// Runs of every length around the code limits, between random literals
+static void runs_map(int8_t* map, int n)
+{
+	static const int lens[] = {1, 2, 3, 128, 129, 130, 131, 500, 0xffff+MCODEC_LONG_RUN-1, 0xffff+MCODEC_LONG_RUN};
+	int i = 0;
+	for(int r=0; i<n; r++)
+	{
+		int len = lens[r % (sizeof lens/sizeof lens[0])];
+		if(len > 1000)
+			len = (n-i)/2 + 1;
+		int8_t v = rand();
+		for(int k=0; k<len && i<n; k++, i++)
+			map[i] = v;
+		for(int k=0; k<1+rand()%200 && i<n; k++, i++)
+			map[i] = rand();
+	}
+}
+
+// Encodes map (against ref), checks the size bound and that it decodes back, into a fresh buffer and in place
+static int round_trip(const int8_t* map, const int8_t* ref, int n, int* enc_len)
+{
+	static uint8_t enc[MAP_CELLS + MAP_CELLS/128 + 2];
+	static int8_t out[MAP_CELLS];
+
+	int len = mcodec_encode(enc, map, ref, n);
+	*enc_len = len;
+	if(len > mcodec_max_size(n))
+		return 0;
+
+	memset(out, 0x5a, n);
+	if(mcodec_decode(out, ref, n, enc, len) < 0 || memcmp(out, map, n))
+		return 0;
+
+	if(ref)
+	{
+		memcpy(out, ref, n);
+		if(mcodec_decode(out, out, n, enc, len) < 0 || memcmp(out, map, n))
+			return 0;
+	}
+
+	// Every truncation, one byte too many, and the wrong map size are rejected
+	for(int l=0; l<len; l++)
+	{
+		if(mcodec_decode(out, ref, n, enc, l) == 0)
+			return 0;
+	}
+	enc[len] = 0;
+	return mcodec_decode(out, ref, n, enc, len+1) < 0 && mcodec_decode(out, ref, n-1, enc, len) < 0 &&
+		(ref || mcodec_decode(out, ref, n+1, enc, len) < 0);
+}
+
+static void test_mapcodec()
+{
+	static int8_t a[MAP_CELLS], b[MAP_CELLS];
+	int len;
+
+	memset(a, TOF3D_UNSEEN, MAP_CELLS);
+	check(round_trip(a, NULL, MAP_CELLS, &len) && len == 8, "mapcodec: blank map is two long runs");
+
+	runs_map(a, MAP_CELLS);
+	check(round_trip(a, NULL, MAP_CELLS, &len), "mapcodec: runs of every length, keyframe");
+
+	// The next scan: a few cells changed, each costing a literal and the run up to the next one
+	memcpy(b, a, MAP_CELLS);
+	for(int i=0; i<100; i++)
+		b[rand()%MAP_CELLS] = rand();
+	check(round_trip(b, a, MAP_CELLS, &len) && len < 100*6, "mapcodec: delta, also in place");
+	check(round_trip(a, a, MAP_CELLS, &len) && len == 8, "mapcodec: delta of an unchanged map is two long runs");
+}
+
+int main()
+{
+	static char types_max[TCP_CODEC_MAX_OPS+1], types_over[TCP_CODEC_MAX_OPS+3], types_long[N_SHORTS+3];
+
+	// "bs" pairs: TCP_CODEC_MAX_OPS runs fit, one pair more doesn't
+	for(int i=0; i<TCP_CODEC_MAX_OPS/2; i++)
+		memcpy(&types_max[2*i], "bs", 2);
+	for(int i=0; i<TCP_CODEC_MAX_OPS/2+1; i++)
+		memcpy(&types_over[2*i], "bs", 2);
+
+	types_long[0] = 'B';
+	memset(&types_long[1], 'S', N_SHORTS);
+	types_long[N_SHORTS+1] = 'I';
+
+	tcp_message_t msg_max  = {NULL, 0xf0, 3*TCP_CODEC_MAX_OPS/2, types_max};
+	tcp_message_t msg_over = {NULL, 0xf1, 3*(TCP_CODEC_MAX_OPS/2+1), types_over};
+	tcp_message_t msg_long = {NULL, 0xf2, sizeof(long_run_t), types_long};
+
+	test_mapcodec();
+
+	unlink(SOCK_PATH);
+	if(init_tcp_comm(SOCK_PATH, rx) < 0)
+		return EXIT_FAILURE;
+	int client = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, SOCK_PATH, sizeof addr.sun_path - 1);
+	if(connect(client, (struct sockaddr*)&addr, sizeof addr) < 0)
+	{
+		perror("connect");
+		return EXIT_FAILURE;
+	}
+	for(int i=0; i<10 && !tcp_n_clients; i++)
+		tcp_comm_poll(10, -1);
+	check(tcp_n_clients == 1, "client connected");
+
+	uint8_t zeros[3*(TCP_CODEC_MAX_OPS/2+1)] = {0};
+	uint8_t buf[3+sizeof(long_run_t)];
+
+	check(tcp_send_msg(&msg_max, zeros) == 0, "TCP_CODEC_MAX_OPS field size changes are accepted");
+	check(read_all(client, buf, 3+msg_max.size) == 0 && buf[0] == 0xf0, "and sent");
+	check(tcp_send_msg(&msg_over, zeros) == -2, "one more is rejected");
+
+	long_run_t lr;
+	lr.first = 0xab;
+	for(int i=0; i<N_SHORTS; i++)
+		lr.shorts[i] = i*257+1;
+	lr.last = 0x01020304;
+	check(tcp_send_msg(&msg_long, &lr) == 0, "a run of more than 255 fields is accepted");
+	check(msg_long.n_ops == 4 && msg_long.ops[1].count == 255 && msg_long.ops[2].count == N_SHORTS-255, "and split in two ops");
+
+	int ok = read_all(client, buf, 3+sizeof lr) == 0 && buf[0] == 0xf2 && ((buf[1]<<8) | buf[2]) == sizeof lr && buf[3] == 0xab;
+	for(int i=0; ok && i<N_SHORTS; i++)
+		ok = ((buf[4+2*i]<<8) | buf[5+2*i]) == (uint16_t)(i*257+1);
+	uint8_t* p = &buf[4+2*N_SHORTS];
+	ok = ok && p[0] == 1 && p[1] == 2 && p[2] == 3 && p[3] == 4;
+	check(ok, "every field is big endian on the wire");
+
+	// An unknown 4 kB message, then two hmap level messages, the last one split over two writes
+	static uint8_t in[7+4096+4+4];
+	uint8_t* q = in;
+	*q++ = 0xee; *q++ = 0xff; *q++ = 0xff; *q++ = 0; *q++ = 0; *q++ = 0x10; *q++ = 0;
+	memset(q, 0x55, 4096); q += 4096;
+	*q++ = TCP_CR_HMAP_LEVEL_MID; *q++ = 0; *q++ = 1; *q++ = 2;
+	*q++ = TCP_CR_HMAP_LEVEL_MID; *q++ = 0; *q++ = 1; *q++ = 1;
+	ok = write(client, in, q-in-2) == q-in-2;
+	for(int i=0; i<1000 && n_rx_levels < 1; i++)
+		tcp_comm_poll(1, -1);
+	ok = ok && write(client, q-2, 2) == 2;
+	for(int i=0; i<1000 && n_rx_levels < 2; i++)
+		tcp_comm_poll(1, -1);
+	check(ok && n_rx_levels == 2 && rx_levels[0] == 2 && rx_levels[1] == 1, "messages after a skipped big one, and split ones, are received");
+
+	close(client);
+	tcp_comm_close();
+	unlink(SOCK_PATH);
+
+	fprintf(stderr, failed ? "FAILED\n" : "All passed\n");
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -5,7 +5,7 @@
 	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
 
 	This program is free software; you can redistribute it and/or modify
-	it under the terms of the GNU General Public License version 2, as 
+	it under the terms of the GNU General Public License version 2, as
 	published by the Free Software Foundation.
 
 	This program is distributed in the hope that it will be useful,
@@ -17,31 +17,80 @@
 
 
 
-	Module for working around complex POSIX socket API. Builds a simple TCP connection.
+	Module for working around complex POSIX socket API: TCP and Unix domain socket servers for
+	many clients, with non-blocking per-client output queues. See tcp_comm.h
 
 
 */
 
-#define _BSD_SOURCE // for usleep
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
-#include <termios.h>
 #include <string.h>
 #include <fcntl.h>
-#include <stropts.h>
-#include <sys/select.h>
-#include <sys/ioctl.h>
+#include <time.h>
 
+#include "tcp_comm.h"
 #include "tcp_parser.h"
 
-int tcp_listener_sock;
-int tcp_client_sock = -1; // One client at the time is allowed.
+// epoll data of the fds that aren't clients (clients are their index in tcp_clients)
+#define EP_TCP_LISTENER  1000
+#define EP_UNIX_LISTENER 1001
+#define EP_WATCH_FD      1002
+
+tcp_client_t tcp_clients[TCP_MAX_CLIENTS];
+int tcp_n_clients = 0;
+uint32_t tcp_dest_mask = TCP_ALL_CLIENTS;
+uint32_t tcp_sent_mask;
+uint32_t tcp_sent_acc;
+const tcp_payload_owner_t* tcp_payload_owner = NULL;
+uint64_t tcp_msg_origin_ns = 0;
+lat_hist_t tcp_lat_queue = {.name = "tcp message -> socket"};
+lat_hist_t tcp_lat_e2e = {.name = "spi -> socket"};
+
+static int epoll_fd = -1;
+static int tcp_listener_sock = -1;
+static int unix_listener_sock = -1;
+static char unix_path[108];
+static int watched_fd = -1;
+static tcp_rx_handler_t rx_handler;
+
+static tcp_msg_t msg_pool[TCP_MSG_POOL_LEN];
+static tcp_msg_t* free_msgs;
+static const int buf_sizes[TCP_BUF_CLASSES] = TCP_BUF_SIZES;
+static void* free_bufs[TCP_BUF_CLASSES]; // Each free buffer starts with the pointer to the next one
+static int n_free_bufs[TCP_BUF_CLASSES];
+
+static double timestamp()
+{
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+
+	return (double)spec.tv_sec + (double)spec.tv_nsec/1.0e9;
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int epoll_add(int fd, uint32_t data)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = data};
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
 
 int build_socket(uint16_t port)
 {
@@ -64,7 +113,7 @@ int build_socket(uint16_t port)
 	}
 
 	#ifdef SO_REUSEPORT
-	if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0) 
+	if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) < 0)
 	{
 		perror("setsockopt(SO_REUSEPORT) failed");
 		exit(EXIT_FAILURE);
@@ -83,100 +132,692 @@ int build_socket(uint16_t port)
 	return sock;
 }
 
-int init_tcp_comm()
+// Returns -1 on failure: the Unix socket is optional, TCP still works without it.
+static int build_unix_socket(const char* path)
 {
+	struct sockaddr_un name = {.sun_family = AF_UNIX};
+
+	if(strlen(path) >= sizeof name.sun_path)
+	{
+		fprintf(stderr, "ERROR: Unix socket path %s too long\n", path);
+		return -1;
+	}
+	strcpy(name.sun_path, path);
+
+	// A socket left over from a previous run (nobody accepts on it) is removed; a live one, or anything
+	// else at the path, is left alone
+	struct stat st;
+	if(lstat(path, &st) == 0)
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			fprintf(stderr, "ERROR: Unix socket path %s exists and isn't a socket\n", path);
+			return -1;
+		}
+
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(probe < 0)
+		{
+			perror("socket(AF_UNIX)");
+			return -1;
+		}
+		int ret = connect(probe, (struct sockaddr*)&name, sizeof name);
+		int err = errno;
+		close(probe);
+		if(ret == 0)
+		{
+			fprintf(stderr, "ERROR: Unix socket %s is in use by another server\n", path);
+			return -1;
+		}
+		if(err != ECONNREFUSED)
+		{
+			fprintf(stderr, "ERROR: Unix socket %s: %d (%s)\n", path, err, strerror(err));
+			return -1;
+		}
+		unlink(path);
+	}
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock < 0)
+	{
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+
+	if(bind(sock, (struct sockaddr*)&name, sizeof name) < 0 || listen(sock, 8) < 0)
+	{
+		fprintf(stderr, "ERROR: Unix socket %s: %d (%s)\n", path, errno, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int init_tcp_comm(const char* unix_sock_path, tcp_rx_handler_t handler)
+{
+	rx_handler = handler;
+	tcp_parser_init();
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+		tcp_clients[i].fd = -1;
+
+	for(int i=0; i<TCP_MSG_POOL_LEN; i++)
+	{
+		msg_pool[i].next_free = free_msgs;
+		free_msgs = &msg_pool[i];
+	}
+
+	epoll_fd = epoll_create1(0);
+	if(epoll_fd < 0)
+	{
+		perror("epoll_create1");
+		return -1;
+	}
+
 	/* Create the socket and set it up to accept connections. */
-	tcp_listener_sock = build_socket(22222);
-	if(listen(tcp_listener_sock, 1) < 0)
+	tcp_listener_sock = build_socket(TCP_PORT);
+	if(listen(tcp_listener_sock, 8) < 0)
 	{
 		perror ("listen");
 		exit(EXIT_FAILURE);
 	}
+	set_nonblocking(tcp_listener_sock);
+	epoll_add(tcp_listener_sock, EP_TCP_LISTENER);
+
+	if(unix_sock_path && unix_sock_path[0])
+	{
+		unix_listener_sock = build_unix_socket(unix_sock_path);
+		if(unix_listener_sock >= 0)
+		{
+			snprintf(unix_path, sizeof unix_path, "%s", unix_sock_path);
+			set_nonblocking(unix_listener_sock);
+			epoll_add(unix_listener_sock, EP_UNIX_LISTENER);
+		}
+	}
 
 	return 0;
 }
 
-// Call this when you have data (connection request) in tcp_listener_sock input buffer, for example, after using select()
-int handle_tcp_listener()
+static void close_client(int idx)
+{
+	tcp_client_t* cl = &tcp_clients[idx];
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cl->fd, NULL);
+	close(cl->fd);
+	cl->fd = -1;
+	tcp_n_clients--;
+
+	while(cl->q_n)
+	{
+		tcp_msg_put(cl->queue[cl->q_rd]);
+		cl->q_rd = (cl->q_rd+1) % TCP_CLIENT_QUEUE_LEN;
+		cl->q_n--;
+	}
+
+	fprintf(stderr, "INFO: client %d disconnected (%llu messages dropped, %llu coalesced), %d clients left.\n",
+		idx, (unsigned long long)cl->dropped, (unsigned long long)cl->coalesced, tcp_n_clients);
+}
+
+// Call this when you have data (connection request) in a listener socket input buffer
+static int handle_listener(int listener, int is_unix)
 {
-	int new_fd;
-	struct sockaddr_in clientname;
-	size_t size = sizeof(clientname);
-	new_fd = accept(tcp_listener_sock, (struct sockaddr *) &clientname, &size);
+	int new_fd = accept(listener, NULL, NULL);
 	if(new_fd < 0)
 	{
-		fprintf(stderr, "ERROR: accepting tcp connection request failed.\n");
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			fprintf(stderr, "ERROR: accepting connection request failed: %d (%s).\n", errno, strerror(errno));
+		return -1;
 	}
 
-	if(tcp_client_sock >= 0)
+	int idx;
+	for(idx=0; idx<TCP_MAX_CLIENTS; idx++)
 	{
-		// We already have a client; disconnect it.
-		close(tcp_client_sock);
+		if(tcp_clients[idx].fd < 0)
+			break;
+	}
+	if(idx == TCP_MAX_CLIENTS)
+	{
+		fprintf(stderr, "WARN: too many clients (%d), connection refused.\n", TCP_MAX_CLIENTS);
+		close(new_fd);
+		return -1;
 	}
 
-	tcp_client_sock = new_fd;
-	fprintf(stderr, "INFO: connection accepted, client %08x, port %u.\n", clientname.sin_addr.s_addr,
-	        ntohs(clientname.sin_port));
+	set_nonblocking(new_fd);
+	if(!is_unix)
+	{
+		int one = 1; // Maps are sent as soon as they're ready
+		setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
 
+		// The send buffer autotunes to megabytes: on a slow link, that's seconds of stale scans out of our reach.
+		// Keep the unsent backlog in the queue instead, where it's seen, and dropped or coalesced.
+		#ifdef TCP_NOTSENT_LOWAT
+		int lowat = TCP_CLIENT_NOTSENT_LOWAT;
+		setsockopt(new_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof lowat);
+		#endif
+	}
 
+	tcp_client_t* cl = &tcp_clients[idx];
+	memset(cl, 0, sizeof *cl);
+	cl->fd = new_fd;
+	cl->is_unix = is_unix;
+	cl->bw_t0 = timestamp();
+	cl->sub = (tcp_cr_subscribe_t){.types = (1<<TCP_SUB_HMAP)|(1<<TCP_SUB_ELEVMAP)|(1<<TCP_SUB_OBJLIST)|(1<<TCP_SUB_DEPTH)|(1<<TCP_SUB_AMPL),
+		.div = {4, 4, 1, 4, 4}};
+	if(epoll_add(new_fd, idx) < 0)
+	{
+		perror("epoll_ctl");
+		close(new_fd);
+		cl->fd = -1;
+		return -1;
+	}
+	tcp_n_clients++;
+
+	fprintf(stderr, "INFO: %s connection accepted, client %d, %d clients.\n", is_unix ? "Unix socket" : "TCP", idx, tcp_n_clients);
 	return 0;
 }
 
-// Call this when you have data in tcp_client_sock input buffer, for example, after using select()
-int handle_tcp_client()
+static void set_epollout(int idx, int on)
+{
+	tcp_client_t* cl = &tcp_clients[idx];
+	if(cl->epollout == on)
+		return;
+
+	struct epoll_event ev = {.events = EPOLLIN | (on ? EPOLLOUT : 0), .data.u32 = idx};
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+	cl->epollout = on;
+}
+
+/*
+	Writes out as much of the queue as the socket takes without blocking, all queued messages with one
+	sendmsg. A partial write leaves q_off at where to continue, which can be in the header or the payload.
+	Returns -1 if the client was closed because of an error.
+*/
+static int flush_client(int idx)
 {
-	int ret = tcp_parser(tcp_client_sock);
+	tcp_client_t* cl = &tcp_clients[idx];
+
+	while(cl->q_n)
+	{
+		struct iovec iov[2*TCP_CLIENT_QUEUE_LEN];
+		int n_iov = 0;
+		int off = cl->q_off;
+		for(int i=0; i<cl->q_n; i++)
+		{
+			tcp_msg_t* msg = cl->queue[(cl->q_rd+i) % TCP_CLIENT_QUEUE_LEN];
+			if(off < msg->hdr_len)
+				iov[n_iov++] = (struct iovec){msg->hdr + off, msg->hdr_len - off};
+			int poff = (off > msg->hdr_len) ? off - msg->hdr_len : 0;
+			if(poff < msg->payload_len)
+				iov[n_iov++] = (struct iovec){(void*)(msg->payload + poff), msg->payload_len - poff};
+			off = 0;
+		}
+
+		struct msghdr mh = {.msg_iov = iov, .msg_iovlen = n_iov};
+		ssize_t ret = sendmsg(cl->fd, &mh, MSG_NOSIGNAL);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				set_epollout(idx, 1);
+				return 0;
+			}
+			fprintf(stderr, "ERROR: client %d: socket write error %d (%s). Closing connection.\n", idx, errno, strerror(errno));
+			close_client(idx);
+			return -1;
+		}
+
+		cl->tx_bytes += ret;
+		cl->bw_bytes += ret;
+
+		// Release the messages written out completely
+		uint64_t now_ns = 0;
+		while(cl->q_n)
+		{
+			tcp_msg_t* msg = cl->queue[cl->q_rd];
+			if(cl->q_off + ret < msg->len)
+			{
+				cl->q_off += ret;
+				break;
+			}
+			ret -= msg->len - cl->q_off;
+			cl->q_bytes -= msg->len;
+			if(!now_ns)
+				now_ns = lat_now_ns();
+			lat_hist_add(&tcp_lat_queue, msg->t_built_ns, now_ns);
+			lat_hist_add(&tcp_lat_e2e, msg->origin_ns, now_ns);
+			tcp_msg_put(msg);
+			cl->q_rd = (cl->q_rd+1) % TCP_CLIENT_QUEUE_LEN;
+			cl->q_n--;
+			cl->q_off = 0;
+		}
+	}
+
+	set_epollout(idx, 0);
+	return 0;
+}
+
+static void client_rx(void* cl, int mid)
+{
+	if(rx_handler)
+		rx_handler(cl, mid);
+}
+
+static void handle_client(int idx)
+{
+	tcp_client_t* cl = &tcp_clients[idx];
+	int ret = tcp_parser(&cl->parser, cl->fd, client_rx, cl);
 	if(ret == -10 || ret == -11)
 	{
-		fprintf(stderr,"Info: closing TCP connection.\n");
-		close(tcp_client_sock);
-		tcp_client_sock = -1;
+		fprintf(stderr,"Info: closing connection of client %d.\n", idx);
+		close_client(idx);
+	}
+}
+
+/*
+	Waits up to timeout_ms for socket events and handles them: new connections, incoming messages
+	(passed to the rx handler), and sockets that can take more output.
+	watch_fd (e.g. stdin, -1 = none) is polled along: returns 1 when it's readable, else 0.
+*/
+int tcp_comm_poll(int timeout_ms, int watch_fd)
+{
+	if(watch_fd != watched_fd)
+	{
+		if(watched_fd >= 0)
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watched_fd, NULL);
+		if(watch_fd >= 0)
+			epoll_add(watch_fd, EP_WATCH_FD);
+		watched_fd = watch_fd;
+	}
+
+	struct epoll_event evs[TCP_MAX_CLIENTS+3];
+	int n = epoll_wait(epoll_fd, evs, TCP_MAX_CLIENTS+3, timeout_ms);
+	if(n < 0)
+	{
+		if(errno == EINTR)
+			return 0;
+		fprintf(stderr, "epoll_wait() error %d", errno);
+		return -1;
+	}
+
+	int watch_ready = 0;
+	for(int i=0; i<n; i++)
+	{
+		uint32_t d = evs[i].data.u32;
+		if(d == EP_TCP_LISTENER)
+			handle_listener(tcp_listener_sock, 0);
+		else if(d == EP_UNIX_LISTENER)
+			handle_listener(unix_listener_sock, 1);
+		else if(d == EP_WATCH_FD)
+			watch_ready = 1;
+		else if(d < TCP_MAX_CLIENTS && tcp_clients[d].fd >= 0)
+		{
+			if(evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+				handle_client(d);
+			if(tcp_clients[d].fd >= 0 && (evs[i].events & EPOLLOUT))
+				flush_client(d);
+		}
+	}
+
+	return watch_ready;
+}
+
+uint32_t tcp_clients_with_hmap_level(int level)
+{
+	uint32_t mask = 0;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(tcp_clients[i].fd >= 0 && tcp_clients[i].hmap_level == level)
+			mask |= 1U<<i;
+	}
+	return mask;
+}
+
+/*
+	Clients subscribed to the type, who want it with scan number scan_cnt (or a snapshot it hasn't got yet).
+	sensor >= 0: only the ones subscribed to the pictures of that sensor.
+	Degraded clients skip (and count) what their level cuts out; snapshots are always sent.
+*/
+uint32_t tcp_clients_due(int type, uint32_t scan_cnt, int sensor)
+{
+	uint32_t mask = 0;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		tcp_client_t* cl = &tcp_clients[i];
+		tcp_cr_subscribe_t* sub = &cl->sub;
+		if(cl->fd < 0 || !(sub->types & (1<<type)) || (sensor >= 0 && !(sub->sensors & (1<<sensor))))
+			continue;
+		if(cl->snapshot_types & (1<<type))
+		{
+			mask |= 1U<<i;
+			continue;
+		}
+		if(!sub->div[type] || scan_cnt % sub->div[type])
+			continue;
+
+		int picture = (type == TCP_SUB_DEPTH || type == TCP_SUB_AMPL || type == TCP_SUB_POINTCLOUD);
+		int map = (type == TCP_SUB_HMAP || type == TCP_SUB_HMAP_DELTA || type == TCP_SUB_ELEVMAP);
+		if((picture && cl->degrade >= TCP_DEGRADE_NO_PICTURES) ||
+		   (map && cl->degrade >= TCP_DEGRADE_LOW_RATE && scan_cnt % (4*sub->div[type])))
+		{
+			cl->skipped[type]++;
+			continue;
+		}
+		mask |= 1U<<i;
+	}
+	return mask;
+}
+
+// Clients whose subscription flags, masked with mask, equal value
+uint32_t tcp_clients_with_sub_flags(int mask, int value)
+{
+	uint32_t ret = 0;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(tcp_clients[i].fd >= 0 && (tcp_clients[i].sub.flags & mask) == value)
+			ret |= 1U<<i;
 	}
 	return ret;
 }
 
-void tcp_comm_close()
+// The type has been queued to the clients in mask: their snapshot of it is done
+void tcp_clients_sent(int type, uint32_t mask)
 {
-	close(tcp_client_sock);
-	tcp_client_sock = -1;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(mask & (1U<<i))
+			tcp_clients[i].snapshot_types &= ~(1<<type);
+	}
 }
 
-int tcp_send(uint8_t* buf, int len)
+static const char* degrade_names[] = {"full rate", "no pictures", "low map rate", "newest scan only"};
+
+// Discards the queued messages that haven't started going out
+static void coalesce_client(tcp_client_t* cl)
 {
-	int timeout = 100;
-	uint8_t* p_buf = buf;
-	while(len)
+	int keep = (cl->q_off > 0) ? 1 : 0;
+
+	// The partly written message has to be finished, but not from the payload owner's buffer, which it would keep
+	// pinned for as long as the client is stalled: the rest of it is copied to a message of its own.
+	tcp_msg_t* head = cl->queue[cl->q_rd];
+	if(keep && head->owner.release)
 	{
-		int ret = write(tcp_client_sock, p_buf, (len>50000)?50000:len); // write() is broken with len over about 65536, at least in linux.
-		if(ret < 0)
+		int rest = head->len - cl->q_off;
+		tcp_msg_t* copy = tcp_msg_new(0, NULL, rest);
+		if(copy)
 		{
-			fprintf(stderr, "ERROR: tcp_send(): socket write error %d (%s). Closing TCP connection.\n", errno, strerror(errno));
-			tcp_comm_close();
-			return -1;
+			int hdr_rest = (cl->q_off < head->hdr_len) ? head->hdr_len - cl->q_off : 0;
+			memcpy(copy->buf, head->hdr + head->hdr_len - hdr_rest, hdr_rest);
+			memcpy(copy->buf + hdr_rest, head->payload + head->payload_len - (rest - hdr_rest), rest - hdr_rest);
+			copy->t_built_ns = head->t_built_ns;
+			copy->origin_ns = head->origin_ns;
+			cl->queue[cl->q_rd] = copy;
+			cl->q_bytes += rest - head->len;
+			cl->q_off = 0;
+			tcp_msg_put(head);
 		}
-//		else if(ret == 0)
-//		{
-//			fprintf(stderr, "INFO: tcp_send(): write() returned 0, closing TCP connection.\n");
-//			tcp_comm_close();
-//			return -2;
-//		}
-		
-		len -= ret;
-		p_buf += ret;
-		if(len)
-		{
-			fprintf(stderr,"INFO: tcp_send(): write() didn't write everything, written=%d, left=%d\n", ret, len);
-			usleep(200);
-			timeout--;
-
-			if(timeout == 0)
+	}
+
+	if(cl->q_n <= keep)
+		return;
+
+	for(int i=keep; i<cl->q_n; i++)
+	{
+		tcp_msg_t* msg = cl->queue[(cl->q_rd+i) % TCP_CLIENT_QUEUE_LEN];
+		cl->q_bytes -= msg->len;
+		tcp_msg_put(msg);
+		cl->coalesced++;
+	}
+	cl->q_n = keep;
+	cl->hmap_delta_seq = 0; // Its reference may be among the discarded: next one is a keyframe
+}
+
+/*
+	Call once per scan, before sending it: measures each client's bandwidth and how long its queue would take
+	to drain, and moves it between the TCP_DEGRADE_* levels. Drops move it up a level too.
+*/
+void tcp_clients_assess()
+{
+	static const int level_ms[] = TCP_DEGRADE_MS;
+	double now = timestamp();
+
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		tcp_client_t* cl = &tcp_clients[i];
+		if(cl->fd < 0)
+			continue;
+
+		double dt = now - cl->bw_t0;
+		if(dt >= 0.5)
+		{
+			double bw = cl->bw_bytes/dt;
+			cl->bw = cl->bw ? 0.7*cl->bw + 0.3*bw : bw;
+			cl->bw_bytes = 0;
+			cl->bw_t0 = now;
+		}
+
+		// The bandwidth is only known to be at least what's been written; 10 kB/s as the floor
+		double drain_ms = 1000.0*cl->q_bytes / ((cl->bw > 10000.0) ? cl->bw : 10000.0);
+		int level = cl->degrade;
+		while(level < TCP_DEGRADE_COALESCE && drain_ms > level_ms[level+1])
+			level++;
+		if(cl->dropped != cl->assessed_dropped && level < TCP_DEGRADE_COALESCE && level == cl->degrade)
+			level++;
+		cl->assessed_dropped = cl->dropped;
+
+		if(level > cl->degrade)
+		{
+			fprintf(stderr, "WARN: client %d is slow (%d kB queued, %.0f kB/s): %s\n",
+				i, cl->q_bytes/1024, cl->bw/1024.0, degrade_names[level]);
+			cl->degrade = level;
+			cl->calm_scans = 0;
+		}
+		else if(cl->q_n == 0)
+		{
+			if(cl->degrade > TCP_DEGRADE_NONE && ++cl->calm_scans >= TCP_RECOVER_SCANS)
 			{
-				fprintf(stderr, "ERROR: tcp_send() timeouted because write() doesn't seem to do anything useful. Closing TCP connection.\n");
-				tcp_comm_close();
-				return -1;
+				cl->degrade--;
+				cl->calm_scans = 0;
+				fprintf(stderr, "INFO: client %d keeps up again (%.0f kB/s): %s\n", i, cl->bw/1024.0, degrade_names[cl->degrade]);
 			}
 		}
+		else
+			cl->calm_scans = 0;
+
+		if(cl->degrade >= TCP_DEGRADE_COALESCE)
+			coalesce_client(cl);
+	}
+}
+
+void tcp_print_client_stats()
+{
+	fprintf(stderr, "client  link  kB/s     queued kB  sent MB  dropped  coalesced  skipped pict  skipped maps  state\n");
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		tcp_client_t* cl = &tcp_clients[i];
+		if(cl->fd < 0)
+			continue;
+		fprintf(stderr, "%-6d  %-4s  %-7.0f  %-9d  %-7.1f  %-7llu  %-9llu  %-12llu  %-12llu  %s\n",
+			i, cl->is_unix ? "unix" : "tcp", cl->bw/1024.0, cl->q_bytes/1024, cl->tx_bytes/1.0e6,
+			(unsigned long long)cl->dropped, (unsigned long long)cl->coalesced,
+			(unsigned long long)(cl->skipped[TCP_SUB_DEPTH] + cl->skipped[TCP_SUB_AMPL] + cl->skipped[TCP_SUB_POINTCLOUD]),
+			(unsigned long long)(cl->skipped[TCP_SUB_HMAP] + cl->skipped[TCP_SUB_HMAP_DELTA] + cl->skipped[TCP_SUB_ELEVMAP]),
+			degrade_names[cl->degrade]);
 	}
+}
 
-	return 0;
+// Smallest size class that fits size bytes, -1 if none does
+static int buf_class(int size)
+{
+	for(int c=0; c<TCP_BUF_CLASSES; c++)
+	{
+		if(size <= buf_sizes[c])
+			return c;
+	}
+	return -1;
+}
+
+static uint8_t* buf_get(int size)
+{
+	int c = buf_class(size);
+	if(c < 0)
+		return malloc(size);
+	if(!free_bufs[c])
+		return malloc(buf_sizes[c]);
+
+	void* buf = free_bufs[c];
+	free_bufs[c] = *(void**)buf;
+	n_free_bufs[c]--;
+	return buf;
+}
+
+// size is the one given to buf_get()
+static void buf_put(uint8_t* buf, int size)
+{
+	int c = buf_class(size);
+	if(c < 0 || n_free_bufs[c] >= TCP_BUF_POOL_LEN)
+	{
+		free(buf);
+		return;
+	}
+	*(void**)buf = free_bufs[c];
+	free_bufs[c] = buf;
+	n_free_bufs[c]++;
+}
+
+/*
+	Gets a message with one reference, owned by the caller, who fills in hdr[0..hdr_len-1].
+	With payload = NULL, msg->buf has room for payload_len bytes for the caller to fill; payload_len can be
+	lowered afterwards. Otherwise the payload is referenced if tcp_payload_owner is set, else copied to msg->buf.
+	Returns NULL when out of memory.
+*/
+tcp_msg_t* tcp_msg_new(int hdr_len, const void* payload, int payload_len)
+{
+	tcp_msg_t* msg = free_msgs;
+	if(msg)
+		free_msgs = msg->next_free;
+	else if(!(msg = malloc(sizeof *msg)))
+		return NULL;
+
+	msg->refcnt = 1;
+	msg->hdr_len = hdr_len;
+	msg->payload_len = payload_len;
+	msg->len = hdr_len + payload_len;
+	msg->buf = NULL;
+	msg->buf_size = 0;
+	msg->owner.release = NULL;
+	msg->t_built_ns = lat_now_ns();
+	msg->origin_ns = tcp_msg_origin_ns;
+
+	if(payload && tcp_payload_owner)
+	{
+		msg->owner = *tcp_payload_owner;
+		if(msg->owner.hold)
+			msg->owner.hold(msg->owner.arg);
+		msg->payload = payload;
+		return msg;
+	}
+
+	msg->buf = buf_get(payload_len);
+	if(!msg->buf)
+	{
+		tcp_msg_put(msg);
+		return NULL;
+	}
+	msg->buf_size = payload_len;
+	if(payload)
+		memcpy(msg->buf, payload, payload_len);
+	msg->payload = msg->buf;
+	return msg;
+}
+
+void tcp_msg_put(tcp_msg_t* msg)
+{
+	if(--msg->refcnt)
+		return;
+
+	if(msg->buf)
+		buf_put(msg->buf, msg->buf_size);
+	if(msg->owner.release)
+		msg->owner.release(msg->owner.arg);
+
+	if(msg >= msg_pool && msg < msg_pool+TCP_MSG_POOL_LEN)
+	{
+		msg->next_free = free_msgs;
+		free_msgs = msg;
+	}
+	else
+		free(msg);
+}
+
+/*
+	Queues the message to every client in tcp_dest_mask, and writes what can be written right away.
+	Takes over the caller's reference. Returns -1 if nobody got it.
+*/
+int tcp_send_shared(tcp_msg_t* msg)
+{
+	int n_sent = 0;
+	msg->len = msg->hdr_len + msg->payload_len;
+	tcp_sent_mask = 0;
+
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		tcp_client_t* cl = &tcp_clients[i];
+		if(cl->fd < 0 || !(tcp_dest_mask & (1U<<i)))
+			continue;
+
+		if(cl->q_n == TCP_CLIENT_QUEUE_LEN || cl->q_bytes + msg->len > TCP_CLIENT_MAX_QUEUED_BYTES)
+		{
+			cl->dropped++;
+			if(cl->dropped == 1 || cl->dropped%100 == 0)
+				fprintf(stderr, "WARN: client %d doesn't keep up, %llu messages dropped so far\n", i, (unsigned long long)cl->dropped);
+			continue;
+		}
+
+		msg->refcnt++;
+		cl->queue[(cl->q_rd + cl->q_n) % TCP_CLIENT_QUEUE_LEN] = msg;
+		cl->q_n++;
+		cl->q_bytes += msg->len;
+		n_sent++;
+		tcp_sent_mask |= 1U<<i;
+		tcp_sent_acc |= 1U<<i;
+
+		if(!cl->epollout) // Else, it's already waiting for room in the socket
+			flush_client(i);
+	}
+
+	tcp_msg_put(msg);
+	return n_sent ? 0 : -1;
+}
+
+// Copies the buffer to a new shared message, for small messages built on the stack
+int tcp_send(uint8_t* buf, int len)
+{
+	tcp_msg_t* msg = tcp_msg_new(0, NULL, len);
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send\n");
+		return -1;
+	}
+	memcpy(msg->buf, buf, len);
+	return tcp_send_shared(msg);
+}
+
+void tcp_comm_close()
+{
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(tcp_clients[i].fd >= 0)
+			close_client(i);
+	}
+
+	if(tcp_listener_sock >= 0) close(tcp_listener_sock);
+	if(unix_listener_sock >= 0)
+	{
+		close(unix_listener_sock);
+		unlink(unix_path);
+	}
+	if(epoll_fd >= 0) close(epoll_fd);
+	tcp_listener_sock = unix_listener_sock = epoll_fd = -1;
 }
@@ -5,7 +5,7 @@
 	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
 
 	This program is free software; you can redistribute it and/or modify
-	it under the terms of the GNU General Public License version 2, as 
+	it under the terms of the GNU General Public License version 2, as
 	published by the Free Software Foundation.
 
 	This program is distributed in the hope that it will be useful,
@@ -17,6 +17,24 @@
 
 
 
+	Clients connect over TCP (port 22222) or the Unix domain socket, any number of them up to TCP_MAX_CLIENTS.
+	Everything is non-blocking and driven by epoll in tcp_comm_poll(), called from the main loop.
+
+	An outgoing message is built once into a refcounted tcp_msg_t, and each destination client's
+	output queue holds a reference to it; it's released when the last client has written it out.
+	A client that doesn't read fast enough gets messages dropped (whole messages only) instead of stalling the others.
+	Before that, tcp_clients_assess() degrades its streams step by step, see TCP_DEGRADE_*, and restores them
+	once its queue stays empty.
+
+	A message is a small header (message id, size and the fixed fields) plus a payload, written out together
+	with one writev-style sendmsg. The payload is either in a pooled buffer, or - while tcp_payload_owner is set -
+	referenced in place, e.g. straight from the scan, which the owner keeps alive (pinned) until the message is released.
+	Message structs and payload buffers are recycled through free lists: no malloc per message.
+
+	Each message is stamped when it's built, and with the origin of its data (tcp_msg_origin_ns, e.g. when the
+	scan's first frame came from SPI). When a client's socket has taken its last byte, the latencies from these
+	go to tcp_lat_queue and tcp_lat_e2e, see latency.h.
+	All of this is for the main thread only.
 */
 
 #ifndef TCP_COMM_H
@@ -24,12 +42,115 @@
 
 #include <stdint.h>
 
-extern int tcp_listener_sock;
-extern int tcp_client_sock; // One client at the time is allowed.
+#include "tcp_parser.h"
+#include "latency.h"
+
+#define TCP_PORT 22222
+#define TCP_DEFAULT_UNIX_PATH "/tmp/pulutof.sock"
+
+#define TCP_MAX_CLIENTS 16
+#define TCP_CLIENT_QUEUE_LEN 64
+#define TCP_CLIENT_MAX_QUEUED_BYTES (4*1024*1024)
+#define TCP_CLIENT_NOTSENT_LOWAT (128*1024) // Unsent bytes a TCP socket takes beyond what's in flight
+
+#define TCP_ALL_CLIENTS 0xffffffffU
+
+// Degradation levels of a slow client, each including the previous ones
+#define TCP_DEGRADE_NONE        0
+#define TCP_DEGRADE_NO_PICTURES 1 // Raw pictures and point clouds are skipped
+#define TCP_DEGRADE_LOW_RATE    2 // Maps are sent at a quarter of the subscribed rate
+#define TCP_DEGRADE_COALESCE    3 // Unsent messages of older scans are discarded: only the newest scan is queued
+
+// Queue drain time (queued bytes / measured bandwidth) that moves a client to each level
+#define TCP_DEGRADE_MS {0, 150, 400, 1000}
+#define TCP_RECOVER_SCANS 30 // A level is restored after this many scans in a row with an empty queue
+
+#define TCP_MSG_HDR_MAX 32
+#define TCP_MSG_POOL_LEN 256    // Message structs kept for reuse; more are malloc'd when needed
+// Pooled payload buffers come in size classes, so that small messages don't take a buffer that fits any
+#define TCP_BUF_CLASSES 3
+#define TCP_BUF_SIZES {256, 8192, TCP_BUF_SIZE}
+#define TCP_BUF_SIZE (3+65535)  // The biggest class fits any message
+#define TCP_BUF_POOL_LEN 32     // Free buffers kept per class
+
+typedef struct
+{
+	void (*hold)(void* arg);    // Called when a message starts referencing the payload...
+	void (*release)(void* arg); // ...and when it's done with it
+	void* arg;
+} tcp_payload_owner_t;
+
+typedef struct tcp_msg
+{
+	struct tcp_msg* next_free;
+	int refcnt;
+	int len;            // hdr_len + payload_len, set by tcp_send_shared()
+	int hdr_len;
+	int payload_len;
+	const uint8_t* payload;
+	uint8_t* buf;       // Pooled buffer the payload is in; NULL when the payload is referenced
+	int buf_size;
+	tcp_payload_owner_t owner; // Of a referenced payload
+	uint64_t t_built_ns;
+	uint64_t origin_ns;
+	uint8_t hdr[TCP_MSG_HDR_MAX];
+} tcp_msg_t;
+
+typedef struct
+{
+	int fd; // -1 = free slot
+	int is_unix;
+	int hmap_level; // Objmap pyramid level subscribed with TCP_CR_HMAP_LEVEL_MID; 0 = full resolution
+	int subscribed; // Has sent TCP_CR_SUBSCRIBE_MID; else sub has the defaults, see tcp_parser.h
+	tcp_cr_subscribe_t sub;
+	int snapshot_types; // TCP_SUB_* bits of a snapshot request not sent yet, see tcp_clients_sent()
+	uint32_t hmap_delta_seq; // Last TCP_RC_HMAP_DELTA_MID frame queued to it, the reference of the next delta; 0 = none
+	tcp_parser_state_t parser;
+
+	// Output queue; the first message is written from q_off on
+	tcp_msg_t* queue[TCP_CLIENT_QUEUE_LEN];
+	int q_rd, q_n, q_off;
+	int q_bytes;
+	int epollout; // EPOLLOUT is registered (the socket was full)
+	uint64_t dropped;
+
+	// Link tracking, see tcp_clients_assess()
+	uint64_t tx_bytes;
+	uint64_t bw_bytes;  // Written since bw_t0
+	double bw_t0;
+	double bw;          // Bytes/s, averaged
+	uint64_t assessed_dropped;
+	int degrade;        // TCP_DEGRADE_*
+	int calm_scans;
+	uint64_t skipped[TCP_SUB_N_TYPES]; // Messages not sent because of the degradation
+	uint64_t coalesced;
+} tcp_client_t;
+
+// Called for every complete message received from a client; mid is the message id, the data is in its msg_cr_* struct.
+typedef void (*tcp_rx_handler_t)(tcp_client_t* cl, int mid);
+
+extern tcp_client_t tcp_clients[TCP_MAX_CLIENTS];
+extern int tcp_n_clients;
+extern uint32_t tcp_dest_mask; // Bit n = tcp_clients[n]: who the tcp_send_* functions send to. Default all.
+extern uint32_t tcp_sent_mask; // Who the last tcp_send_shared() queued the message to (not dropped)
+extern uint32_t tcp_sent_acc; // Same, ORed over every message since the caller last zeroed it
+extern const tcp_payload_owner_t* tcp_payload_owner; // Payloads given to the tcp_send_* functions belong to this; NULL = copy them
+extern uint64_t tcp_msg_origin_ns; // Origin stamp of the messages built from now on, 0 = none
+extern lat_hist_t tcp_lat_queue;   // Built -> written to the socket, per client
+extern lat_hist_t tcp_lat_e2e;     // Origin -> written to the socket, per client
+
+int init_tcp_comm(const char* unix_path, tcp_rx_handler_t handler);
+int tcp_comm_poll(int timeout_ms, int watch_fd);
+uint32_t tcp_clients_with_hmap_level(int level);
+uint32_t tcp_clients_due(int type, uint32_t scan_cnt, int sensor);
+uint32_t tcp_clients_with_sub_flags(int mask, int value);
+void tcp_clients_sent(int type, uint32_t mask);
+void tcp_clients_assess();
+void tcp_print_client_stats();
 
-int init_tcp_comm();
-int handle_tcp_client();
-int handle_tcp_listener();
+tcp_msg_t* tcp_msg_new(int hdr_len, const void* payload, int payload_len);
+void tcp_msg_put(tcp_msg_t* msg);
+int tcp_send_shared(tcp_msg_t* msg);
 int tcp_send(uint8_t* buf, int len);
 void tcp_comm_close();
 
@@ -22,15 +22,19 @@
 
 */
 
+#define _DEFAULT_SOURCE
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <endian.h>
 
 #include "tcp_comm.h"
 #include "tcp_parser.h"
+#include "depthcodec.h"
+#include "mapcodec.h"
 
 tcp_cr_maintenance_t msg_cr_maintenance;
 tcp_message_t msgmeta_cr_maintenance =
@@ -40,14 +44,51 @@ tcp_message_t msgmeta_cr_maintenance =
 	8, "ii"
 };
 
-#define NUM_CR_MSGS 1
+tcp_cr_hmap_level_t msg_cr_hmap_level;
+tcp_message_t msgmeta_cr_hmap_level =
+{
+	&msg_cr_hmap_level,
+	TCP_CR_HMAP_LEVEL_MID,
+	1, "B"
+};
+
+tcp_cr_subscribe_t msg_cr_subscribe;
+tcp_message_t msgmeta_cr_subscribe =
+{
+	&msg_cr_subscribe,
+	TCP_CR_SUBSCRIBE_MID,
+	11, "BBBBBBBBBBB"
+};
+
+#define NUM_CR_MSGS 3
 tcp_message_t* CR_MSGS[NUM_CR_MSGS] =
 {
-	&msgmeta_cr_maintenance
+	&msgmeta_cr_maintenance,
+	&msgmeta_cr_hmap_level,
+	&msgmeta_cr_subscribe
 };
 
+// Writes the message header for a payload_len byte payload; returns the header length, 3 or 7 (extended frame)
+static int put_msg_header(uint8_t* buf, int mid, uint32_t payload_len)
+{
+	buf[0] = mid;
+	if(payload_len < TCP_EXT_SIZE)
+	{
+		buf[1] = (payload_len>>8)&0xff;
+		buf[2] = payload_len&0xff;
+		return 3;
+	}
+	buf[1] = buf[2] = 0xff;
+	buf[3] = (payload_len>>24)&0xff;
+	buf[4] = (payload_len>>16)&0xff;
+	buf[5] = (payload_len>>8)&0xff;
+	buf[6] = payload_len&0xff;
+	return 7;
+}
+
 #define I32TOBUF(i_, b_, s_) {b_[(s_)] = ((i_)>>24)&0xff; b_[(s_)+1] = ((i_)>>16)&0xff; b_[(s_)+2] = ((i_)>>8)&0xff; b_[(s_)+3] = ((i_)>>0)&0xff; }
 #define I16TOBUF(i_, b_, s_) {b_[(s_)] = ((i_)>>8)&0xff; b_[(s_)+1] = ((i_)>>0)&0xff; }
+#define U64TOBUF(i_, b_, s_) {I32TOBUF((uint32_t)((i_)>>32), b_, s_); I32TOBUF((uint32_t)(i_), b_, (s_)+4); }
 
 void tcp_send_picture(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, uint8_t *pict)
 {
@@ -58,13 +99,14 @@ void tcp_send_picture(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, uint8
 	}
 
 	int size=3+2+1+2+2+(xs*ys)*bytes_per_pixel;
-	uint8_t *buf = malloc(size);
+	tcp_msg_t *msg = tcp_msg_new(10, pict, bytes_per_pixel*xs*ys);
 
-	if(!buf)
+	if(!msg)
 	{
 		fprintf(stderr, "ERROR: Out of memory in tcp_send_picture\n");
 		return;
 	}
+	uint8_t *buf = msg->hdr;
 
 	buf[0] = TCP_RC_PICTURE_MID;
 	buf[1] = ((size-3)>>8)&0xff;
@@ -75,11 +117,45 @@ void tcp_send_picture(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, uint8
 	I16TOBUF(xs, buf, 6);
 	I16TOBUF(ys, buf, 8);
 
-	memcpy(&buf[10], pict, bytes_per_pixel*xs*ys);
+	tcp_send_shared(msg);
+}
 
-	tcp_send(buf, size);
+/*
+	Like tcp_send_picture(), but the image is compressed losslessly with depthcodec.h (1 or 2 bytes per pixel).
+	Payload: int16_t id, then the dcodec stream, which has the image size and bytes per pixel.
+*/
+void tcp_send_picture_packed(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, const void *pict)
+{
+	if(xs < 1 || ys < 1 || xs > 10000 || ys > 10000 || (bytes_per_pixel != 1 && bytes_per_pixel != 2))
+	{
+		fprintf(stderr, "ERROR: tcp_send_picture_packed: invalid params\n");
+		return;
+	}
 
-	free(buf);
+	tcp_msg_t *msg = tcp_msg_new(5, NULL, dcodec_max_size(bytes_per_pixel, xs, ys));
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_picture_packed\n");
+		return;
+	}
+	uint8_t *buf = msg->hdr;
+
+	msg->payload_len = dcodec_encode(msg->buf, pict, bytes_per_pixel, xs, ys);
+	int size = 3+2+msg->payload_len;
+	if(size-3 >= TCP_EXT_SIZE)
+	{
+		fprintf(stderr, "ERROR: tcp_send_picture_packed: picture doesn't fit in a message\n");
+		tcp_msg_put(msg);
+		return;
+	}
+
+	buf[0] = TCP_RC_PICTURE_PACKED_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	I16TOBUF(id, buf, 3);
+
+	tcp_send_shared(msg);
 }
 
 void tcp_send_hmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int8_t *hmap)
@@ -91,7 +167,13 @@ void tcp_send_hmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_
 	}
 
 	int size = 3 + 2+2+4+4+2+1+xsamps*ysamps;
-	uint8_t *buf = malloc(size);
+	tcp_msg_t *msg = tcp_msg_new(18, hmap, xsamps*ysamps);
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_hmap\n");
+		return;
+	}
+	uint8_t *buf = msg->hdr;
 	buf[0] = TCP_RC_HMAP_MID;
 	buf[1] = ((size-3)>>8)&0xff;
 	buf[2] = (size-3)&0xff;
@@ -103,262 +185,735 @@ void tcp_send_hmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_
 	I32TOBUF(yorig_mm, buf, 13);
 	buf[17] = unit_size_mm;
 
-	memcpy(&buf[18], (uint8_t*)hmap, xsamps*ysamps);
+	tcp_send_shared(msg);
+}
 
-	tcp_send(buf, size);
-	free(buf);
+/*
+	Objmap pyramid level: like the hmap, but with the level number and a 16-bit unit size (320 mm doesn't fit in a byte).
+*/
+void tcp_send_hmap_level(int level, int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int8_t *hmap)
+{
+	if(xsamps < 1 || xsamps > 256 || ysamps < 1 || ysamps > 256 || unit_size_mm < 2 || unit_size_mm > 10000 || !hmap)
+	{
+		printf("ERR: tcp_send_hmap_level() argument sanity check fail\n");
+		return;
+	}
+
+	int size = 3 + 1+2+2+2+4+4+2+xsamps*ysamps;
+	tcp_msg_t *msg = tcp_msg_new(20, hmap, xsamps*ysamps);
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_hmap_level\n");
+		return;
+	}
+	uint8_t *buf = msg->hdr;
+	buf[0] = TCP_RC_HMAP_LEVEL_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	buf[3] = level;
+	I16TOBUF(xsamps, buf, 4);
+	I16TOBUF(ysamps, buf, 6);
+	I16TOBUF((ang>>16), buf, 8);
+	I32TOBUF(xorig_mm, buf, 10);
+	I32TOBUF(yorig_mm, buf, 14);
+	I16TOBUF(unit_size_mm, buf, 18);
+
+	tcp_send_shared(msg);
 }
 
-int tcp_send_msg(tcp_message_t* msg_type, void* msg)
+/*
+	Elevation map, 3 bytes per cell: min_z, max_z (int8_t, in ELEVMAP_Z_UNIT mm, ELEVMAP_NO_DATA = no samples)
+	and number of samples (saturated to 255). Doesn't fit in one message, so it's sent in bands of rows:
+	each message carries its first row index and number of rows.
+*/
+#define ELEVMAP_Z_UNIT  20
+#define ELEVMAP_NO_DATA -128
+
+static int8_t elev_z_to_i8(int z)
 {
-	static uint8_t sendbuf[65536];
-	sendbuf[0] = msg_type->mid;
-	sendbuf[1] = (msg_type->size>>8)&0xff;
-	sendbuf[2] = msg_type->size&0xff;
+	int zq = (z >= 0) ? (z+ELEVMAP_Z_UNIT/2)/ELEVMAP_Z_UNIT : -((-z+ELEVMAP_Z_UNIT/2)/ELEVMAP_Z_UNIT);
+	if(zq < -127) zq = -127;
+	if(zq > 127) zq = 127;
+	return zq;
+}
 
-	uint8_t* p_dest = sendbuf+3;
-	uint8_t* p_src = msg;
+void tcp_send_elevmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, const tof3d_elev_t *elevmap)
+{
+	if(xsamps < 1 || xsamps > 256 || ysamps < 1 || ysamps > 256 || unit_size_mm < 2 || unit_size_mm > 200 || !elevmap)
+	{
+		printf("ERR: tcp_send_elevmap() argument sanity check fail\n");
+		return;
+	}
+
+	int rows_per_msg = 60000/(xsamps*3);
 
-	for(int field=0;;field++)
+	for(int y0 = 0; y0 < ysamps; y0 += rows_per_msg)
 	{
-		switch(msg_type->types[field])
+		int n_rows = (ysamps-y0 < rows_per_msg) ? (ysamps-y0) : rows_per_msg;
+		int size = 3 + 2+2+2+2+2+4+4+1+1 + n_rows*xsamps*3;
+		tcp_msg_t *msg = tcp_msg_new(23, NULL, n_rows*xsamps*3);
+		if(!msg)
 		{
-			case 'b':
-			case 'B':
-				*(p_dest++) = *(p_src++);
-			break;
-
-			case 's':
-			case 'S':
+			fprintf(stderr, "ERROR: Out of memory in tcp_send_elevmap\n");
+			return;
+		}
+		uint8_t *buf = msg->hdr;
+
+		buf[0] = TCP_RC_ELEVMAP_MID;
+		buf[1] = ((size-3)>>8)&0xff;
+		buf[2] = (size-3)&0xff;
+
+		I16TOBUF(xsamps, buf, 3);
+		I16TOBUF(ysamps, buf, 5);
+		I16TOBUF(y0, buf, 7);
+		I16TOBUF(n_rows, buf, 9);
+		I16TOBUF((ang>>16), buf, 11);
+		I32TOBUF(xorig_mm, buf, 13);
+		I32TOBUF(yorig_mm, buf, 17);
+		buf[21] = unit_size_mm;
+		buf[22] = ELEVMAP_Z_UNIT;
+
+		uint8_t* p_out = msg->buf;
+		const tof3d_elev_t* p_in = &elevmap[y0*xsamps];
+		for(int i=0; i < n_rows*xsamps; i++)
+		{
+			if(p_in[i].n_samples == 0)
 			{
-				*(p_dest++) = (((*((uint16_t*)p_src)) )>>8)&0xff;
-				*(p_dest++) = (((*((uint16_t*)p_src)) )>>0)&0xff;
-				p_src+=2;
+				*(p_out++) = (uint8_t)ELEVMAP_NO_DATA;
+				*(p_out++) = (uint8_t)ELEVMAP_NO_DATA;
+				*(p_out++) = 0;
 			}
-			break;
-
-			case 'i':
-			case 'I':
+			else
 			{
-				*(p_dest++) = (((*((uint32_t*)p_src)) )>>24)&0xff;
-				*(p_dest++) = (((*((uint32_t*)p_src)) )>>16)&0xff;
-				*(p_dest++) = (((*((uint32_t*)p_src)) )>>8)&0xff;
-				*(p_dest++) = (((*((uint32_t*)p_src)) )>>0)&0xff;
-				p_src+=4;
+				*(p_out++) = elev_z_to_i8(p_in[i].min_z);
+				*(p_out++) = elev_z_to_i8(p_in[i].max_z);
+				*(p_out++) = (p_in[i].n_samples > 255) ? 255 : p_in[i].n_samples;
 			}
-			break;
+		}
 
-			case 'l':
-			case 'L':
-			{
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>56)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>48)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>40)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>32)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>24)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>16)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>8)&0xff;
-				*(p_dest++) = (((*((uint64_t*)p_src)) )>>0)&0xff;
-				p_src+=8;
-			}
+		if(tcp_send_shared(msg) < 0)
 			break;
+	}
+}
 
-			case 0:
-				goto PARSE_END;
+/*
+	Obstacle list: robot pose, number of objects, then 13 bytes per object:
+	x0, y0, x1, y1 (int16, mm rel. to robot), class (uint8), min_dist (uint16, mm), n_cells (uint16)
+*/
+void tcp_send_objlist(int32_t ang, int xorig_mm, int yorig_mm, int n_objects, const tof3d_object_t *objects)
+{
+	uint8_t buf[3 + 2+4+4+1 + 255*13];
 
-			default:
-				fprintf(stderr, "ERROR: parse type string has invalid character 0x%02x\n", msg_type->types[field]);
-				return -2;
+	if(n_objects < 0 || n_objects > 255 || (n_objects && !objects))
+	{
+		printf("ERR: tcp_send_objlist() argument sanity check fail\n");
+		return;
+	}
+
+	int size = 3 + 2+4+4+1 + n_objects*13;
+	buf[0] = TCP_RC_OBJLIST_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	I16TOBUF((ang>>16), buf, 3);
+	I32TOBUF(xorig_mm, buf, 5);
+	I32TOBUF(yorig_mm, buf, 9);
+	buf[13] = n_objects;
+
+	for(int i=0; i<n_objects; i++)
+	{
+		int o = 14 + i*13;
+		I16TOBUF(objects[i].x0, buf, o);
+		I16TOBUF(objects[i].y0, buf, o+2);
+		I16TOBUF(objects[i].x1, buf, o+4);
+		I16TOBUF(objects[i].y1, buf, o+6);
+		buf[o+8] = objects[i].cls;
+		I16TOBUF(objects[i].min_dist, buf, o+9);
+		I16TOBUF(objects[i].n_cells, buf, o+11);
+	}
+
+	tcp_send(buf, size);
+}
+
+/*
+	Same as the hmap, but 4 bits per sample in tile_size*tile_size tiles (see objmap.h): half the size on the wire.
+*/
+void tcp_send_hmap_packed(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int tile_size, uint8_t *packed, int packed_len)
+{
+	if(xsamps < 1 || xsamps > 256 || ysamps < 1 || ysamps > 256 || unit_size_mm < 2 || unit_size_mm > 200 || tile_size < 2 || tile_size > 64 || packed_len > 60000 || !packed)
+	{
+		printf("ERR: tcp_send_hmap_packed() argument sanity check fail\n");
+		return;
+	}
+
+	int size = 3 + 2+2+4+4+2+1+1+packed_len;
+	tcp_msg_t *msg = tcp_msg_new(19, packed, packed_len);
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_hmap_packed\n");
+		return;
+	}
+	uint8_t *buf = msg->hdr;
+	buf[0] = TCP_RC_HMAP_PACKED_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	I16TOBUF(xsamps, buf, 3);
+	I16TOBUF(ysamps, buf, 5);
+	I16TOBUF((ang>>16), buf, 7);
+	I32TOBUF(xorig_mm, buf, 9);
+	I32TOBUF(yorig_mm, buf, 13);
+	buf[17] = unit_size_mm;
+	buf[18] = tile_size;
+
+	tcp_send_shared(msg);
+}
+
+/*
+	Objmap as run-length coded keyframes and deltas (mapcodec.h), for the full scan rate on slow links.
+
+	Header: the hmap fields, then uint32_t seq (counts from 1) and uint32_t ref_seq, then the mapcodec stream.
+	ref_seq = 0: a keyframe. Else, the map is a delta against frame ref_seq, which is always the last frame
+	that client got: the client only needs to keep its current map, and decode in place.
+
+	Each client gets deltas against its own last frame, as long as that's in the history; clients with the same
+	reference share the message. Others (new, or with a rate divider) get a keyframe, and everyone gets one
+	every HMAP_KEYFRAME_INTERVAL frames to recover from anything.
+*/
+#define HMAP_DELTA_HISTORY 8
+#define HMAP_KEYFRAME_INTERVAL 64
+
+static struct
+{
+	uint32_t seq; // 0 = unused
+	int xs, ys;
+	int8_t* map;
+} hmap_history[HMAP_DELTA_HISTORY];
+static uint32_t hmap_delta_seq;
+
+static void send_hmap_frame(uint32_t dest, uint32_t seq, uint32_t ref_seq, const int8_t* ref,
+	int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, const int8_t *hmap)
+{
+	tcp_msg_t *msg = tcp_msg_new(26, NULL, mcodec_max_size(xsamps*ysamps));
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_hmap_delta\n");
+		return;
+	}
+
+	msg->payload_len = mcodec_encode(msg->buf, hmap, ref, xsamps*ysamps);
+	int size = 26 + msg->payload_len;
+	if(size-3 >= TCP_EXT_SIZE)
+	{
+		fprintf(stderr, "ERROR: tcp_send_hmap_delta: map doesn't fit in a message\n");
+		tcp_msg_put(msg);
+		return;
+	}
+
+	uint8_t *buf = msg->hdr;
+	buf[0] = TCP_RC_HMAP_DELTA_MID;
+	buf[1] = ((size-3)>>8)&0xff;
+	buf[2] = (size-3)&0xff;
+
+	I16TOBUF(xsamps, buf, 3);
+	I16TOBUF(ysamps, buf, 5);
+	I16TOBUF((ang>>16), buf, 7);
+	I32TOBUF(xorig_mm, buf, 9);
+	I32TOBUF(yorig_mm, buf, 13);
+	buf[17] = unit_size_mm;
+	I32TOBUF(seq, buf, 18);
+	I32TOBUF(ref_seq, buf, 22);
+
+	tcp_dest_mask = dest;
+	tcp_send_shared(msg);
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(tcp_sent_mask & (1U<<i))
+			tcp_clients[i].hmap_delta_seq = seq;
+	}
+}
+
+void tcp_send_hmap_delta(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, const int8_t *hmap)
+{
+	if(xsamps < 1 || xsamps > 256 || ysamps < 1 || ysamps > 256 || unit_size_mm < 2 || unit_size_mm > 200 || !hmap)
+	{
+		printf("ERR: tcp_send_hmap_delta() argument sanity check fail\n");
+		return;
+	}
+
+	uint32_t dest = tcp_dest_mask;
+	uint32_t seq = ++hmap_delta_seq;
+	if(seq == 0) // 0 means "none"
+		seq = ++hmap_delta_seq;
+
+	uint32_t remaining = 0;
+	for(int i=0; i<TCP_MAX_CLIENTS; i++)
+	{
+		if(tcp_clients[i].fd >= 0 && (dest & (1U<<i)))
+			remaining |= 1U<<i;
+	}
+
+	// Deltas, one per distinct reference in the history
+	for(int h=0; h<HMAP_DELTA_HISTORY && seq % HMAP_KEYFRAME_INTERVAL; h++)
+	{
+		if(!hmap_history[h].seq || hmap_history[h].xs != xsamps || hmap_history[h].ys != ysamps)
+			continue;
+
+		uint32_t group = 0;
+		for(int i=0; i<TCP_MAX_CLIENTS; i++)
+		{
+			if((remaining & (1U<<i)) && tcp_clients[i].hmap_delta_seq == hmap_history[h].seq)
+				group |= 1U<<i;
+		}
+		if(group)
+		{
+			send_hmap_frame(group, seq, hmap_history[h].seq, hmap_history[h].map, xsamps, ysamps, ang, xorig_mm, yorig_mm, unit_size_mm, hmap);
+			remaining &= ~group;
 		}
 	}
 
-	PARSE_END: ;
+	if(remaining)
+		send_hmap_frame(remaining, seq, 0, NULL, xsamps, ysamps, ang, xorig_mm, yorig_mm, unit_size_mm, hmap);
 
-	//fprintf(stderr, "Sending tcp, size=%d\n", msg_type->size+3);
-	tcp_send(sendbuf, msg_type->size+3);
+	tcp_dest_mask = dest;
 
-	return 0;
+	// Replace the oldest
+	int oldest = 0;
+	for(int h=1; h<HMAP_DELTA_HISTORY; h++)
+	{
+		if(hmap_history[h].seq < hmap_history[oldest].seq)
+			oldest = h;
+	}
+	if(!hmap_history[oldest].map && !(hmap_history[oldest].map = malloc(256*256)))
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_hmap_delta\n");
+		return;
+	}
+	hmap_history[oldest].seq = seq;
+	hmap_history[oldest].xs = xsamps;
+	hmap_history[oldest].ys = ysamps;
+	memcpy(hmap_history[oldest].map, hmap, xsamps*ysamps);
 }
 
 /*
-Return value:
-< 0: Error.
-0: Message was not parsed (not fully received yet)
->0: Message ID of the parsed message.
+	Point cloud of the scan (relative to the robot or in world coordinates, as the cloud was generated),
+	only the points of one sensor if sensor >= 0. Points are int16_t x, y, z in unit_mm steps relative to
+	an origin chosen per message, so they're 6 bytes instead of 12; unit_mm is the smallest power of two that
+	covers the extent of the points (1 mm within +-32 m of the origin). Extended frame when needed.
+
+	Payload:
+		int16_t  robot ang, int32_t robot x, y (mm)
+		uint8_t  sensor (0xff = all), uint8_t flags (bit 0: amplitudes follow the points)
+		uint8_t  sensor_mask of the scan: per sensor, one message is sent for each bit
+		int32_t  origin x, y, z (mm)
+		uint16_t unit_mm
+		uint32_t n_points
+		int16_t  x, y, z of each point
+		uint8_t  amplitude of each point, if flagged
 */
+#define PC_HDR_LEN (2+4+4+1+1+1+4+4+4+2+4)
 
-int tcp_parser(int sock)
+void tcp_send_pointcloud(const tof3d_scan_t *scan, int sensor, int with_ampl)
 {
-	int ret;
-	static int state = 0; // Num of bytes read
-	static struct __attribute__ ((packed)) { uint8_t mid; uint8_t size_msb; uint8_t size_lsb;} header; // Stored header of incoming message
-	static int bytes_left = 0;
-	static tcp_message_t* msg = 0; // Once message is recognized, pointer to message type struct.
-	static int unrecog = 0;
-
-	static uint8_t buf[65536];
-	static uint8_t* p_buf = buf;
-
-	if(state < 3)
-	{
-		msg = 0;
-		unrecog = 0;
-		ret = read(sock, (uint8_t*)&(header.mid) + state, 3-state);
-		if(ret < 0)
+	int n = 0;
+	int32_t min[3] = {INT32_MAX, INT32_MAX, INT32_MAX}, max[3] = {INT32_MIN, INT32_MIN, INT32_MIN};
+	for(int i=0; i<scan->n_points; i++)
+	{
+		if(sensor >= 0 && scan->cloud_sidx[i] != sensor)
+			continue;
+		int32_t c[3] = {scan->cloud[i].x, scan->cloud[i].y, scan->cloud[i].z};
+		for(int k=0; k<3; k++)
 		{
-			fprintf(stderr, "ERROR: TCP stream read error %d (%s)\n", errno, strerror(errno));
-			state = 0;
-			return -11;
+			if(c[k] < min[k]) min[k] = c[k];
+			if(c[k] > max[k]) max[k] = c[k];
 		}
-		else if(ret == 0)
+		n++;
+	}
+	int32_t origin[3] = {0, 0, 0};
+	int64_t extent = 0;
+	if(n)
+	{
+		for(int k=0; k<3; k++)
 		{
-			fprintf(stderr, "Client closed connection\n");
-			state = 0;
-			return -10;
+			origin[k] = ((int64_t)min[k] + max[k])/2;
+			if((int64_t)max[k]-origin[k] > extent) extent = (int64_t)max[k]-origin[k];
+			if((int64_t)origin[k]-min[k] > extent) extent = (int64_t)origin[k]-min[k];
 		}
-		else
-			state += ret;
 	}
+	int shift = 0;
+	while((extent>>shift) > 32767)
+		shift++;
+
+	int payload_len = PC_HDR_LEN + n*6 + (with_ampl ? n : 0);
+	uint8_t hdr[7];
+	int hl = put_msg_header(hdr, TCP_RC_POINTCLOUD_MID, payload_len);
 
-	if(state >= 3)
+	tcp_msg_t *msg = tcp_msg_new(hl, NULL, payload_len);
+	if(!msg)
 	{
-		if(msg == 0 && unrecog == 0)
-		{		
-			for(int i=0; i<NUM_CR_MSGS; i++)
-			{
-				if(CR_MSGS[i]->mid == header.mid)
-				{
-					msg = CR_MSGS[i];
-					break;
-				}
-			}
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_pointcloud\n");
+		return;
+	}
+	memcpy(msg->hdr, hdr, hl);
+
+	uint8_t *buf = msg->buf;
+	I16TOBUF((scan->robot_pos.ang>>16), buf, 0);
+	I32TOBUF(scan->robot_pos.x, buf, 2);
+	I32TOBUF(scan->robot_pos.y, buf, 6);
+	buf[10] = (sensor >= 0) ? sensor : 0xff;
+	buf[11] = with_ampl ? 1 : 0;
+	buf[12] = scan->sensor_mask;
+	I32TOBUF(origin[0], buf, 13);
+	I32TOBUF(origin[1], buf, 17);
+	I32TOBUF(origin[2], buf, 21);
+	I16TOBUF(1<<shift, buf, 25);
+	I32TOBUF(n, buf, 27);
+
+	uint8_t* p_pt = &buf[PC_HDR_LEN];
+	uint8_t* p_ampl = p_pt + n*6;
+	for(int i=0; i<scan->n_points; i++)
+	{
+		if(sensor >= 0 && scan->cloud_sidx[i] != sensor)
+			continue;
+		int32_t c[3] = {scan->cloud[i].x, scan->cloud[i].y, scan->cloud[i].z};
+		for(int k=0; k<3; k++)
+		{
+			// Rounded to the nearest step; the extent check keeps it in range
+			int32_t q = (int32_t)(((int64_t)c[k] - origin[k] + ((1<<shift)>>1)) >> shift);
+			if(q > 32767) q = 32767;
+			I16TOBUF(q, p_pt, 0);
+			p_pt += 2;
+		}
+		if(with_ampl)
+			*p_ampl++ = scan->cloud_ampl[i];
+	}
 
-			int size_from_header = ((int)header.size_msb<<8) | (int)header.size_lsb;
-			if(!msg)
-			{
-				fprintf(stderr, "WARN: Ignoring unrecognized message with msgid 0x%02x\n", header.mid);
-				unrecog = 1;
-			}
-			else if(size_from_header != msg->size)
-			{
-				fprintf(stderr, "WARN: Ignoring message with msgid 0x%02x because of size mismatch (got:%u, expected:%u)\n",
-					header.mid, size_from_header, msg->size);
-				unrecog = 1;
-			}
-			bytes_left = size_from_header;
-			p_buf = buf;
+	tcp_send_shared(msg);
+}
+
+/*
+	Organized point cloud of one sensor (see tof3d_organized_t), in extended frames: the planes of
+	the struct as they are, with the int16_t ones big endian.
+
+	Payload:
+		int16_t  robot ang, int32_t robot x, y (mm)
+		uint8_t  sensor
+		uint16_t xs, ys (pixels)
+		uint8_t  valid[xs*ys/8]   bit i%8 of byte i/8 set when pixel i has a point
+		int16_t  x[xs*ys], y[xs*ys], z[xs*ys] (mm, robot coordinates)
+		int8_t   nx[xs*ys], ny[xs*ys], nz[xs*ys] (normal, scaled to 127)
+		uint8_t  curvature[xs*ys]
+*/
+#define ORG_N (TOF_XS*TOF_YS)
+#define ORG_HDR_LEN (2+4+4+1+2+2)
+#define ORG_LEN (ORG_HDR_LEN + ORG_N/8 + 3*2*ORG_N + 4*ORG_N)
+
+void tcp_send_organized(const tof3d_scan_t *scan, int sensor)
+{
+	if(sensor < 0 || sensor > 3 || !scan->organized_valid)
+	{
+		printf("ERR: tcp_send_organized() argument sanity check fail\n");
+		return;
+	}
+
+	uint8_t hdr[7];
+	int hl = put_msg_header(hdr, TCP_RC_ORGANIZED_MID, ORG_LEN);
+
+	tcp_msg_t *msg = tcp_msg_new(hl, NULL, ORG_LEN);
+	if(!msg)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_organized\n");
+		return;
+	}
+	memcpy(msg->hdr, hdr, hl);
+
+	const tof3d_organized_t *org = &scan->organized[sensor];
+	uint8_t *buf = msg->buf;
+	I16TOBUF((scan->robot_pos.ang>>16), buf, 0);
+	I32TOBUF(scan->robot_pos.x, buf, 2);
+	I32TOBUF(scan->robot_pos.y, buf, 6);
+	buf[10] = sensor;
+	I16TOBUF(TOF_XS, buf, 11);
+	I16TOBUF(TOF_YS, buf, 13);
+
+	uint8_t *p = &buf[ORG_HDR_LEN];
+	memcpy(p, org->valid, ORG_N/8); p += ORG_N/8;
+	const int16_t *planes[3] = {org->x, org->y, org->z};
+	for(int k=0; k<3; k++)
+	{
+		for(int i=0; i<ORG_N; i++, p+=2)
+			I16TOBUF(planes[k][i], p, 0);
+	}
+	memcpy(p, org->nx, ORG_N); p += ORG_N;
+	memcpy(p, org->ny, ORG_N); p += ORG_N;
+	memcpy(p, org->nz, ORG_N); p += ORG_N;
+	memcpy(p, org->curvature, ORG_N);
+
+	tcp_send_shared(msg);
+}
+
+/*
+	Pipeline stamps of a scan (see latency.h), sent before the other messages of the scan: everything up to the
+	next timing message is from it. The stamps are the host's CLOCK_MONOTONIC in ns, so a client on the same
+	host can compare them with its own clock; remote ones can use the differences. 0 = not stamped.
+
+	Payload:
+		uint32_t scan_cnt (as counted by main)
+		uint8_t  sensor_mask
+		uint64_t spi[4]        frame of each sensor read from SPI
+		uint64_t processed[4]  distances_to_objmap() done with it
+		uint64_t published     scan complete
+		uint64_t consumed      picked up by main
+		uint64_t sent          this message built
+*/
+#define TIMING_LEN (4+1+8*11)
+
+void tcp_send_timing(uint32_t scan_cnt, int sensor_mask, const tof3d_stamps_t *stamps)
+{
+	uint8_t buf[3+TIMING_LEN];
+
+	int hl = put_msg_header(buf, TCP_RC_TIMING_MID, TIMING_LEN);
+	uint8_t *p = &buf[hl];
+	I32TOBUF(scan_cnt, p, 0);
+	p[4] = sensor_mask;
+	for(int i=0; i<4; i++)
+	{
+		U64TOBUF(stamps->spi[i], p, 5+8*i);
+		U64TOBUF(stamps->processed[i], p, 37+8*i);
+	}
+	U64TOBUF(stamps->published, p, 69);
+	U64TOBUF(stamps->consumed, p, 77);
+	U64TOBUF(lat_now_ns(), p, 85);
+
+	tcp_send(buf, hl+TIMING_LEN);
+}
+
+/*
+	Message codecs: the types string of a tcp_message_t is compiled, on first use, into runs of fields of the
+	same size. The wire format is the packed struct with every field big endian, so a run is either copied
+	as is (bytes) or byte swapped field by field; the same ops both decode and encode.
+	Returns 0, or -1 if the types string is invalid, needs more than TCP_CODEC_MAX_OPS runs, or doesn't add up
+	to the message size.
+*/
+static int compile_codec(tcp_message_t* msg_type)
+{
+	if(msg_type->n_ops)
+		return (msg_type->n_ops > 0) ? 0 : -1;
+
+	int n_ops = 0, size = 0;
+	for(const char* t = msg_type->types; *t; t++)
+	{
+		int field_size;
+		switch(*t)
+		{
+			case 'b': case 'B': field_size = 1; break;
+			case 's': case 'S': field_size = 2; break;
+			case 'i': case 'I': field_size = 4; break;
+			case 'l': case 'L': field_size = 8; break;
+			default:
+				fprintf(stderr, "ERROR: message 0x%02x: type string has invalid character 0x%02x\n", msg_type->mid, *t);
+				msg_type->n_ops = -1;
+				return -1;
 		}
 
-		// Read as much data as the size field shows.
-		if(bytes_left)
+		if(n_ops && msg_type->ops[n_ops-1].field_size == field_size && msg_type->ops[n_ops-1].count < 255)
+			msg_type->ops[n_ops-1].count++;
+		else
 		{
-			ret = read(sock, p_buf, bytes_left);
-			if(ret < 0)
+			if(n_ops == TCP_CODEC_MAX_OPS)
 			{
-				fprintf(stderr, "ERROR: TCP stream read error %d (%s), closing socket.\n", errno, strerror(errno));
-				tcp_comm_close();
-			}
-			else if(ret == 0)
-			{
-				fprintf(stderr, "ERROR: TCP stream read() returned 0 bytes even when it shoudln't, closing socket.\n");
-				tcp_comm_close();
-			}
-			else
-			{
-				bytes_left -= ret;
-				p_buf += ret;
+				fprintf(stderr, "ERROR: message 0x%02x: type string needs more than %d codec ops\n", msg_type->mid, TCP_CODEC_MAX_OPS);
+				msg_type->n_ops = -1;
+				return -1;
 			}
+			msg_type->ops[n_ops].field_size = field_size;
+			msg_type->ops[n_ops].count = 1;
+			n_ops++;
 		}
+		size += field_size;
+	}
 
-		if(bytes_left < 0)
-		{
-			fprintf(stderr, "ERROR: bytes_left < 0, closing socket.\n");
-			tcp_comm_close();
-			bytes_left = 0;
-		}
+	if(size != msg_type->size || n_ops == 0)
+	{
+		fprintf(stderr, "ERROR: message 0x%02x: type string is %d bytes, message size %d\n", msg_type->mid, size, msg_type->size);
+		msg_type->n_ops = -1;
+		return -1;
+	}
 
-		if(bytes_left == 0)
+	msg_type->n_ops = n_ops;
+	return 0;
+}
+
+// Converts between the wire format and the struct, either way (htobe and betoh are the same swap, or none)
+static void run_codec(const tcp_message_t* msg_type, uint8_t* dst, const uint8_t* src)
+{
+	for(int op=0; op<msg_type->n_ops; op++)
+	{
+		int n = msg_type->ops[op].count;
+		switch(msg_type->ops[op].field_size)
 		{
-			state = 0;
+			case 1:
+				memcpy(dst, src, n);
+				dst += n; src += n;
+			break;
 
-			if(!unrecog)
-			{
-				// Parse the message
-				uint8_t* p_src = buf;
-				void* p_dest = msg->p_data;
+			case 2:
+				for(int i=0; i<n; i++, dst+=2, src+=2)
+				{
+					uint16_t v; memcpy(&v, src, 2);
+					v = htobe16(v); memcpy(dst, &v, 2);
+				}
+			break;
 
-				if(p_dest == 0)
+			case 4:
+				for(int i=0; i<n; i++, dst+=4, src+=4)
 				{
-					fprintf(stderr, "ERROR: message parsing destination pointer NULL\n");
-					return -1;
+					uint32_t v; memcpy(&v, src, 4);
+					v = htobe32(v); memcpy(dst, &v, 4);
 				}
+			break;
 
-				for(int field=0;;field++)
+			case 8:
+				for(int i=0; i<n; i++, dst+=8, src+=8)
 				{
-					switch(msg->types[field])
-					{
-						case 'b':
-						case 'B':
-							*((uint8_t*)p_dest) = *(p_src++);
-							p_dest = ((uint8_t*)p_dest) + 1;
-						break;
-
-						case 's':
-						case 'S':
-						{
-							uint16_t tmp  = ((uint16_t)(*(p_src++))<<8);
-								 tmp |=  *(p_src++);
-							*((uint16_t*)p_dest) = tmp;
-							p_dest = ((uint16_t*)p_dest) + 1;
-						}
-						break;
-
-						case 'i':
-						case 'I':
-						{
-							uint32_t tmp  = ((uint32_t)(*(p_src++))<<24);
-								 tmp |= ((uint32_t)(*(p_src++))<<16);
-								 tmp |= ((uint32_t)(*(p_src++))<<8);
-								 tmp |=  *(p_src++);
-							*((uint32_t*)p_dest) = tmp;
-							p_dest = ((uint32_t*)p_dest) + 1;
-						}
-						break;
-
-						case 'l':
-						case 'L':
-						{
-							uint64_t tmp  = ((uint64_t)(*(p_src++))<<56);
-								 tmp |= ((uint64_t)(*(p_src++))<<48);
-								 tmp |= ((uint64_t)(*(p_src++))<<40);
-								 tmp |= ((uint64_t)(*(p_src++))<<32);
-								 tmp |= ((uint64_t)(*(p_src++))<<24);
-								 tmp |= ((uint64_t)(*(p_src++))<<16);
-								 tmp |= ((uint64_t)(*(p_src++))<<8);
-								 tmp |=  *(p_src++);
-							*((uint64_t*)p_dest) = tmp;
-							p_dest = ((uint64_t*)p_dest) + 1;
-						}
-						break;
-
-
-						case 0:
-							goto PARSE_END;
-
-						default:
-							fprintf(stderr, "ERROR: parse type string has invalid character 0x%02x\n", msg->types[field]);
-							return -2;
-
-					}
+					uint64_t v; memcpy(&v, src, 8);
+					v = htobe64(v); memcpy(dst, &v, 8);
 				}
+			break;
+		}
+	}
+}
 
-				PARSE_END: ;
-				return header.mid;
-			}
+// Compiles the codecs of the messages we receive, so that table errors show up at startup
+void tcp_parser_init()
+{
+	for(int i=0; i<NUM_CR_MSGS; i++)
+	{
+		compile_codec(CR_MSGS[i]);
+		if(CR_MSGS[i]->size > TCP_CR_MAX_SIZE)
+		{
+			fprintf(stderr, "ERROR: message 0x%02x is %d bytes, doesn't fit in the receive buffer (TCP_CR_MAX_SIZE %d)\n",
+				CR_MSGS[i]->mid, CR_MSGS[i]->size, TCP_CR_MAX_SIZE);
+			CR_MSGS[i]->n_ops = -1; // Skipped like an invalid one
 		}
+	}
+}
 
+int tcp_send_msg(tcp_message_t* msg_type, void* msg)
+{
+	if(compile_codec(msg_type) < 0)
+		return -2;
+
+	tcp_msg_t* out = tcp_msg_new(3, NULL, msg_type->size);
+	if(!out)
+	{
+		fprintf(stderr, "ERROR: Out of memory in tcp_send_msg\n");
+		return -1;
 	}
 
+	put_msg_header(out->hdr, msg_type->mid, msg_type->size);
+	run_codec(msg_type, out->buf, msg);
+	tcp_send_shared(out);
+
 	return 0;
 }
 
+/*
+	Reads what's available in the socket with one read(), and handles every complete message in the buffer:
+	recognized ones are decoded to their msg_cr_* struct and passed to cb, others are skipped.
+
+	Return value:
+	< 0: The connection is closed (-10) or broken (-11): close it.
+	>= 0: Number of messages handled.
+*/
+int tcp_parser(tcp_parser_state_t* ps, int sock, tcp_parser_cb_t cb, void* arg)
+{
+	int ret = read(sock, ps->buf + ps->wr, sizeof ps->buf - ps->wr);
+	if(ret < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		fprintf(stderr, "ERROR: TCP stream read error %d (%s)\n", errno, strerror(errno));
+		return -11;
+	}
+	else if(ret == 0)
+	{
+		fprintf(stderr, "Client closed connection\n");
+		return -10;
+	}
+	ps->wr += ret;
+
+	int n_msgs = 0;
+	while(1)
+	{
+		int avail = ps->wr - ps->rd;
+
+		if(ps->skip_left)
+		{
+			int n = (ps->skip_left < (uint32_t)avail) ? (int)ps->skip_left : avail;
+			ps->rd += n;
+			ps->skip_left -= n;
+			if(ps->skip_left)
+				break;
+			continue;
+		}
+
+		// Header: 3 bytes, or 7 for an extended frame
+		if(avail < 3)
+			break;
+		uint8_t* p = ps->buf + ps->rd;
+		int header_len = 3;
+		uint32_t size = ((uint32_t)p[1]<<8) | p[2];
+		if(size == TCP_EXT_SIZE)
+		{
+			if(avail < 7)
+				break;
+			header_len = 7;
+			size = ((uint32_t)p[3]<<24) | ((uint32_t)p[4]<<16) | ((uint32_t)p[5]<<8) | p[6];
+		}
+
+		tcp_message_t* msg = NULL;
+		for(int i=0; i<NUM_CR_MSGS; i++)
+		{
+			if(CR_MSGS[i]->mid == p[0])
+			{
+				msg = CR_MSGS[i];
+				break;
+			}
+		}
+
+		if(!msg || size != (uint32_t)msg->size || compile_codec(msg) < 0)
+		{
+			if(!msg)
+				fprintf(stderr, "WARN: Ignoring unrecognized message with msgid 0x%02x\n", p[0]);
+			else
+				fprintf(stderr, "WARN: Ignoring message with msgid 0x%02x because of size mismatch (got:%u, expected:%u)\n",
+					p[0], size, msg->size);
+			ps->rd += header_len;
+			ps->skip_left = size;
+			continue;
+		}
+
+		if(avail < header_len + (int)size)
+			break;
+
+		run_codec(msg, msg->p_data, p + header_len);
+		ps->rd += header_len + size;
+		n_msgs++;
+		if(cb)
+			cb(arg, msg->mid);
+	}
+
+	// Keep the partial message at the start of the buffer
+	if(ps->rd == ps->wr)
+		ps->rd = ps->wr = 0;
+	else if(ps->rd > 0)
+	{
+		memmove(ps->buf, ps->buf + ps->rd, ps->wr - ps->rd);
+		ps->wr -= ps->rd;
+		ps->rd = 0;
+	}
+
+	return n_msgs;
+}
@@ -22,6 +22,11 @@
 #ifndef TCP_PARSER_H
 #define TCP_PARSER_H
 
+#include <stdint.h>
+#include "pulutof.h"
+
+#define TCP_CODEC_MAX_OPS 32 // Field size changes in one types string (runs over 255 fields take more)
+
 typedef struct
 {
 	// Where to write when receiving. This field is ignored for tx. 
@@ -32,7 +37,7 @@ typedef struct
 	// Number of bytes of data expected / sent
 	int size;
 	// Zero-terminated string: Interpretation of the bytes:
-	char types[32]; 
+	const char* types;
 	/*
 		'b' int8_t
 		'B' uint8_t
@@ -44,8 +49,23 @@ typedef struct
 		'L' uint64_t
 	*/
 	int ret;
+
+	// Compiled from types on first use: runs of count fields of field_size bytes. 0 = not yet, -1 = invalid.
+	int n_ops;
+	struct { uint8_t field_size; uint8_t count; } ops[TCP_CODEC_MAX_OPS];
 } tcp_message_t;
 
+#define TCP_CR_MAX_SIZE 32 // Largest message we accept (the tcp_cr_*_t below), checked in tcp_parser_init()
+
+// Receive state of one connection: messages may arrive over several reads, and one read may have many.
+// Anything bigger than an accepted message is skipped, so the buffer only needs to fit one of those.
+typedef struct
+{
+	uint8_t buf[7+TCP_CR_MAX_SIZE]; // Extended header + message
+	int rd, wr;         // Unparsed data is buf[rd..wr-1]
+	uint32_t skip_left; // Bytes still to be discarded of an ignored message
+} tcp_parser_state_t;
+
 
 #define TCP_CR_MAINTENANCE_MID    62
 typedef struct __attribute__ ((packed))
@@ -56,16 +76,89 @@ typedef struct __attribute__ ((packed))
 
 extern tcp_cr_maintenance_t   msg_cr_maintenance;
 
+#define TCP_CR_HMAP_LEVEL_MID     63
+typedef struct __attribute__ ((packed))
+{
+	uint8_t level; // 0 = full resolution objmap, 1..3 = objmap pyramid level
+} tcp_cr_hmap_level_t;
+
+extern tcp_cr_hmap_level_t    msg_cr_hmap_level;
+
+/*
+	Per-client subscription. Until a client sends one, it gets everything the command line enables, the hmap,
+	elevmap and pictures on every 4th scan (raw tof pictures as ids 100 and 101, of the sensor selected in main).
+	With a subscription, it gets exactly the subscribed types, each on every div[type]th scan; div 0 = only on
+	snapshots. Amplitude pictures are sent as id TCP_AMPL_PICTURE_ID+sensor for each sensor in sensors, and the
+	depth picture (id 100) when its sensor is in sensors. snapshot = 1 sends every subscribed type once, with
+	the first scan that has it. Elevmap, objlist and raw depth are only generated when the command line or some subscription asks for them.
+*/
+#define TCP_CR_SUBSCRIBE_MID      64
+
+#define TCP_SUB_HMAP     0 // At the level set with TCP_CR_HMAP_LEVEL_MID
+#define TCP_SUB_ELEVMAP  1
+#define TCP_SUB_OBJLIST  2
+#define TCP_SUB_DEPTH    3
+#define TCP_SUB_AMPL     4
+#define TCP_SUB_HMAP_DELTA 5 // Run-length coded keyframes and deltas, see tcp_send_hmap_delta()
+#define TCP_SUB_POINTCLOUD 6 // See tcp_send_pointcloud(); options in flags
+#define TCP_SUB_N_TYPES  7
+
+#define TCP_SUB_FLAG_PC_PER_SENSOR 1 // One point cloud message per sensor instead of one for the whole scan
+#define TCP_SUB_FLAG_PC_AMPL       2 // With the amplitude of each point
+#define TCP_SUB_FLAG_TIMING        4 // A TCP_RC_TIMING_MID message before the messages of each scan, see tcp_send_timing()
+#define TCP_SUB_FLAG_PC_ORGANIZED  8 // Organized clouds with normals per sensor instead, see tcp_send_organized()
+
+#define TCP_AMPL_PICTURE_ID 110
+
+typedef struct __attribute__ ((packed))
+{
+	uint8_t types;   // Bit (1<<TCP_SUB_*) per subscribed type
+	uint8_t sensors; // Raw tof pictures: bit n = sensor n
+	uint8_t div[TCP_SUB_N_TYPES];
+	uint8_t snapshot;
+	uint8_t flags;   // TCP_SUB_FLAG_*
+} tcp_cr_subscribe_t;
+
+extern tcp_cr_subscribe_t     msg_cr_subscribe;
+
+/*
+	Message framing: uint8_t mid, uint16_t size of the payload that follows. Payloads of 65535 bytes and more
+	use an extended frame: size = TCP_EXT_SIZE, then the real size as uint32_t. Everything is big endian.
+*/
+#define TCP_EXT_SIZE 0xffff
+
 #define TCP_RC_HMAP_MID             138
+#define TCP_RC_HMAP_PACKED_MID      139
+#define TCP_RC_HMAP_LEVEL_MID       140
+#define TCP_RC_ELEVMAP_MID          141
+#define TCP_RC_OBJLIST_MID          144
+#define TCP_RC_HMAP_DELTA_MID       145
+#define TCP_RC_POINTCLOUD_MID       146
+#define TCP_RC_TIMING_MID           147
+#define TCP_RC_ORGANIZED_MID        148
 #define TCP_RC_PICTURE_MID	    142
+#define TCP_RC_PICTURE_PACKED_MID   143
+
 
+// Called for each message received; its data is in the message's msg_cr_* struct until the next one.
+typedef void (*tcp_parser_cb_t)(void* arg, int mid);
 
-int tcp_parser(int sock);
+void tcp_parser_init();
+int tcp_parser(tcp_parser_state_t* ps, int sock, tcp_parser_cb_t cb, void* arg);
 
 int tcp_send_msg(tcp_message_t* msg_type, void* msg);
 
 void tcp_send_picture(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, uint8_t *pict);
+void tcp_send_picture_packed(int16_t id, uint8_t bytes_per_pixel, int xs, int ys, const void *pict);
 void tcp_send_hmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int8_t *hmap);
+void tcp_send_hmap_level(int level, int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int8_t *hmap);
+void tcp_send_elevmap(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, const tof3d_elev_t *elevmap);
+void tcp_send_objlist(int32_t ang, int xorig_mm, int yorig_mm, int n_objects, const tof3d_object_t *objects);
+void tcp_send_hmap_delta(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, const int8_t *hmap);
+void tcp_send_pointcloud(const tof3d_scan_t *scan, int sensor, int with_ampl);
+void tcp_send_organized(const tof3d_scan_t *scan, int sensor);
+void tcp_send_timing(uint32_t scan_cnt, int sensor_mask, const tof3d_stamps_t *stamps);
+void tcp_send_hmap_packed(int xsamps, int ysamps, int32_t ang, int xorig_mm, int yorig_mm, int unit_size_mm, int tile_size, uint8_t *packed, int packed_len);
 
 
 #endif
@@ -0,0 +1,125 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Temporal depth filter, see tempfilt.h
+
+	The per-pixel loops are written branch-free on plain arrays so that they vectorize
+	(uint16 min/max for the median, uint32 add/sub and float divide for the mean).
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pulutof.h"
+#include "tempfilt.h"
+
+void tempfilt_reset(tempfilt_t* tf)
+{
+	tf->n = 0;
+	tf->head = 0;
+	memset(tf->sum, 0, sizeof tf->sum);
+	memset(tf->cnt, 0, sizeof tf->cnt);
+}
+
+static int moved(pos_t a, pos_t b)
+{
+	int32_t dang = (int32_t)((uint32_t)a.ang - (uint32_t)b.ang); // Wraps around correctly
+	return abs(a.x - b.x) > TEMPFILT_MAX_MOVE_MM || abs(a.y - b.y) > TEMPFILT_MAX_MOVE_MM ||
+	       dang > TEMPFILT_MAX_TURN || dang < -TEMPFILT_MAX_TURN;
+}
+
+static void median3(uint16_t* restrict out, const uint16_t* restrict a, const uint16_t* restrict b, const uint16_t* restrict c)
+{
+	for(int i=0; i<TOF_XS*TOF_YS; i++)
+	{
+		uint16_t lo = a[i] < b[i] ? a[i] : b[i];
+		uint16_t hi = a[i] < b[i] ? b[i] : a[i];
+		uint16_t m = hi < c[i] ? hi : c[i];
+		out[i] = lo > m ? lo : m;
+	}
+}
+
+// Replaces the oldest frame (in slot, if the history is full) with the new one in the running sums.
+static void mean_update(uint16_t* restrict depth, uint16_t* restrict slot, int full,
+	uint32_t* restrict sum, uint8_t* restrict cnt, int n)
+{
+	for(int i=0; i<TOF_XS*TOF_YS; i++)
+	{
+		uint16_t o = full ? slot[i] : 0;
+		uint16_t d = depth[i];
+		sum[i] += (uint32_t)d - (uint32_t)o;
+		cnt[i] += (d != 0) - (o != 0);
+		slot[i] = d;
+	}
+
+	for(int i=0; i<TOF_XS*TOF_YS; i++)
+	{
+		float c = cnt[i];
+		float avg = (float)sum[i] / (c > 0.0f ? c : 1.0f) + 0.5f;
+		depth[i] = (2*cnt[i] > n) ? (uint16_t)avg : 0;
+	}
+}
+
+/*
+	Filters the depth image of the frame in place, and stores it in the history. The first frames after a reset
+	(or a mode change) pass through, only partially filtered.
+*/
+void tempfilt_apply(tempfilt_t* tf, int mode, pulutof_frame_t* frame)
+{
+	uint16_t* depth = pulutof_frame_depth(frame);
+	pos_t pos = frame->robot_pos;
+
+	int k = (mode == TEMPFILT_MEDIAN3) ? 3 : mode;
+	if(mode == TEMPFILT_OFF || k < 2 || k > TEMPFILT_MAX_K)
+	{
+		tf->mode = TEMPFILT_OFF;
+		return;
+	}
+
+	if(mode != tf->mode || (tf->n > 0 && moved(pos, tf->ref_pos)))
+	{
+		tf->mode = mode;
+		tf->k = k;
+		tempfilt_reset(tf);
+	}
+
+	if(tf->n == 0)
+		tf->ref_pos = pos;
+
+	int full = tf->n == tf->k;
+	uint16_t* slot = tf->hist[tf->head];
+	if(!full)
+		tf->n++;
+
+	if(mode == TEMPFILT_MEDIAN3)
+	{
+		memcpy(slot, depth, sizeof tf->hist[0]);
+		if(tf->n == 3)
+			median3(depth, tf->hist[0], tf->hist[1], tf->hist[2]);
+	}
+	else
+	{
+		mean_update(depth, slot, full, tf->sum, tf->cnt, tf->n);
+	}
+
+	tf->head++; if(tf->head >= tf->k) tf->head = 0;
+}
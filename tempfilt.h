@@ -0,0 +1,61 @@
+/*
+	PULUROBOT PULUTOF-DEVKIT
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Host-side temporal depth filter: combines the last frames of one sensor, pixel by pixel.
+
+	Mean mode keeps running sums of the valid (nonzero) samples, so the cost per frame doesn't depend on
+	the history length; a pixel is output only when it's valid in the majority of the history.
+	Median mode is the median of the last 3 frames, which also removes single-frame dropouts and spikes.
+
+	Only valid while the sensor doesn't move: when the robot pose drifts away from the pose at the start
+	of the history, the history is restarted. The same goes for the sensor settings: the caller resets it
+	after an exposure change.
+*/
+
+#ifndef TEMPFILT_H
+#define TEMPFILT_H
+
+#include <stdint.h>
+
+#define TEMPFILT_MAX_K 8
+
+#define TEMPFILT_OFF     0
+#define TEMPFILT_MEDIAN3 -1
+// 2..TEMPFILT_MAX_K: mean of the last n frames
+
+#define TEMPFILT_MAX_MOVE_MM  10
+#define TEMPFILT_MAX_TURN     (11930465/2) // 0.5 degrees in pos_t ang units (2^32/360 per degree)
+
+typedef struct
+{
+	int mode;   // TEMPFILT_*, or the mean length
+	int k;      // History length
+	int n;      // Frames currently in the history
+	int head;   // Next history slot to write
+	pos_t ref_pos;
+
+	uint16_t hist[TEMPFILT_MAX_K][TOF_XS*TOF_YS];
+	uint32_t sum[TOF_XS*TOF_YS];
+	uint8_t  cnt[TOF_XS*TOF_YS];
+} tempfilt_t;
+
+void tempfilt_reset(tempfilt_t* tf);
+void tempfilt_apply(tempfilt_t* tf, int mode, pulutof_frame_t* frame);
+
+#endif